@@ -0,0 +1,339 @@
+// License blurb {{{
+
+/*
+    pgstata-bench - measures how fast the pgload plugin loads each type
+    Copyright (C) 2007 Andrew Chadwick
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License and the
+    GNU Lesser General Public License along with this program.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+// }}}
+// Library inclusions {{{
+
+/* For clock_gettime() and getopt() */
+#define _XOPEN_SOURCE 600
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libpq-fe.h>
+
+#include "stshim.h"
+
+// }}}
+// Settings and constants {{{
+
+/* Every table is made in this schema, which is dropped, with anything else
+ * in it, before and after a run. Don't point this at a database you care
+ * about. */
+
+#define BENCH_SCHEMA "pgstata_bench"
+#define BENCH_DEFAULT_ROWS 1000000
+#define BENCH_DEFAULT_WIDTH 16
+#define BENCH_DEFAULT_MODES "cursor,binary,stream"
+
+/* One column of each type pgstata_prepare() maps, as an expression of the
+ * row number i. "unknown" is a type with no mapping of its own, which loads
+ * as a string. */
+
+typedef struct _bench_type {
+    const char *name;
+    const char *expr;
+} bench_type;
+
+static const bench_type bench_types[] = {
+    { "int2",      "(i % 30000)::int2" },
+    { "int4",      "i::int4" },
+    { "int8",      "(i::int8 * 1000003)" },
+    { "float4",    "(i / 7.0)::float4" },
+    { "float8",    "(i / 7.0)::float8" },
+    { "numeric",   "(i / 100.0)::numeric(12,2)" },
+    { "date",      "date '2000-01-01' + i % 10000" },
+    { "timestamp", "timestamp '2000-01-01' + i * interval '1 second'" },
+    { "bool",      "(i % 2 = 0)" },
+    { "bpchar",    "lpad((i % 100000)::text, 10, 'x')::char(10)" },
+    { "text",      "md5(i::text)" },
+    { "unknown",   "(i * interval '1 minute')" },
+    { NULL, NULL }
+};
+
+// }}}
+// Helper funcs {{{
+
+static double
+bench_clock (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_exec (PGconn *conn, const char *sql)
+{
+    PGresult *res = PQexec(conn, sql);
+    int ok = (PQresultStatus(res) == PGRES_COMMAND_OK
+              || PQresultStatus(res) == PGRES_TUPLES_OK);
+    if (! ok) {
+        fprintf(stderr, "pgstata-bench: %s\n%s", sql, PQerrorMessage(conn));
+    }
+    PQclear(res);
+    return ok ? 0 : 1;
+}
+
+/*
+ * Makes table NAME of ROWS rows and WIDTH columns, each of them TYPE's
+ * expression, and analyzes it so that the plugin's row estimate is a fair
+ * one.
+ */
+
+static int
+bench_make_table (PGconn *conn, const char *name, const bench_type *type,
+                  const int rows, const int width)
+{
+    size_t len = 256 + strlen(name) + width * (strlen(type->expr) + 32);
+    char *sql = malloc(len);
+    int used, c, rc;
+    if (sql == NULL) {
+        fprintf(stderr, "pgstata-bench: out of memory\n");
+        return 1;
+    }
+    used = snprintf(sql, len, "CREATE TABLE " BENCH_SCHEMA ".%s AS SELECT ",
+                    name);
+    for (c=1; c<=width; ++c) {
+        used += snprintf(sql + used, len - used, "%s%s AS c%d",
+                         c > 1 ? ", " : "", type->expr, c);
+    }
+    snprintf(sql + used, len - used,
+             " FROM generate_series(1, %d) AS g(i)", rows);
+    rc = bench_exec(conn, sql);
+    if (rc == 0) {
+        snprintf(sql, len, "ANALYZE " BENCH_SCHEMA ".%s", name);
+        rc = bench_exec(conn, sql);
+    }
+    free(sql);
+    return rc;
+}
+
+/* The next space-separated word of *LIST, copied into BUF */
+
+static int
+bench_next_word (const char **list, char *buf, const size_t len)
+{
+    const char *p = *list;
+    size_t n = 0;
+    while (*p == ' ') {
+        ++p;
+    }
+    if (*p == '\000') {
+        return 0;
+    }
+    while (p[n] != '\000' && p[n] != ' ') {
+        ++n;
+    }
+    snprintf(buf, len, "%.*s", (int) n, p);
+    *list = p + n;
+    return 1;
+}
+
+static double
+bench_macro_num (const char *name)
+{
+    const char *val = stshim_macro(name);
+    return val != NULL ? atof(val) : 0;
+}
+
+// }}}
+// The load {{{
+
+/*
+ * Loads TABLE in mode MODE ("cursor", "binary" or "stream") the way the
+ * pgload ADO wrapper does, with Stata 13's string limits: make the variables
+ * prepare describes, grow the dataset ahead of each batch, and widen what
+ * populate_next asks to have widened. Puts the rows loaded, the bytes the
+ * plugin decoded and the wall-clock time taken into ROWS, BYTES and SECS.
+ */
+
+static int
+bench_load (const char *conninfo, const char *table, const char *mode,
+            double *rows, double *bytes, double *secs)
+{
+    char sql[256], strlfile[64], strlopt[80];
+    char name[64], type[16];
+    const char *vars, *types, *recast;
+    int capacity, obs, estimate, rc;
+    const char *mode_opt = strcmp(mode, "cursor") == 0 ? "" : mode;
+    const double started = bench_clock();
+
+    snprintf(sql, sizeof(sql), "SELECT * FROM " BENCH_SCHEMA ".%s", table);
+    snprintf(strlfile, sizeof(strlfile), "/tmp/pgstata-bench-XXXXXX");
+    close(mkstemp(strlfile));
+    snprintf(strlopt, sizeof(strlopt), "strlfile=%s", strlfile);
+
+    stshim_clear();
+    stshim_call("profile", "start", NULL);
+    if ((rc = stshim_call("connect", conninfo, "", NULL)) != 0) {
+        goto DONE;
+    }
+    rc = stshim_call("prepare", sql, "", mode_opt, "maxstr=2045", "strl",
+                     NULL);
+    if (rc != 0) {
+        stshim_call("disconnect", "", NULL);
+        goto DONE;
+    }
+
+    vars = stshim_macro("_vars");
+    types = stshim_macro("_types");
+    while (bench_next_word(&vars, name, sizeof(name))
+           && bench_next_word(&types, type, sizeof(type))) {
+        stshim_add_var(name, type);
+    }
+
+    capacity = 0;
+    estimate = (int) bench_macro_num("_estimate");
+    while (rc == 0) {
+        obs = (int) bench_macro_num("_obs");
+        if (obs > capacity) {
+            capacity = capacity + (capacity + 1) / 2;
+            capacity = capacity > obs ? capacity : obs;
+            capacity = capacity > estimate ? capacity : estimate;
+            estimate = 0;
+            if (stshim_set_obs(capacity) != 0) {
+                fprintf(stderr, "pgstata-bench: out of memory\n");
+                rc = 909;
+                break;
+            }
+        }
+        rc = stshim_call("populate_next", "", strlopt, NULL);
+        recast = stshim_macro("_recast");
+        while (rc == 0 && recast != NULL
+               && bench_next_word(&recast, name, sizeof(name))
+               && bench_next_word(&recast, type, sizeof(type))) {
+            stshim_recast(name, type);
+        }
+    }
+    rc = rc == 1 ? 0 : rc;
+    stshim_call("disconnect", "", NULL);
+
+DONE:
+    *secs = bench_clock() - started;
+    stshim_call("profile", "finish", NULL);
+    *rows = bench_macro_num("_prof_rows");
+    *bytes = bench_macro_num("_prof_bytes");
+    unlink(strlfile);
+    return rc;
+}
+
+// }}}
+// Main {{{
+
+static void
+bench_usage (void)
+{
+    fprintf(stderr,
+            "usage: pgstata-bench [-n ROWS] [-w WIDTH] [-m MODES] [-v] "
+            "CONNINFO\n"
+            "  Loads a table of each type, of 1 and WIDTH columns, in each of "
+            "MODES\n"
+            "  (default " BENCH_DEFAULT_MODES "), and reports rows/s and MB/s."
+            "\n  Creates and drops the schema " BENCH_SCHEMA ".\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    int nrows = BENCH_DEFAULT_ROWS;
+    int width = BENCH_DEFAULT_WIDTH;
+    const char *modes = BENCH_DEFAULT_MODES;
+    int verbose = 0;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "n:w:m:v")) != -1) {
+        switch (opt) {
+            case 'n': nrows = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'm': modes = optarg; break;
+            case 'v': verbose = 1; break;
+            default:  bench_usage(); return 2;
+        }
+    }
+    if (optind != argc - 1 || nrows < 1 || width < 1) {
+        bench_usage();
+        return 2;
+    }
+    const char *conninfo = argv[optind];
+
+    PGconn *conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        fprintf(stderr, "pgstata-bench: %s", PQerrorMessage(conn));
+        PQfinish(conn);
+        return 1;
+    }
+    if (bench_exec(conn, "SET client_min_messages = warning")
+        || bench_exec(conn, "DROP SCHEMA IF EXISTS " BENCH_SCHEMA " CASCADE")
+        || bench_exec(conn, "CREATE SCHEMA " BENCH_SCHEMA)) {
+        PQfinish(conn);
+        return 1;
+    }
+
+    stshim_init();
+    stshim_quiet(! verbose);
+    printf("%-10s %5s %-7s %10s %9s %8s %12s %8s\n", "type", "cols", "mode",
+           "rows", "MB", "secs", "rows/s", "MB/s");
+
+    const bench_type *type;
+    for (type=bench_types; type->name != NULL && ! failed; ++type) {
+        int widths[2] = { 1, width };
+        int w;
+        for (w=0; w<(width > 1 ? 2 : 1) && ! failed; ++w) {
+            char table[64];
+            snprintf(table, sizeof(table), "t_%s_%d", type->name, widths[w]);
+            if (bench_make_table(conn, table, type, nrows, widths[w])) {
+                failed = 1;
+                break;
+            }
+
+            char mode[16];
+            const char *mode_list = modes;
+            while (*mode_list != '\000') {
+                size_t n = strcspn(mode_list, ",");
+                snprintf(mode, sizeof(mode), "%.*s", (int) n, mode_list);
+                mode_list += n + (mode_list[n] == ',');
+
+                double rows, bytes, secs;
+                if (bench_load(conninfo, table, mode, &rows, &bytes, &secs)) {
+                    fprintf(stderr, "pgstata-bench: loading %s in %s mode "
+                            "failed: %s", table, mode, stshim_last_error());
+                    failed = 1;
+                    break;
+                }
+                printf("%-10s %5d %-7s %10.0f %9.1f %8.3f %12.0f %8.1f\n",
+                       type->name, widths[w], mode, rows, bytes / 1e6, secs,
+                       secs > 0 ? rows / secs : 0,
+                       secs > 0 ? bytes / 1e6 / secs : 0);
+                fflush(stdout);
+            }
+        }
+    }
+
+    bench_exec(conn, "DROP SCHEMA IF EXISTS " BENCH_SCHEMA " CASCADE");
+    PQfinish(conn);
+    return failed;
+}
+
+// }}}
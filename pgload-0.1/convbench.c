@@ -0,0 +1,474 @@
+// License blurb {{{
+
+/*
+    pgconv-bench - micro-benchmarks of the pgload plugin's value decoders
+    Copyright (C) 2007 Andrew Chadwick
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License and the
+    GNU Lesser General Public License along with this program.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+// }}}
+// Library inclusions {{{
+
+/* For clock_gettime() and getopt() */
+#define _XOPEN_SOURCE 600
+#include <time.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgconv.h"
+
+// }}}
+// Settings and constants {{{
+
+/* Each benchmark decodes a corpus of CORPUS_VALUES values, over and over,
+ * until it has run for at least the minimum time (-t, in seconds). Like
+ * Google Benchmark, it starts with one pass and multiplies the number of
+ * passes until a run is long enough to time. */
+
+#define CONVBENCH_CORPUS_VALUES 4096
+#define CONVBENCH_MIN_SECS 0.5
+
+/* strN values are clipped at Stata 9 to 12's limit */
+
+#define CONVBENCH_CLIP_LEN 244
+
+// }}}
+// Corpora {{{
+
+// NVALUES values, value I being the LENS[I] bytes at TEXT + OFFSETS[I],
+// each followed by a NUL as libpq's text values are
+typedef struct _convbench_corpus {
+    char   *text;
+    size_t  text_len;
+    size_t  used;
+    int    *offsets;
+    int    *lens;
+    int     nvalues;
+    size_t  bytes;
+} convbench_corpus;
+
+typedef void (*convbench_gen) (char *buf, int *len, const int i);
+
+typedef struct _convbench {
+    const char      *name;
+    pgstata_decoder  decode;
+    convbench_gen    gen;
+} convbench;
+
+static uint64_t convbench_state = UINT64_C(0x9E3779B97F4A7C15);
+
+static uint64_t
+convbench_rand (void)
+{
+    convbench_state ^= convbench_state >> 12;
+    convbench_state ^= convbench_state << 25;
+    convbench_state ^= convbench_state >> 27;
+    return convbench_state * UINT64_C(2685821657736338717);
+}
+
+static void
+convbench_put_be (char *buf, uint64_t val, const int n)
+{
+    int i;
+    for (i=n-1; i>=0; --i) {
+        buf[i] = (char) (val & 0xFF);
+        val >>= 8;
+    }
+}
+
+static void
+gen_int4_text (char *buf, int *len, const int i)
+{
+    const int32_t v = (int32_t) convbench_rand() >> (convbench_rand() % 31);
+    *len = sprintf(buf, "%d", (int) v);
+}
+
+static void
+gen_int8_text (char *buf, int *len, const int i)
+{
+    *len = sprintf(buf, "%lld", (long long) (int64_t) convbench_rand());
+}
+
+static void
+gen_float8_text (char *buf, int *len, const int i)
+{
+    const double v = (double) (convbench_rand() >> 11) / (1 << 20)
+                     * (convbench_rand() & 1 ? 1 : -1);
+    *len = sprintf(buf, "%.17g", v);
+}
+
+static void
+gen_price_text (char *buf, int *len, const int i)
+{
+    *len = sprintf(buf, "%d.%02d", (int) (convbench_rand() % 100000),
+                   (int) (convbench_rand() % 100));
+}
+
+static void
+gen_long_numeric_text (char *buf, int *len, const int i)
+{
+    *len = sprintf(buf, "%llu%09u.%llu",
+                   (unsigned long long) (convbench_rand() >> 4),
+                   (unsigned) (convbench_rand() % 1000000000),
+                   (unsigned long long) (convbench_rand() >> 4));
+}
+
+static void
+gen_bool_text (char *buf, int *len, const int i)
+{
+    *len = sprintf(buf, "%s", convbench_rand() & 1 ? "t" : "f");
+}
+
+// Panel data sorted by date: a few hundred dates, each for a run of rows
+static void
+gen_date_text_repeated (char *buf, int *len, const int i)
+{
+    const int k = (i / 16) % 250;
+    *len = sprintf(buf, "%04d-%02d-%02d", 1990 + k / 12, 1 + k % 12, 28);
+}
+
+static void
+gen_date_text (char *buf, int *len, const int i)
+{
+    *len = sprintf(buf, "%04d-%02d-%02d",
+                   1800 + (int) (convbench_rand() % 400),
+                   1 + (int) (convbench_rand() % 12),
+                   1 + (int) (convbench_rand() % 28));
+}
+
+static void
+gen_timestamp_text (char *buf, int *len, const int i)
+{
+    *len = sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d.%06d",
+                   1970 + (int) (convbench_rand() % 60),
+                   1 + (int) (convbench_rand() % 12),
+                   1 + (int) (convbench_rand() % 28),
+                   (int) (convbench_rand() % 24),
+                   (int) (convbench_rand() % 60),
+                   (int) (convbench_rand() % 60),
+                   (int) (convbench_rand() % 1000000));
+}
+
+static void
+gen_timestamptz_text (char *buf, int *len, const int i)
+{
+    gen_timestamp_text(buf, len, i);
+    *len += sprintf(buf + *len, "+05:30");
+}
+
+static void
+gen_bool_binary (char *buf, int *len, const int i)
+{
+    buf[0] = (char) (convbench_rand() & 1);
+    *len = 1;
+}
+
+static void
+gen_int2_binary (char *buf, int *len, const int i)
+{
+    convbench_put_be(buf, convbench_rand(), 2);
+    *len = 2;
+}
+
+static void
+gen_int4_binary (char *buf, int *len, const int i)
+{
+    convbench_put_be(buf, convbench_rand(), 4);
+    *len = 4;
+}
+
+static void
+gen_int8_binary (char *buf, int *len, const int i)
+{
+    convbench_put_be(buf, convbench_rand(), 8);
+    *len = 8;
+}
+
+static void
+gen_float4_binary (char *buf, int *len, const int i)
+{
+    union {
+        uint32_t i;
+        float    f;
+    } f4;
+    f4.f = (float) (convbench_rand() >> 40) / 1024;
+    convbench_put_be(buf, f4.i, 4);
+    *len = 4;
+}
+
+static void
+gen_float8_binary (char *buf, int *len, const int i)
+{
+    union {
+        uint64_t i;
+        double   d;
+    } f8;
+    f8.d = (double) (convbench_rand() >> 11) / (1 << 20);
+    convbench_put_be(buf, f8.i, 8);
+    *len = 8;
+}
+
+// A binary NUMERIC of NDIGITS random base-10000 digits, the first of weight
+// WEIGHT
+static void
+put_numeric_binary (char *buf, int *len, const int ndigits, const int weight,
+                    const int dscale)
+{
+    int k;
+    convbench_put_be(buf, (uint64_t) ndigits, 2);
+    convbench_put_be(buf + 2, (uint64_t) weight, 2);
+    convbench_put_be(buf + 4, convbench_rand() & 1 ? 0x4000 : 0, 2);
+    convbench_put_be(buf + 6, (uint64_t) dscale, 2);
+    for (k=0; k<ndigits; ++k) {
+        convbench_put_be(buf + 8 + 2 * k, 1 + convbench_rand() % 9999, 2);
+    }
+    *len = 8 + 2 * ndigits;
+}
+
+// Prices and amounts of up to eight digits and four decimals, as
+// numeric(12,4): 12345.67 is 1 2345 6700
+static void
+gen_price_binary (char *buf, int *len, const int i)
+{
+    put_numeric_binary(buf, len, 2 + (int) (convbench_rand() % 2), 1, 4);
+}
+
+// More digits than the fast path takes
+static void
+gen_long_numeric_binary (char *buf, int *len, const int i)
+{
+    put_numeric_binary(buf, len, 8, 4, 16);
+}
+
+static void
+gen_date_binary (char *buf, int *len, const int i)
+{
+    convbench_put_be(buf, (uint64_t) (convbench_rand() % 200000) - 100000, 4);
+    *len = 4;
+}
+
+static void
+gen_timestamp_binary (char *buf, int *len, const int i)
+{
+    convbench_put_be(buf, convbench_rand() >> 8, 8);
+    *len = 8;
+}
+
+// Strings of two- and three-byte characters, longer than a strN holds
+static void
+gen_utf8_string (char *buf, int *len, const int i)
+{
+    static const char *chars[] = { "a", "\xC3\xA9", "\xE2\x82\xAC", "z" };
+    *len = 0;
+    while (*len < CONVBENCH_CLIP_LEN + 40) {
+        *len += sprintf(buf + *len, "%s", chars[convbench_rand() % 4]);
+    }
+}
+
+static int
+decode_utf8_clip (const char *val, const int len, double *out)
+{
+    *out = pgstata_utf8_clip(val, len, CONVBENCH_CLIP_LEN);
+    return 0;
+}
+
+static const convbench convbench_list[] = {
+    { "int4_text",          pgstata_decode_int_text,         gen_int4_text },
+    { "int8_text",          pgstata_decode_int_text,         gen_int8_text },
+    { "float8_text",        pgstata_decode_float_text,       gen_float8_text },
+    { "numeric_text/price", pgstata_decode_float_text,       gen_price_text },
+    { "numeric_text/long",  pgstata_decode_float_text,
+                            gen_long_numeric_text },
+    { "bool_text",          pgstata_decode_bool_text,        gen_bool_text },
+    { "date_text",          pgstata_decode_date_text,        gen_date_text },
+    { "date_text/repeated", pgstata_decode_date_text,
+                            gen_date_text_repeated },
+    { "timestamp_text",     pgstata_decode_timestamp_text,
+                            gen_timestamp_text },
+    { "timestamptz_text",   pgstata_decode_timestamp_text,
+                            gen_timestamptz_text },
+    { "bool_binary",        pgstata_decode_bool_binary,      gen_bool_binary },
+    { "int2_binary",        pgstata_decode_int2_binary,      gen_int2_binary },
+    { "int4_binary",        pgstata_decode_int4_binary,      gen_int4_binary },
+    { "int8_binary",        pgstata_decode_int8_binary,      gen_int8_binary },
+    { "float4_binary",      pgstata_decode_float4_binary,
+                            gen_float4_binary },
+    { "float8_binary",      pgstata_decode_float8_binary,
+                            gen_float8_binary },
+    { "numeric_binary/price", pgstata_decode_numeric_binary,
+                            gen_price_binary },
+    { "numeric_binary/checked", pgstata_decode_numeric_binary_checked,
+                            gen_price_binary },
+    { "numeric_binary/long", pgstata_decode_numeric_binary,
+                            gen_long_numeric_binary },
+    { "date_binary",        pgstata_decode_date_binary,      gen_date_binary },
+    { "timestamp_binary",   pgstata_decode_timestamp_binary,
+                            gen_timestamp_binary },
+    { "utf8_clip",          decode_utf8_clip,                gen_utf8_string },
+    { NULL, NULL, NULL }
+};
+
+static int
+convbench_make_corpus (convbench_corpus *corpus, const convbench_gen gen)
+{
+    char buf[512];
+    int i, len;
+    memset(corpus, 0, sizeof(*corpus));
+    corpus->text_len = 64 * CONVBENCH_CORPUS_VALUES;
+    corpus->text = malloc(corpus->text_len);
+    corpus->offsets = malloc(CONVBENCH_CORPUS_VALUES * sizeof(int));
+    corpus->lens = malloc(CONVBENCH_CORPUS_VALUES * sizeof(int));
+    if (corpus->text == NULL || corpus->offsets == NULL
+        || corpus->lens == NULL) {
+        return 1;
+    }
+    for (i=0; i<CONVBENCH_CORPUS_VALUES; ++i) {
+        gen(buf, &len, i);
+        if (corpus->used + len + 1 > corpus->text_len) {
+            char *grown = realloc(corpus->text, 2 * corpus->text_len);
+            if (grown == NULL) {
+                return 1;
+            }
+            corpus->text = grown;
+            corpus->text_len *= 2;
+        }
+        memcpy(corpus->text + corpus->used, buf, len);
+        corpus->text[corpus->used + len] = '\000';
+        corpus->offsets[i] = (int) corpus->used;
+        corpus->lens[i] = len;
+        corpus->used += len + 1;
+        corpus->bytes += len;
+    }
+    corpus->nvalues = CONVBENCH_CORPUS_VALUES;
+    return 0;
+}
+
+static void
+convbench_free_corpus (convbench_corpus *corpus)
+{
+    free(corpus->text);
+    free(corpus->offsets);
+    free(corpus->lens);
+}
+
+// }}}
+// Timing {{{
+
+static double
+convbench_clock (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Where results go, so that the decoding can't be optimised away
+volatile double convbench_sink;
+
+static double
+convbench_run (const convbench *bench, const convbench_corpus *corpus,
+               const long passes)
+{
+    const double started = convbench_clock();
+    double sum = 0, out;
+    long pass;
+    int i;
+    for (pass=0; pass<passes; ++pass) {
+        for (i=0; i<corpus->nvalues; ++i) {
+            if (bench->decode(corpus->text + corpus->offsets[i],
+                              corpus->lens[i], &out) >= 0) {
+                sum += out;
+            }
+        }
+    }
+    convbench_sink = sum;
+    return convbench_clock() - started;
+}
+
+// }}}
+// Main {{{
+
+static void
+convbench_usage (void)
+{
+    fprintf(stderr,
+            "usage: pgconv-bench [-t SECS] [FILTER]\n"
+            "  Times each of pgconv.c's decoders, or those whose names "
+            "contain FILTER,\n"
+            "  for at least SECS seconds each (default %g).\n",
+            CONVBENCH_MIN_SECS);
+}
+
+int
+main (int argc, char **argv)
+{
+    double min_secs = CONVBENCH_MIN_SECS;
+    const char *filter = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't': min_secs = atof(optarg); break;
+            default:  convbench_usage(); return 2;
+        }
+    }
+    if (optind < argc - 1) {
+        convbench_usage();
+        return 2;
+    }
+    if (optind == argc - 1) {
+        filter = argv[optind];
+    }
+
+    printf("%-22s %12s %14s %12s %11s\n", "Benchmark", "Time", "Iterations",
+           "Values/s", "Bytes/s");
+    printf("------------------------------------------------------------"
+           "--------------\n");
+
+    const convbench *bench;
+    for (bench=convbench_list; bench->name != NULL; ++bench) {
+        convbench_corpus corpus;
+        if (filter != NULL && strstr(bench->name, filter) == NULL) {
+            continue;
+        }
+        if (convbench_make_corpus(&corpus, bench->gen)) {
+            fprintf(stderr, "pgconv-bench: out of memory\n");
+            convbench_free_corpus(&corpus);
+            return 1;
+        }
+
+        long passes = 1;
+        double secs = convbench_run(bench, &corpus, passes);
+        while (secs < min_secs) {
+            double scale = secs > 0 ? 1.4 * min_secs / secs : 10;
+            passes = (long) (passes * (scale < 10 ? scale : 10)) + 1;
+            secs = convbench_run(bench, &corpus, passes);
+        }
+
+        const double values = (double) passes * corpus.nvalues;
+        printf("%-22s %9.2f ns %14.0f %10.1f M %8.1f MB\n", bench->name,
+               secs / values * 1e9, values, values / secs / 1e6,
+               (double) passes * corpus.bytes / secs / 1e6);
+        convbench_free_corpus(&corpus);
+    }
+    return 0;
+}
+
+// }}}
@@ -0,0 +1,895 @@
+// License blurb {{{
+
+/*
+    pgconv-fuzz - differential fuzzing of the pgload plugin's value decoders
+    Copyright (C) 2007 Andrew Chadwick
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License and the
+    GNU Lesser General Public License along with this program.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+// }}}
+// Library inclusions {{{
+
+/* For getopt() */
+#define _XOPEN_SOURCE 600
+#include <time.h>
+#include <unistd.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgconv.h"
+
+// }}}
+// Settings and constants {{{
+
+/* Each round makes a random value of every type, encodes it the way the
+ * server does in text and in binary COPY form, and checks that each decoder
+ * gives what a slow, obviously correct reference gives, and that a value's
+ * text and binary forms decode alike. Some values are then mangled and fed
+ * to the text decoders, which must still agree with strtod() where it
+ * applies, and must not read outside the value (build with ASan to check).
+ *
+ * Dates run over the whole range Postgres allows, 4713 BC to 5874897 AD, and
+ * timestamps over 4713 BC to 294276 AD. */
+
+#define CONVFUZZ_DEFAULT_ROUNDS 1000000
+#define CONVFUZZ_MIN_JDN 0              // 1 Jan 4713 BC (Julian Day 0)
+#define CONVFUZZ_MAX_DATE_JDN 2147483494
+#define CONVFUZZ_MAX_TS_JDN 109203489   // 31 Dec 294276 AD
+#define CONVFUZZ_STATA_JDN 2436935      // 1 Jan 1960
+#define CONVFUZZ_PG_JDN 2451545         // 1 Jan 2000
+#define CONVFUZZ_USECS_PER_DAY INT64_C(86400000000)
+
+// }}}
+// Globals {{{
+
+uint64_t convfuzz_state;
+long     convfuzz_round;
+long     convfuzz_checks = 0;
+int      convfuzz_verbose = 0;
+
+// }}}
+// Helper funcs {{{
+
+static uint64_t
+convfuzz_rand (void)
+{
+    convfuzz_state ^= convfuzz_state >> 12;
+    convfuzz_state ^= convfuzz_state << 25;
+    convfuzz_state ^= convfuzz_state >> 27;
+    return convfuzz_state * UINT64_C(2685821657736338717);
+}
+
+// Uniform in [LO, HI]
+static int64_t
+convfuzz_range (const int64_t lo, const int64_t hi)
+{
+    const uint64_t span = (uint64_t) hi - (uint64_t) lo + 1;
+    return (int64_t) ((uint64_t) lo + convfuzz_rand() % span);
+}
+
+static void
+convfuzz_put_be (char *buf, uint64_t val, const int n)
+{
+    int i;
+    for (i=n-1; i>=0; --i) {
+        buf[i] = (char) (val & 0xFF);
+        val >>= 8;
+    }
+}
+
+static int
+convfuzz_same (const double a, const double b)
+{
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+/*
+ * Reports a decoder which disagrees with the reference, with the input in
+ * hex and the round, so that the failure can be replayed from the seed.
+ */
+
+static void
+convfuzz_fail (const char *what, const char *val, const int len,
+               const int rc, const double got, const int want_rc,
+               const double want)
+{
+    int i;
+    fprintf(stderr, "pgconv-fuzz: %s, round %ld: input \"", what,
+            convfuzz_round);
+    for (i=0; i<len; ++i) {
+        const unsigned char c = (unsigned char) val[i];
+        fprintf(stderr, c >= 0x20 && c < 0x7F && c != '"' ? "%c" : "\\x%02X",
+                c);
+    }
+    fprintf(stderr, "\" (%d bytes)\n  got %d, %.17g; want %d, %.17g\n",
+            len, rc, got, want_rc, want);
+    exit(1);
+}
+
+// Runs DECODE on a copy of VAL of exactly LEN bytes and a NUL, in a buffer
+// of its own so that ASan catches reads beyond it
+static int
+convfuzz_decode (const pgstata_decoder decode, const char *val,
+                 const int len, double *out)
+{
+    char *copy = malloc(len + 1);
+    int rc;
+    if (copy == NULL) {
+        fprintf(stderr, "pgconv-fuzz: out of memory\n");
+        exit(2);
+    }
+    memcpy(copy, val, len);
+    copy[len] = '\000';
+    *out = 0;
+    rc = decode(copy, len, out);
+    free(copy);
+    ++convfuzz_checks;
+    return rc;
+}
+
+static void
+convfuzz_check (const char *what, const pgstata_decoder decode,
+                const char *val, const int len, const int want_rc,
+                const double want)
+{
+    double got;
+    const int rc = convfuzz_decode(decode, val, len, &got);
+    if (rc != want_rc || (rc >= 0 && ! convfuzz_same(got, want))) {
+        convfuzz_fail(what, val, len, rc, got, want_rc, want);
+    }
+}
+
+// }}}
+// Reference implementations {{{
+
+/*
+ * These are written for clarity rather than speed, and differently from the
+ * decoders, so that the two are unlikely to share a mistake.
+ */
+
+// strtod(), with NaN and infinities missing, as the float decoders promise
+static int
+ref_double (const char *val, const int len, double *out)
+{
+    char *copy = malloc(len + 1);
+    char *end;
+    double value;
+    if (copy == NULL) {
+        exit(2);
+    }
+    memcpy(copy, val, len);
+    copy[len] = '\000';
+    value = strtod(copy, &end);
+    if (end == copy) {
+        free(copy);
+        return -1;
+    }
+    free(copy);
+    *out = isfinite(value) ? value : PGSTATA_MISSVAL;
+    return 0;
+}
+
+// Julian Day Number of a proleptic Gregorian date (Fliegel and Van Flandern)
+static int64_t
+ref_jdn (const int64_t year, const int64_t month, const int64_t day)
+{
+    const int64_t a = (14 - month) / 12;
+    const int64_t y = year + 4800 - a;
+    const int64_t m = month + 12 * a - 3;
+    return day + (153 * m + 2) / 5 + 365 * y + y / 4 - y / 100 + y / 400
+           - 32045;
+}
+
+// And back again (Richards), for JDN >= 0; YEAR is astronomical
+static void
+ref_civil (const int64_t jdn, int64_t *year, int *month, int *day)
+{
+    const int64_t f = jdn + 1401 + (((4 * jdn + 274277) / 146097) * 3) / 4
+                      - 38;
+    const int64_t e = 4 * f + 3;
+    const int64_t g = (e % 1461) / 4;
+    const int64_t h = 5 * g + 2;
+    *day = (int) ((h % 153) / 5 + 1);
+    *month = (int) ((h / 153 + 2) % 12 + 1);
+    *year = e / 1461 - 4716 + (12 + 2 - *month) / 12;
+}
+
+// The date as the server prints it in the ISO DateStyle
+static int
+ref_format_date (char *buf, const int64_t jdn)
+{
+    int64_t year;
+    int month, day;
+    ref_civil(jdn, &year, &month, &day);
+    if (year <= 0) {
+        return sprintf(buf, "%04lld-%02d-%02d BC", (long long) (1 - year),
+                       month, day);
+    }
+    return sprintf(buf, "%04lld-%02d-%02d", (long long) year, month, day);
+}
+
+/*
+ * The timestamp USECS microseconds after 1 Jan 2000 as the server prints it:
+ * shifted by OFFSET seconds and followed by it if TZ is set, fractional
+ * seconds without trailing zeros, and " BC" last.
+ */
+
+static int
+ref_format_timestamp (char *buf, const int64_t usecs, const int tz,
+                      const int offset)
+{
+    const int64_t local = usecs + offset * INT64_C(1000000);
+    int64_t days = local / CONVFUZZ_USECS_PER_DAY;
+    int64_t tod = local % CONVFUZZ_USECS_PER_DAY;
+    int64_t year;
+    int month, day, len;
+    if (tod < 0) {
+        tod += CONVFUZZ_USECS_PER_DAY;
+        --days;
+    }
+    ref_civil(days + CONVFUZZ_PG_JDN, &year, &month, &day);
+    len = sprintf(buf, "%04lld-%02d-%02d %02d:%02d:%02d",
+                  (long long) (year <= 0 ? 1 - year : year), month, day,
+                  (int) (tod / INT64_C(3600000000)),
+                  (int) (tod / 60000000 % 60), (int) (tod / 1000000 % 60));
+    if (tod % 1000000 != 0) {
+        len += sprintf(buf + len, ".%06d", (int) (tod % 1000000));
+        while (buf[len - 1] == '0') {
+            buf[--len] = '\000';
+        }
+    }
+    if (tz) {
+        const int abs_off = offset < 0 ? -offset : offset;
+        len += sprintf(buf + len, "%c%02d", offset < 0 ? '-' : '+',
+                       abs_off / 3600);
+        if (abs_off % 3600 != 0) {
+            len += sprintf(buf + len, ":%02d", abs_off / 60 % 60);
+        }
+        if (abs_off % 60 != 0) {
+            len += sprintf(buf + len, ":%02d", abs_off % 60);
+        }
+    }
+    if (year <= 0) {
+        len += sprintf(buf + len, " BC");
+    }
+    return len;
+}
+
+// %tc milliseconds of USECS microseconds after 1 Jan 2000, rounding down
+static double
+ref_timestamp_msecs (const int64_t usecs)
+{
+    int64_t msecs = usecs / 1000;
+    if (usecs % 1000 < 0) {
+        --msecs;
+    }
+    return (double) (msecs + (CONVFUZZ_PG_JDN - CONVFUZZ_STATA_JDN)
+                             * INT64_C(86400000));
+}
+
+// How much of a valid UTF-8 string of LEN bytes fits in MAX_LEN bytes,
+// counted a whole character at a time
+static int
+ref_utf8_clip (const char *val, const int len, const int max_len)
+{
+    int kept = 0;
+    if (max_len <= 0 || len <= max_len) {
+        return len;
+    }
+    while (kept < len) {
+        const unsigned char c = (unsigned char) val[kept];
+        const int n = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        if (kept + n > max_len) {
+            break;
+        }
+        kept += n;
+    }
+    return kept;
+}
+
+// The significant digits of decimal TEXT, which may have a sign, a point
+// and an exponent, without leading or trailing zeros, into DIGITS; TEXT is
+// 0.DIGITS x 10^*EXP10. Returns how many there are.
+static int
+ref_canon_decimal (const char *text, char *digits, int *exp10)
+{
+    char all[512];
+    int n = 0, point = -1, first = 0, last;
+    const char *p = text;
+    if (*p == '-' || *p == '+') {
+        ++p;
+    }
+    for (; (*p >= '0' && *p <= '9') || *p == '.'; ++p) {
+        if (*p == '.') {
+            point = n;
+        }
+        else if (n < (int) sizeof(all)) {
+            all[n++] = *p;
+        }
+    }
+    if (point < 0) {
+        point = n;
+    }
+    while (first < n && all[first] == '0') {
+        ++first;
+    }
+    last = n;
+    while (last > first && all[last - 1] == '0') {
+        --last;
+    }
+    memcpy(digits, all + first, last - first);
+    digits[last - first] = '\000';
+    *exp10 = point - first + (*p == 'e' || *p == 'E' ? atoi(p + 1) : 0);
+    return last - first;
+}
+
+// Whether VALUE, printed to as many significant digits as decimal TEXT has,
+// reads differently from TEXT, as the checked NUMERIC decoders promise.
+// Values beyond Stata's largest, and of too many digits to check, always do.
+static int
+ref_lossy (const char *text, const double value)
+{
+    char want[512], got[512], buf[128];
+    int want_exp, got_exp;
+    const int n = ref_canon_decimal(text, want, &want_exp);
+    if (n == 0) {
+        return 0;
+    }
+    if (fabs(value) >= PGSTATA_MISSVAL || n > PGSTATA_NUMERIC_CHECK_DIGITS) {
+        return 1;
+    }
+    snprintf(buf, sizeof(buf), "%.*e", n - 1, value);
+    ref_canon_decimal(buf, got, &got_exp);
+    return strcmp(want, got) != 0 || want_exp != got_exp;
+}
+
+// }}}
+// Value generators {{{
+
+// A double with a random bit pattern, a "nice" value, or a special one
+static double
+convfuzz_double (void)
+{
+    union {
+        uint64_t i;
+        double   d;
+    } bits;
+    switch (convfuzz_rand() % 6) {
+        case 0:
+            bits.i = convfuzz_rand();
+            return bits.d;
+        case 1:
+            return (double) convfuzz_range(-1000000, 1000000) / 100;
+        case 2:
+            return ldexp((double) (convfuzz_rand() >> 11),
+                         (int) convfuzz_range(-1100, 1000));
+        case 3:
+            return (double) (int64_t) convfuzz_rand()
+                   / pow(10, (double) convfuzz_range(0, 25));
+        case 4: {
+            static const double special[] = {
+                0.0, -0.0, 1.0, -1.0, 0.1, 1e22, 1e23, 9007199254740992.0,
+                9007199254740993.0, 4.9406564584124654e-324,
+                2.2250738585072014e-308, 1.7976931348623157e308, 0x1p1023
+            };
+            return special[convfuzz_rand() % (sizeof(special)
+                                              / sizeof(special[0]))];
+        }
+        default:
+            return (double) (float) ((double) (int32_t) convfuzz_rand()
+                                     / (1 << (convfuzz_rand() % 24)));
+    }
+}
+
+// A numeric as the server prints it: up to 40 digits either side of the
+// point, or NaN
+static int
+convfuzz_numeric (char *buf)
+{
+    int len = 0, i;
+    const int int_digits = (int) convfuzz_range(1, 40);
+    const int scale = (int) convfuzz_range(0, 40);
+    if (convfuzz_rand() % 50 == 0) {
+        return sprintf(buf, "NaN");
+    }
+    if (convfuzz_rand() & 1) {
+        buf[len++] = '-';
+    }
+    buf[len++] = (char) ('0' + (int_digits > 1 ? convfuzz_range(1, 9)
+                                               : convfuzz_range(0, 9)));
+    for (i=1; i<int_digits; ++i) {
+        buf[len++] = (char) ('0' + convfuzz_range(0, 9));
+    }
+    if (scale > 0) {
+        buf[len++] = '.';
+        for (i=0; i<scale; ++i) {
+            buf[len++] = (char) ('0' + convfuzz_range(0, 9));
+        }
+    }
+    buf[len] = '\000';
+    return len;
+}
+
+/*
+ * A binary NUMERIC of random base-10000 digits, into BUF, and the same value
+ * in decimal, for strtod(), into TEXT. Most have no leading or trailing zero
+ * digits, as the server sends them, and most fit the decoder's fast path;
+ * the rest reach far enough either way to overflow and underflow a double.
+ */
+static int
+convfuzz_numeric_binary (char *buf, char *text)
+{
+    static const uint16_t specials[] = { 0xC000, 0xD000, 0xF000 };
+    static const char *special_text[] = { "NaN", "Infinity", "-Infinity" };
+    int ndigits, weight, i, tlen = 0;
+    uint16_t sign = convfuzz_rand() & 1 ? 0x4000 : 0x0000;
+    switch (convfuzz_rand() % 4) {
+        case 0:  ndigits = (int) convfuzz_range(0, 4);
+                 weight = (int) convfuzz_range(-6, 5);
+                 break;
+        case 1:  ndigits = (int) convfuzz_range(1, 12);
+                 weight = (int) convfuzz_range(-20, 20);
+                 break;
+        case 2:  ndigits = (int) convfuzz_range(1, 40);
+                 weight = (int) convfuzz_range(-40, 40);
+                 break;
+        default: ndigits = (int) convfuzz_range(1, 6);
+                 weight = (int) convfuzz_range(-120, 120);
+                 break;
+    }
+    if (convfuzz_rand() % 50 == 0) {
+        i = (int) (convfuzz_rand() % 3);
+        convfuzz_put_be(buf, 0, 2);
+        convfuzz_put_be(buf + 2, 0, 2);
+        convfuzz_put_be(buf + 4, specials[i], 2);
+        convfuzz_put_be(buf + 6, 0, 2);
+        strcpy(text, special_text[i]);
+        return 8;
+    }
+    convfuzz_put_be(buf, (uint64_t) ndigits, 2);
+    convfuzz_put_be(buf + 2, (uint64_t) weight, 2);
+    convfuzz_put_be(buf + 4, sign, 2);
+    convfuzz_put_be(buf + 6, convfuzz_range(0, 100), 2);
+    if (sign) {
+        text[tlen++] = '-';
+    }
+    text[tlen++] = '0';
+    const int trimmed = convfuzz_rand() % 4 != 0;
+    for (i=0; i<ndigits; ++i) {
+        int d = (int) convfuzz_range(0, 9999);
+        if (trimmed && (i == 0 || i == ndigits - 1) && d == 0) {
+            d = 1;
+        }
+        convfuzz_put_be(buf + 8 + 2 * i, (uint64_t) d, 2);
+        tlen += sprintf(text + tlen, "%04d", d);
+    }
+    sprintf(text + tlen, "e%d", 4 * (weight + 1 - ndigits));
+    return 8 + 2 * ndigits;
+}
+
+// A string of 1- to 4-byte UTF-8 characters
+static int
+convfuzz_utf8 (char *buf, const int max)
+{
+    int len = 0;
+    while (len + 4 <= max && convfuzz_rand() % 64 != 0) {
+        switch (convfuzz_rand() % 4) {
+            case 0:
+                buf[len++] = (char) convfuzz_range(0x20, 0x7E);
+                break;
+            case 1:
+                buf[len++] = (char) convfuzz_range(0xC2, 0xDF);
+                buf[len++] = (char) convfuzz_range(0x80, 0xBF);
+                break;
+            case 2:
+                buf[len++] = (char) convfuzz_range(0xE1, 0xEC);
+                buf[len++] = (char) convfuzz_range(0x80, 0xBF);
+                buf[len++] = (char) convfuzz_range(0x80, 0xBF);
+                break;
+            default:
+                buf[len++] = (char) convfuzz_range(0xF1, 0xF3);
+                buf[len++] = (char) convfuzz_range(0x80, 0xBF);
+                buf[len++] = (char) convfuzz_range(0x80, 0xBF);
+                buf[len++] = (char) convfuzz_range(0x80, 0xBF);
+                break;
+        }
+    }
+    return len;
+}
+
+// Changes, adds or removes a byte or two of the LEN bytes in BUF
+static int
+convfuzz_mangle (char *buf, int len)
+{
+    static const char alphabet[] = "0123456789-+.:eE TBCinfyNa\xC3\xA9";
+    int n = (int) convfuzz_range(1, 3);
+    while (n-- > 0) {
+        const int pos = len > 0 ? (int) convfuzz_range(0, len - 1) : 0;
+        const char c = convfuzz_rand() & 1
+                       ? alphabet[convfuzz_rand() % (sizeof(alphabet) - 1)]
+                       : (char) convfuzz_rand();
+        switch (convfuzz_rand() % 4) {
+            case 0:
+                if (len > 0) {
+                    buf[pos] = c;
+                }
+                break;
+            case 1:
+                memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos] = c;
+                ++len;
+                break;
+            case 2:
+                if (len > 0) {
+                    memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                    --len;
+                }
+                break;
+            default:
+                len = pos;
+                break;
+        }
+    }
+    return len;
+}
+
+// }}}
+// The rounds {{{
+
+static void
+fuzz_float (void)
+{
+    char buf[128];
+    double want;
+    const double value = convfuzz_double();
+    static const char *formats[] = { "%.17g", "%.15g", "%.6g", "%.9g",
+                                     "%.17e", "%f" };
+    int len = snprintf(buf, sizeof(buf),
+                       formats[convfuzz_rand() % 6], value);
+    if (len >= (int) sizeof(buf)) {
+        len = snprintf(buf, sizeof(buf), "%.17g", value);
+    }
+    // The server spells these out
+    if (isnan(value)) {
+        len = sprintf(buf, "NaN");
+    }
+    else if (isinf(value)) {
+        len = sprintf(buf, value < 0 ? "-Infinity" : "Infinity");
+    }
+    const int want_rc = ref_double(buf, len, &want);
+    convfuzz_check("float text", pgstata_decode_float_text, buf, len,
+                   want_rc, want);
+
+    // Binary float8 and float4 round trips
+    union {
+        uint64_t i;
+        double   d;
+    } f8;
+    union {
+        uint32_t i;
+        float    f;
+    } f4;
+    f8.d = value;
+    convfuzz_put_be(buf, f8.i, 8);
+    convfuzz_check("float8 binary", pgstata_decode_float8_binary, buf, 8, 0,
+                   isfinite(value) ? value : PGSTATA_MISSVAL);
+    f4.i = (uint32_t) convfuzz_rand();
+    convfuzz_put_be(buf, f4.i, 4);
+    convfuzz_check("float4 binary", pgstata_decode_float4_binary, buf, 4, 0,
+                   isfinite(f4.f) ? (double) f4.f : PGSTATA_MISSVAL);
+
+    len = convfuzz_numeric(buf);
+    const int numeric_rc = ref_double(buf, len, &want);
+    convfuzz_check("numeric text", pgstata_decode_float_text, buf, len,
+                   numeric_rc, want);
+    convfuzz_check("numeric text checked",
+                   pgstata_decode_numeric_text_checked, buf, len,
+                   numeric_rc < 0 ? -1 : ref_lossy(buf, want), want);
+}
+
+static void
+fuzz_numeric_binary (void)
+{
+    char buf[128], text[256];
+    double want;
+    int len = convfuzz_numeric_binary(buf, text);
+    ref_double(text, (int) strlen(text), &want);
+    convfuzz_check("numeric binary", pgstata_decode_numeric_binary, buf, len,
+                   0, want);
+    convfuzz_check("numeric binary checked",
+                   pgstata_decode_numeric_binary_checked, buf, len,
+                   ref_lossy(text, want), want);
+
+    // Mangled headers and digits are refused or decoded, but never read
+    // beyond
+    double got;
+    len = convfuzz_mangle(buf, len);
+    const int rc = convfuzz_decode(pgstata_decode_numeric_binary_checked,
+                                   buf, len, &got);
+    if (rc < -1 || rc > 1) {
+        convfuzz_fail("mangled numeric binary", buf, len, rc, got, 0, 0);
+    }
+}
+
+static void
+fuzz_int (void)
+{
+    char buf[64];
+    int64_t value;
+    switch (convfuzz_rand() % 4) {
+        case 0:  value = (int16_t) convfuzz_rand(); break;
+        case 1:  value = (int32_t) convfuzz_rand(); break;
+        case 2:  value = (int64_t) convfuzz_rand(); break;
+        default: value = (int64_t) convfuzz_rand() >> convfuzz_range(0, 63);
+    }
+    const int len = sprintf(buf, "%lld", (long long) value);
+
+    // Exact if the double converts back to the same integer; long double
+    // holds every int64 on the platforms this is run on
+    const double want = (double) value;
+    const int inexact = (long double) want != (long double) value;
+    convfuzz_check("int text", pgstata_decode_int_text, buf, len, inexact,
+                   want);
+
+    convfuzz_put_be(buf, (uint64_t) value, 8);
+    convfuzz_check("int8 binary", pgstata_decode_int8_binary, buf, 8,
+                   inexact, want);
+    convfuzz_put_be(buf, (uint64_t) value, 4);
+    convfuzz_check("int4 binary", pgstata_decode_int4_binary, buf, 4, 0,
+                   (double) (int32_t) (uint32_t) value);
+    convfuzz_put_be(buf, (uint64_t) value, 2);
+    convfuzz_check("int2 binary", pgstata_decode_int2_binary, buf, 2, 0,
+                   (double) (int16_t) (uint16_t) value);
+}
+
+static void
+fuzz_bool (void)
+{
+    char buf[2];
+    const int value = convfuzz_rand() & 1;
+    buf[0] = value ? 't' : 'f';
+    convfuzz_check("bool text", pgstata_decode_bool_text, buf, 1, 0, value);
+    buf[0] = (char) (value ? convfuzz_range(1, 255) : 0);
+    convfuzz_check("bool binary", pgstata_decode_bool_binary, buf, 1, 0,
+                   value);
+}
+
+static void
+fuzz_date (void)
+{
+    char buf[64];
+    int64_t jdn;
+    switch (convfuzz_rand() % 4) {
+        case 0:  jdn = convfuzz_range(CONVFUZZ_MIN_JDN, CONVFUZZ_MAX_DATE_JDN);
+                 break;
+        case 1:  jdn = convfuzz_range(CONVFUZZ_MIN_JDN, 1721426 + 366);
+                 break;    // BC, and the first years AD
+        case 2:  jdn = convfuzz_range(2378497 - 36525, 2378497 + 36525);
+                 break;    // around 1800, with 1800 and 1900 not leap years
+        default: jdn = convfuzz_range(2415021, 2488070);
+                 break;    // 1900 to 2100
+    }
+    const double want = (double) (jdn - CONVFUZZ_STATA_JDN);
+    const int len = ref_format_date(buf, jdn);
+
+    // The two references must agree with each other first
+    int64_t year;
+    int month, day;
+    ref_civil(jdn, &year, &month, &day);
+    if (ref_jdn(year, month, day) != jdn) {
+        convfuzz_fail("reference calendar", buf, len, 0, 0, 0, want);
+    }
+    convfuzz_check("date text", pgstata_decode_date_text, buf, len, 0, want);
+    convfuzz_put_be(buf, (uint64_t) (jdn - CONVFUZZ_PG_JDN), 4);
+    convfuzz_check("date binary", pgstata_decode_date_binary, buf, 4, 0, want);
+
+    if (convfuzz_rand() % 100 == 0) {
+        convfuzz_check("date text", pgstata_decode_date_text, "infinity", 8,
+                       0, PGSTATA_MISSVAL);
+        convfuzz_put_be(buf, UINT32_C(0x7FFFFFFF), 4);
+        convfuzz_check("date binary", pgstata_decode_date_binary, buf, 4, 0,
+                       PGSTATA_MISSVAL);
+    }
+}
+
+static void
+fuzz_timestamp (void)
+{
+    char buf[96];
+    const int64_t min_usecs = (CONVFUZZ_MIN_JDN - CONVFUZZ_PG_JDN)
+                              * CONVFUZZ_USECS_PER_DAY;
+    const int64_t max_usecs = (CONVFUZZ_MAX_TS_JDN - CONVFUZZ_PG_JDN + 1)
+                              * CONVFUZZ_USECS_PER_DAY - 1;
+    int64_t usecs = convfuzz_range(min_usecs, max_usecs);
+    switch (convfuzz_rand() % 3) {
+        case 0:  usecs -= usecs % 1000000; break;    // whole seconds
+        case 1:  usecs = convfuzz_range(-INT64_C(3155760000000000),
+                                        INT64_C(3155760000000000));
+                 break;    // within a century of 2000
+        default: break;
+    }
+    const int tz = convfuzz_rand() & 1;
+    int offset = 0;
+    if (tz) {
+        switch (convfuzz_rand() % 3) {
+            case 0:  offset = (int) convfuzz_range(-15, 15) * 3600; break;
+            case 1:  offset = (int) convfuzz_range(-15 * 4, 15 * 4) * 900;
+                     break;
+            default: offset = (int) convfuzz_range(-57599, 57599); break;
+        }
+    }
+    // Keep the local time within the range too
+    if (usecs + offset * INT64_C(1000000) < min_usecs
+        || usecs + offset * INT64_C(1000000) > max_usecs) {
+        offset = 0;
+    }
+    const double want = ref_timestamp_msecs(usecs);
+    const int len = ref_format_timestamp(buf, usecs, tz, offset);
+    convfuzz_check(tz ? "timestamptz text" : "timestamp text",
+                   pgstata_decode_timestamp_text, buf, len, 0, want);
+    convfuzz_put_be(buf, (uint64_t) usecs, 8);
+    convfuzz_check("timestamp binary", pgstata_decode_timestamp_binary, buf,
+                   8, 0, want);
+}
+
+static void
+fuzz_clip (void)
+{
+    char buf[600];
+    const int len = convfuzz_utf8(buf, sizeof(buf));
+    const int max_len = (int) convfuzz_range(0, len + 4);
+    const int got = pgstata_utf8_clip(buf, len, max_len);
+    const int want = ref_utf8_clip(buf, len, max_len);
+    ++convfuzz_checks;
+    if (got != want) {
+        convfuzz_fail("utf8 clip", buf, len, got, max_len, want, max_len);
+    }
+}
+
+// Mangled values: the float and int decoders must still match strtod(), and
+// none may read beyond the value
+static void
+fuzz_mangled (void)
+{
+    static const pgstata_decoder text_decoders[] = {
+        pgstata_decode_int_text, pgstata_decode_float_text,
+        pgstata_decode_bool_text, pgstata_decode_date_text,
+        pgstata_decode_timestamp_text, pgstata_decode_numeric_text_checked
+    };
+    char buf[256];
+    double got, want;
+    int len, rc, want_rc;
+
+    switch (convfuzz_rand() % 4) {
+        case 0:
+            len = convfuzz_numeric(buf);
+            break;
+        case 1:
+            len = sprintf(buf, "%.17g", convfuzz_double());
+            break;
+        case 2:
+            len = ref_format_date(buf, convfuzz_range(CONVFUZZ_MIN_JDN,
+                                                      CONVFUZZ_MAX_DATE_JDN));
+            break;
+        default:
+            len = ref_format_timestamp(buf, (int64_t) convfuzz_rand() >> 12,
+                                       1, (int) convfuzz_range(-3600, 3600));
+            break;
+    }
+    len = convfuzz_mangle(buf, len);
+
+    want_rc = ref_double(buf, len, &want);
+    rc = convfuzz_decode(pgstata_decode_float_text, buf, len, &got);
+    if (rc != want_rc || (rc == 0 && ! convfuzz_same(got, want))) {
+        convfuzz_fail("mangled float text", buf, len, rc, got, want_rc,
+                      want);
+    }
+    rc = convfuzz_decode(pgstata_decode_int_text, buf, len, &got);
+    if ((rc < 0) != (want_rc < 0) || (rc >= 0 && ! convfuzz_same(got, want))) {
+        convfuzz_fail("mangled int text", buf, len, rc, got, want_rc, want);
+    }
+
+    int i;
+    for (i=0; i<(int) (sizeof(text_decoders) / sizeof(text_decoders[0]));
+         ++i) {
+        rc = convfuzz_decode(text_decoders[i], buf, len, &got);
+        if (rc < -1 || rc > 1) {
+            convfuzz_fail("mangled text", buf, len, rc, got, 0, 0);
+        }
+    }
+
+    // Binary values of the wrong length are refused
+    static const pgstata_decoder binary_decoders[] = {
+        pgstata_decode_bool_binary, pgstata_decode_int2_binary,
+        pgstata_decode_int4_binary, pgstata_decode_int8_binary,
+        pgstata_decode_float4_binary, pgstata_decode_float8_binary,
+        pgstata_decode_date_binary, pgstata_decode_timestamp_binary
+    };
+    static const int binary_lens[] = { 1, 2, 4, 8, 4, 8, 4, 8 };
+    const int k = (int) (convfuzz_rand() % 8);
+    const int wrong = (int) convfuzz_range(0, 16);
+    if (wrong != binary_lens[k]) {
+        rc = convfuzz_decode(binary_decoders[k], buf, wrong < len ? wrong
+                                                                  : len,
+                             &got);
+        if (rc != -1 && (wrong < len ? wrong : len) != binary_lens[k]) {
+            convfuzz_fail("binary length", buf, wrong, rc, got, -1, 0);
+        }
+    }
+}
+
+// }}}
+// Main {{{
+
+static void
+convfuzz_usage (void)
+{
+    fprintf(stderr,
+            "usage: pgconv-fuzz [-n ROUNDS] [-s SEED] [-v]\n"
+            "  Checks pgconv.c's decoders against reference implementations "
+            "on random\n"
+            "  values for ROUNDS rounds (default %d), starting from SEED "
+            "(default: the time).\n", CONVFUZZ_DEFAULT_ROUNDS);
+}
+
+int
+main (int argc, char **argv)
+{
+    long rounds = CONVFUZZ_DEFAULT_ROUNDS;
+    uint64_t seed = (uint64_t) time(NULL);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:v")) != -1) {
+        switch (opt) {
+            case 'n': rounds = atol(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'v': convfuzz_verbose = 1; break;
+            default:  convfuzz_usage(); return 2;
+        }
+    }
+    if (optind != argc) {
+        convfuzz_usage();
+        return 2;
+    }
+
+    printf("pgconv-fuzz: seed %llu, %ld rounds\n", (unsigned long long) seed,
+           rounds);
+    fflush(stdout);
+    convfuzz_state = seed * UINT64_C(0x9E3779B97F4A7C15) + 1;
+    for (convfuzz_round=0; convfuzz_round<rounds; ++convfuzz_round) {
+        fuzz_float();
+        fuzz_numeric_binary();
+        fuzz_int();
+        fuzz_bool();
+        fuzz_date();
+        fuzz_timestamp();
+        fuzz_clip();
+        fuzz_mangled();
+        if (convfuzz_verbose && (convfuzz_round + 1) % 100000 == 0) {
+            printf("pgconv-fuzz: %ld rounds, %ld checks\n",
+                   convfuzz_round + 1, convfuzz_checks);
+            fflush(stdout);
+        }
+    }
+    printf("pgconv-fuzz: %ld checks passed\n", convfuzz_checks);
+    return 0;
+}
+
+// }}}
@@ -46,23 +46,192 @@
 /* The speed at which this thing operates - over a network connection, at
  * least - seems to be remarkably independent of the SLURP_ROWS setting. This
  * setting does control memory usage, however, so set this to something not
- * too high. */
+ * too high.
+ *
+ * Unless the user fixes the number of rows with batchrows(), only the first
+ * FETCH asks for SLURP_ROWS rows. Later ones are sized from the bytes per row
+ * seen so far so that each round trip brings back about BATCH_BYTES, within
+ * MIN_BATCH_ROWS and MAX_BATCH_ROWS. The copy and stream modes end a batch
+ * once it holds BATCH_BYTES. */
 
-#define PGSTATA_CURSOR_SLURP_ROWS 10000
+#define PGSTATA_CURSOR_SLURP_ROWS 1000
+#define PGSTATA_BATCH_BYTES (16 * 1024 * 1024)
+#define PGSTATA_MIN_BATCH_ROWS 100
+#define PGSTATA_MAX_BATCH_ROWS 1000000
 
-/* Database string format for dates: used by strptime(). */
+/* While the copy mode stores a batch, it pulls whatever the server has sent
+ * in the meantime into libpq's buffer every this many rows, so that the
+ * server is not held up by a full socket buffer. */
 
-#define PGSTATA_PG_DATE_FORMAT "%Y-%m-%d"
+#define PGSTATA_COPY_CONSUME_ROWS 1024
 
-/* Return codes */
+/* Rows per result in the stream mode when libpq supports chunked rows mode
+ * (PostgreSQL 17 and later). Older versions return one row per result. */
+
+#define PGSTATA_STREAM_CHUNK_ROWS 1000
+
+/* Encoded string columns are stored as integer codes with a value label. A
+ * value label can hold at most MAX_ENCODE_VALUES values; a column with more
+ * distinct values than that goes back to being a string. With autoencode, a
+ * string column is encoded if the first batch has at least
+ * AUTOENCODE_MIN_ROWS rows and its values repeat AUTOENCODE_REPEATS times
+ * on average. */
+
+#define PGSTATA_MAX_ENCODE_VALUES 65536
+#define PGSTATA_AUTOENCODE_MIN_ROWS 1000
+#define PGSTATA_AUTOENCODE_REPEATS 20
+
+/* Longest strN in Stata 12 and before; the ADO wrapper passes the limit of
+ * the running Stata to prepare(). String columns are sized to the longest
+ * value seen so far, widening as longer ones turn up. Values longer than
+ * the limit are truncated, or on Stata 13 and later go into a strL. No
+ * Stata has a strN longer than 2045. */
+
+#define PGSTATA_MAX_STR_DEFAULT 244
+#define PGSTATA_MAX_STRN 2045
+
+/* Types with OIDs below this are built in; ENUMs are always above it. */
+
+#define PGSTATA_FIRST_USER_OID 16384
+
+/* The result cache: the default limit on the size of a cache directory, past
+ * which the least recently used results are deleted, and the file format. */
+
+#define PGSTATA_CACHE_BYTES ((size_t) 1024 * 1024 * 1024)
+#define PGSTATA_CACHE_MAGIC "PGSTATAC"
+#define PGSTATA_CACHE_VERSION 1
+
+/* pgexport writes format 118 .dta files, Stata 14's, or format 119 (Stata
+ * 15 MP's) when there are more variables than 118 allows. */
+
+#define PGSTATA_DTA_MAX_VARS_118 32767
+#define PGSTATA_DTA_LABEL_MAX 32000
+
+/* Ranges of Stata's integer storage types; numeric columns get the
+ * narrowest of byte, int, long, float and double which holds every value
+ * loaded exactly. */
+
+#define PGSTATA_BYTE_MIN (-127)
+#define PGSTATA_BYTE_MAX 100
+#define PGSTATA_INT_MIN (-32767)
+#define PGSTATA_INT_MAX 32740
+#define PGSTATA_LONG_MIN (-2147483647.0)
+#define PGSTATA_LONG_MAX 2147483620.0
+#define PGSTATA_FLOAT_MAX 1.70141173319e+38
+
+/* The parallel mode runs at most MAX_WORKERS connections, and each worker
+ * gets at most QUEUED_BATCHES decoded batches ahead of the Stata thread
+ * before waiting for it. */
+
+#define PGSTATA_MAX_WORKERS 64
+#define PGSTATA_QUEUED_BATCHES 2
+
+/* Connections opened by pgconnect stay open across pgload calls, up to
+ * MAX_SESSIONS of them, each found again by its connection string. Each
+ * keeps up to STMT_CACHE_LEN of the queries run on it as prepared
+ * statements, dropping the least recently used. */
+
+#define PGSTATA_MAX_SESSIONS 16
+#define PGSTATA_STMT_CACHE_LEN 32
+
+/* save() sends COPY data to the server in chunks of about this size, and
+ * reads string variables through a buffer big enough for Stata's longest
+ * strN (2045 bytes). */
+
+#define PGSTATA_SAVE_CHUNK_BYTES (1024 * 1024)
+#define PGSTATA_SDATA_BUF_LEN 2048
+
+/* While it waits on the server, the plugin looks to see whether the user
+ * has pressed Break every POLL_MSECS milliseconds, so that a load stops
+ * within a second. Loads which take a while report how far they have got
+ * every PROGRESS_SECS seconds. */
+
+#define PGSTATA_POLL_MSECS 100
+#define PGSTATA_PROGRESS_SECS 10
+
+/* Signature at the start of a binary COPY stream. */
+
+#define PGSTATA_COPY_SIGNATURE "PGCOPY\n\377\r\n\0"
+#define PGSTATA_COPY_SIGNATURE_LEN 11
+
+/* Return codes. Stata's own code for Break is 1, which populate_next()
+ * already uses, so pgstata_break stands in for it; the ADO wrapper exits
+ * with 1 when it sees it. */
 
 typedef enum _pgstata_rc {
     pgstata_ok = 0,
     pgstata_finished = 1,
+    pgstata_break = 2,
     pgstata_usage_error = 198,
     pgstata_db_error = 200
 } pgstata_rc;
 
+/* How prepare() and populate_next() get rows out of the database. The cursor
+ * mode FETCHes text-format batches from a DECLAREd cursor. The copy mode
+ * streams COPY (query) TO STDOUT in binary format and decodes the tuples
+ * straight into Stata variables. The stream mode sends the query once and
+ * reads its text-format rows in single-row or chunked mode, with no
+ * transaction or cursor. The parallel mode splits the query into key ranges,
+ * each read through a cursor on its own connection by a worker thread, all
+ * sharing one snapshot. The cache mode reads a result saved by an earlier
+ * load from the result cache, without the database. */
+
+typedef enum _pgstata_mode {
+    pgstata_mode_cursor = 0,
+    pgstata_mode_copy = 1,
+    pgstata_mode_stream = 2,
+    pgstata_mode_parallel = 3,
+    pgstata_mode_cache = 4
+} pgstata_mode;
+
+/* How a string column is turned into integer codes, if at all. Hashed
+ * columns number their values in order of appearance; ENUM columns use the
+ * type's own order from pg_enum. */
+
+typedef enum _pgstata_encoding {
+    pgstata_encode_none = 0,
+    pgstata_encode_hash = 1,
+    pgstata_encode_enum = 2
+} pgstata_encoding;
+
+/* The Postgres type save() gives a Stata variable, from its storage type and
+ * format: the reverse of the mapping in prepare(). */
+
+typedef enum _pgstata_save_kind {
+    pgstata_save_int2 = 0,
+    pgstata_save_int4 = 1,
+    pgstata_save_float4 = 2,
+    pgstata_save_float8 = 3,
+    pgstata_save_date = 4,
+    pgstata_save_timestamp = 5,
+    pgstata_save_text = 6,
+    pgstata_save_strl = 7
+} pgstata_save_kind;
+
+/* With the profile option, decoding time is counted by the kind of column
+ * decoded. String columns' time is their coding and measuring. */
+
+typedef enum _pgstata_prof_class {
+    pgstata_prof_bool = 0,
+    pgstata_prof_int = 1,
+    pgstata_prof_float = 2,
+    pgstata_prof_numeric = 3,
+    pgstata_prof_datetime = 4,
+    pgstata_prof_string = 5,
+    pgstata_prof_nclasses = 6
+} pgstata_prof_class;
+
+/* What each value in pgexport's spool file is: nothing more for a NULL, a
+ * native double, an int32 code of an encoded column, or an int32 length
+ * followed by the bytes of a string. */
+
+typedef enum _pgstata_spool_tag {
+    pgstata_spool_null = 0,
+    pgstata_spool_number = 1,
+    pgstata_spool_code = 2,
+    pgstata_spool_string = 3
+} pgstata_spool_tag;
+
 // }}}
 // Common blocks of code {{{
 
@@ -91,14 +260,34 @@ typedef enum _pgstata_rc {
 // }}}
 // Library inclusions {{{
 
-/* For struct tm and strptime() */
-#define _XOPEN_SOURCE
-#define __USE_XOPEN
+/* For clock_gettime() */
+#define _XOPEN_SOURCE 600
 #include <time.h>
 
+/* Worker threads of the parallel mode */
+#include <pthread.h>
+
+/* The result cache's files */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+/* Waiting on the server with an eye on the Break key */
+#include <errno.h>
+#include <poll.h>
+
 /* Standard string ops and conversions */
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 /* Postgres client operations */
 #include <libpq-fe.h>
@@ -111,6 +300,9 @@ typedef enum _pgstata_rc {
 #define SD_FASTMODE
 #include "stplugin.h"
 
+/* Value decoders */
+#include "pgconv.h"
+
 // }}}
 // Globals {{{
 
@@ -120,576 +312,7567 @@ PGresult *pgstata_res  = NULL;
 int       pgstata_in_transaction = 0;
 int       pgstata_num_obs_loaded = 0;
 int       pgstata_num_obs = 0;
+int       pgstata_num_vars = 0;
+pgstata_mode pgstata_load_mode = pgstata_mode_cursor;
+int       pgstata_fetch_in_flight = 0;  // cursor mode: next FETCH was sent
+
+// A query prepared on a session's connection, found by its text
+typedef struct _pgstata_stmt {
+    char         *sql;        // NULL if the slot is free
+    char          name[32];
+    PGresult     *desc;       // its columns, from PQdescribePrepared()
+    unsigned long last_used;
+} pgstata_stmt;
+
+// What the catalog says about a type prepare() doesn't know by its OID
+typedef struct _pgstata_typeinfo {
+    Oid    oid;
+    Oid    base;                    // for domains, the type underneath
+    char   name[64];
+    struct _pgstata_dict *labels;   // ENUMs: labels in sort order, or NULL
+} pgstata_typeinfo;
+
+// A connection, the statements prepared on it, and the types looked up
+// over it. connect() attaches pgstata_conn to one; disconnect() closes it
+// unless pgconnect opened it.
+typedef struct _pgstata_session {
+    char         *conninfo;   // NULL if the slot is free
+    PGconn       *conn;
+    int           persistent;
+    pgstata_stmt  stmts[PGSTATA_STMT_CACHE_LEN];
+    unsigned long stmt_clock;
+    unsigned long stmt_serial;
+    pgstata_typeinfo *types;
+    int           ntypes;
+    int           types_len;  // allocated length of TYPES
+} pgstata_session;
+
+pgstata_session  pgstata_sessions[PGSTATA_MAX_SESSIONS];
+pgstata_session *pgstata_cur_session = NULL;  // the one with pgstata_conn
+
+// Batch sizing: see PGSTATA_CURSOR_SLURP_ROWS
+int       pgstata_batch_rows = 0;       // fixed by batchrows(), or 0
+size_t    pgstata_batch_bytes = PGSTATA_BATCH_BYTES;
+int       pgstata_fetch_rows = PGSTATA_CURSOR_SLURP_ROWS;  // last FETCH size
+
+// Seconds spent waiting for the database and storing into Stata
+double    pgstata_wait_secs = 0;
+double    pgstata_store_secs = 0;
+
+// Progress reports: whether to give them, when the load started and the
+// last report was given, and how many rows the planner expects
+int       pgstata_progress = 1;
+double    pgstata_load_started = 0;
+double    pgstata_progress_mark = 0;
+double    pgstata_rows_expected = 0;
+
+// The profile option: seconds spent in each phase of a load, from profile
+// start on, and a record of each batch stored
+typedef struct _pgstata_batch_prof {
+    double rows;
+    double bytes;         // of the values received, as sent
+    double fetch_secs;    // waiting for the batch
+    double decode_secs;   // coding, measuring and decoding it
+    double store_secs;
+} pgstata_batch_prof;
+
+typedef struct _pgstata_profile {
+    int     on;
+    double  started;
+    double  connect_secs;
+    double  prepare_secs;   // prepare(), less waiting for the first batch
+    double  decode_secs[pgstata_prof_nclasses];
+    double  wait_mark;      // pgstata_wait_secs when the last batch was in
+    double  batch_decode;   // decoding the batch not yet recorded
+    pgstata_batch_prof *batches;
+    int     nbatches;
+    int     batches_len;    // allocated length of BATCHES
+} pgstata_profile;
+
+pgstata_profile pgstata_prof;
+
+// Longest strN the running Stata allows, and whether it has strLs
+int       pgstata_max_str = PGSTATA_MAX_STR_DEFAULT;
+int       pgstata_strl_ok = 0;
+
+// Whether numeric columns get the narrowest type for their values, rather
+// than the one prepare() maps their Postgres type to
+int       pgstata_compress = 1;
+
+// Whether NUMERIC values which lose digits in a double are counted, for
+// pgstata_report_lossy()
+int       pgstata_check_numeric = 0;
+
+// Values of strL columns, written for the ADO wrapper to store: see
+// pgstata_store_strl()
+FILE     *pgstata_strl_file = NULL;
+int       pgstata_strl_count = 0;
+
+// pgexport: where populate_next() writes the rows of each batch instead of
+// storing them, see pgstata_spool_batch()
+FILE     *pgstata_export_spool = NULL;
+
+// Values for the query's $1, $2, ... placeholders, set by bind() and used
+// by the next prepare(). A NULL entry binds SQL NULL.
+char    **pgstata_params = NULL;
+int       pgstata_nparams = 0;
+
+// Key columns set by keys(), and their rows in COPY text format, for the
+// next prepare() to upload and filter the query by
+typedef struct _pgstata_key {
+    char   name[33];
+    int    is_str;
+    int    integral;    // numeric, and all whole numbers that fit an int8
+} pgstata_key;
+
+pgstata_key *pgstata_keys = NULL;
+int       pgstata_nkeys = 0;
+char     *pgstata_keys_data = NULL;
+size_t    pgstata_keys_used = 0;
+size_t    pgstata_keys_len = 0;
+
+// Result cache: the file prepare() found the current result in, or will
+// save it to, and the mapping of a cached result being loaded
+char     *pgstata_cache_path = NULL;
+uint64_t  pgstata_cache_key = 0;
+char     *pgstata_cache_query = NULL;  // a cached script's one query
+const char *pgstata_cache_map = NULL;
+size_t    pgstata_cache_map_len = 0;
+
+// Type information about columns, and how to convert their values. This
+// plan is worked out once by prepare() so that populate_next() doesn't have
+// to look at column types for every cell.
+
+// The distinct values of an encoded column. Codes run from 1 to nvalues,
+// and value CODE is the LENS[CODE-1] bytes at TEXT + OFFSETS[CODE-1].
+typedef struct _pgstata_dict {
+    int       nvalues;
+    int       values_len;  // allocated length of the arrays below
+    uint32_t *hashes;
+    size_t   *offsets;
+    int      *lens;
+    char     *text;
+    size_t    text_used;
+    size_t    text_len;
+    int       nslots;      // hash table size, a power of two
+    int      *slots;       // code hashed to each slot, or 0
+    int      *by_text;     // ENUMs: codes in order of their values
+} pgstata_dict;
+
+// What a column's values have looked like. MIN, MAX, INTEGRAL and
+// FLOAT_EXACT only cover the non-missing values of numeric columns.
+typedef struct _pgstata_stats {
+    double nonmissing;
+    double missing;
+    double min;
+    double max;
+    int    integral;    // all whole numbers
+    int    float_exact; // all exactly representable as floats
+    long   lossy;       // values not exactly representable as doubles
+} pgstata_stats;
+
+typedef struct _pgstata_column {
+    Oid             oid;      // Postgres type, after the mapping in prepare()
+    int             width;    // PQfsize()
+    int             mod;      // PQfmod()
+    int             binary;   // copy mode: sent in binary send format
+    pgstata_decoder decode;   // numeric columns: value -> Stata number
+    int             max_len;  // string columns: bytes kept, or 0 for all
+    char            name[64]; // column name, for messages
+    char            type[8];  // Stata type given by prepare()
+    pgstata_encoding encode;  // string columns: stored as coded integers
+    pgstata_dict   *dict;     // encoded columns: their values so far
+    int            *codes;    // encoded columns: codes of the current batch
+    int             codes_len;
+    int             overflow; // encoded column has too many values
+    int             str_width; // string columns: N of the Stata strN
+    int             strl;     // string columns: stored as a strL
+    int             batch_len; // string columns: longest value in batch
+    int             narrow;   // numeric type follows the values loaded
+    double         *values;   // numeric columns: the batch, decoded
+    int             values_len;
+    pgstata_stats   stats;    // batches stored so far
+    pgstata_stats   batch_stats; // the current batch
+} pgstata_column;
+
+pgstata_column *pgstata_columns = NULL;
+int             pgstata_columns_len = 0;
+
+// Copy mode: where each field of the current batch starts, row by row
+const char **copy_fields = NULL;
+int         *copy_field_lens = NULL;  // -1 for NULL
+size_t       copy_fields_len = 0;     // allocated length of the above
+
+// Copy mode: tuples buffered from PQgetCopyData(). Each buffer is owned by
+// libpq and must be released with PQfreemem().
+int    pgstata_in_copy = 0;        // COPY OUT still streaming
+int    copy_header_seen = 0;
+int    copy_ntuples = 0;
+int    copy_tuples_len = 0;        // allocated length of the arrays below
+char **copy_bufs = NULL;
+char **copy_tuples = NULL;         // start of the tuple within each buffer
+int   *copy_lens = NULL;           // bytes from copy_tuples[i] to buffer end
 
-// Type information about columns
-Oid *column_oids   = NULL;
-int *column_widths = NULL;
-int *column_mods   = NULL;
+// Stream mode: the results making up the current batch
+int        pgstata_in_stream = 0;      // query still returning rows
+int        stream_nresults = 0;
+int        stream_results_len = 0;     // allocated length of stream_results
+int        stream_ntuples = 0;         // rows over all of stream_results
+PGresult **stream_results = NULL;
+
+// Parallel mode: a batch fetched and decoded by a worker thread. VALUES and
+// STATS are as the numeric columns' values and batch_stats would be after
+// pgstata_decode_batch(); VALUES[J] is NULL for other columns.
+typedef struct _pgstata_batch {
+    PGresult              *res;
+    int                    nvars;
+    double               **values;
+    pgstata_stats         *stats;
+    struct _pgstata_batch *next;
+} pgstata_batch;
+
+// Parallel mode: a worker, with its own connection and key range. Only the
+// Stata thread calls into Stata; a worker's errors wait in ERROR for it.
+typedef struct _pgstata_worker {
+    PGconn    *conn;
+    PGcancel  *cancel;
+    pthread_t  thread;
+    int        started;
+    int        done;
+    char       error[256];
+} pgstata_worker;
+
+// Parallel mode: the workers, and the queue of batches they have decoded.
+// The queue, and the counts and flags after pgstata_num_workers, are
+// guarded by pgstata_queue_lock.
+pgstata_worker *pgstata_workers = NULL;
+int             pgstata_num_workers = 0;
+pgstata_batch  *pgstata_par_batch = NULL;  // the batch in pgstata_res
+int             pgstata_workers_running = 0;
+int             pgstata_workers_stop = 0;
+pgstata_worker *pgstata_worker_failed = NULL;
+pgstata_batch  *pgstata_queue_head = NULL;
+pgstata_batch  *pgstata_queue_tail = NULL;
+int             pgstata_queued = 0;
+pthread_mutex_t pgstata_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  pgstata_queue_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  pgstata_queue_space = PTHREAD_COND_INITIALIZER;
+
+// Scratch space for NUL-terminating values taken from the COPY stream
+char  *pgstata_scratch = NULL;
+size_t pgstata_scratch_len = 0;
 
 // }}}
 // Helper funcs {{{
 
-
 /*
- * Frees and reinitialises all globals except the one to do with the
- * connection, rolling back any open transaction. After this is called, the
- * db will still be connected and prepare() and friends can be called again.
+ * Returns true if any of the trailing option words given to a plugin command
+ * matches NAME. Empty words are ignored so that ADO wrappers can pass unset
+ * options through as "".
  */
 
-static inline void
-pgstata_cleanup (const int debug_mode)
+static inline int
+pgstata_has_opt (const int argc, char **argv, const char *name)
 {
-    if (column_oids != NULL) {
-        free(column_oids);
-        column_oids = NULL;
-    }
-    if (column_widths != NULL) {
-        free(column_widths);
-        column_widths = NULL;
-    }
-    if (column_mods != NULL) {
-        free(column_mods);
-        column_mods = NULL;
+    int i;
+    for (i=0; i<argc; ++i) {
+        if (strcasecmp(argv[i], name) == 0) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    if (pgstata_in_transaction) {
-        if (debug_mode) {
-            SF_display("DEBUG: cleanup(): rolling back transaction\n");
+
+// True if WORD is one of the space-separated words of LIST
+static int
+pgstata_word_in_list (const char *list, const char *word)
+{
+    const size_t len = strlen(word);
+    const char *p = list;
+    while (*p != '\000') {
+        while (*p == ' ') {
+            ++p;
         }
-        char *rb_sql = "ROLLBACK TRANSACTION\n";
-        if (debug_mode) {
-            SF_display(rb_sql);
+        const char *end = p;
+        while (*end != '\000' && *end != ' ') {
+            ++end;
         }
-        PGresult *rb_res = PQexec(pgstata_conn, rb_sql);
-        if (PQresultStatus(rb_res) != PGRES_COMMAND_OK) {
-            SF_error(PQresultErrorMessage(rb_res));
+        if (end - p == len && len > 0 && strncmp(p, word, len) == 0) {
+            return 1;
         }
-        PQclear(rb_res);
-        pgstata_in_transaction = 0;
+        p = end;
     }
-    if (pgstata_res != NULL) {
-        if (debug_mode) {
-            SF_display("DEBUG: cleanup(): freeing query result structs\n");
+    return 0;
+}
+
+
+/*
+ * Returns the value of a trailing option word of the form NAME=VALUE, or NULL
+ * if there is none.
+ */
+
+static inline const char *
+pgstata_opt_value (const int argc, char **argv, const char *name)
+{
+    size_t n = strlen(name);
+    int i;
+    for (i=0; i<argc; ++i) {
+        if (strncasecmp(argv[i], name, n) == 0 && argv[i][n] == '=') {
+            return argv[i] + n + 1;
         }
-        PQclear(pgstata_res);
-        pgstata_res = NULL;
     }
+    return NULL;
 }
 
 
 /*
- * Like cleanup(), but also tears down the current database connection,
- * leaving the program in a state where connect() can be called.
+ * Parses a byte count with an optional k, m or g suffix (powers of 1024).
+ * Returns 0 on success.
  */
 
-static inline void
-pgstata_teardown (const int debug_mode) {
-    pgstata_cleanup(debug_mode);
-    if (pgstata_conn != NULL) {
-        if (debug_mode) {
-            SF_display("DEBUG: teardown(): ending connection\n");
-        }
-        PQfinish(pgstata_conn);
-        pgstata_conn = NULL;
+static inline int
+pgstata_parse_bytes (const char *text, size_t *bytes)
+{
+    char *end = NULL;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'g': case 'G': value *= 1024;  /* FALLTHRU */
+        case 'm': case 'M': value *= 1024;  /* FALLTHRU */
+        case 'k': case 'K': value *= 1024;  ++end; break;
+        case 'b': case 'B': ++end; break;
+        default: break;
     }
+    if (*end != '\000') {
+        return -1;
+    }
+    *bytes = (size_t) value;
+    return 0;
 }
 
 
 /*
- * Converts a type OID to a human-readable type name.
+ * Number of rows to ask for in the FETCH after RES: the batchrows() setting
+ * if there is one, otherwise enough rows at RES's bytes per row to make up
+ * about pgstata_batch_bytes.
  */
 
-static inline void
-pgstata_typoid2name (const Oid typoid, const size_t n, char *buf,
-                     const int debug_mode)
+static inline int
+pgstata_next_fetch_rows (const PGresult *res)
 {
-    char tmpbuf[256];
-    *tmpbuf = '\000';
-    snprintf(tmpbuf, 255,
-             "SELECT typname FROM pg_type WHERE oid=%d LIMIT 1\n",
-             typoid);
-    if (debug_mode) {
-        SF_display(tmpbuf);
+    if (pgstata_batch_rows > 0) {
+        return pgstata_batch_rows;
     }
-    PGresult *res = PQexec(pgstata_conn, tmpbuf);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        SF_error("Internal error: type-name lookup failed.");
-        SF_error(PQresultErrorMessage(res));
-        *buf = '\000';
-        strncpy(buf, "unknown", n);
+    int ntups = PQntuples(res);
+    if (ntups == 0) {
+        return pgstata_fetch_rows;
     }
-    else {
-        char *tmpval = PQgetvalue(res, 0, 0);
-        *buf = '\000';
-        strncpy(buf, tmpval, n);
+    double bytes_per_row = (double) PQresultMemorySize(res) / ntups;
+    double rows = pgstata_batch_bytes / (bytes_per_row > 1 ? bytes_per_row : 1);
+    if (rows < PGSTATA_MIN_BATCH_ROWS) {
+        return PGSTATA_MIN_BATCH_ROWS;
     }
-    PQclear(res);
+    if (rows > PGSTATA_MAX_BATCH_ROWS) {
+        return PGSTATA_MAX_BATCH_ROWS;
+    }
+    return (int) rows;
 }
 
 
 /*
-  Converts a GMT struct tm into the number of days since 1 Jan 1960. tm_wday,
-  tm_yday, and tm_dst are ignored.
- 
-  Code nicked from Apache 1.3.34's ap_tm2sec (util_date.c), with most of the
-  checks relating to date validity removed.
-*/
-static inline long
-pgstata_tm2statadate (const struct tm *t)
+ * Returns a NUL-terminated copy of LEN bytes at VAL in a scratch buffer
+ * which is reused between calls.
+ */
+
+static inline char *
+pgstata_scratch_copy (const char *val, const size_t len)
+{
+    if (len + 1 > pgstata_scratch_len) {
+        size_t want = pgstata_scratch_len ? pgstata_scratch_len : 256;
+        while (want < len + 1) {
+            want *= 2;
+        }
+        char *tmp = realloc(pgstata_scratch, want);
+        if (tmp == NULL) {
+            return NULL;
+        }
+        pgstata_scratch = tmp;
+        pgstata_scratch_len = want;
+    }
+    memcpy(pgstata_scratch, val, len);
+    pgstata_scratch[len] = '\000';
+    return pgstata_scratch;
+}
+
+
+/*
+ * Releases the COPY tuples buffered for the current batch.
+ */
+
+static inline void
+pgstata_copy_release (void)
 {
-    int year;
-    long days;
+    int i;
+    for (i=0; i<copy_ntuples; ++i) {
+        PQfreemem(copy_bufs[i]);
+    }
+    copy_ntuples = 0;
+}
 
-    static const int dayoffset[12] =
-        {306, 337, 0, 31, 61, 92, 122, 153, 184, 214, 245, 275};
 
-    year = t->tm_year + 100; // tm_year is YYYY-1900, we need YYYY-1800
+/*
+ * Releases the results buffered for the current stream batch.
+ */
+
+static inline void
+pgstata_stream_release (void)
+{
+    int i;
+    for (i=0; i<stream_nresults; ++i) {
+        PQclear(stream_results[i]);
+    }
+    stream_nresults = 0;
+    stream_ntuples = 0;
+}
 
-    // if (year < 70 || ((sizeof(time_t) <= 4) && (year >= 138)))
-    //    return BAD_DATE;
 
-    /* shift new year to 1st March in order to make leap year calc easy */
-    if (t->tm_mon < 2)
-        year--;
+/*
+ * Stops a COPY OUT or a streamed query which is still returning rows, or a
+ * prefetched FETCH which has not been collected: asks the server to cancel
+ * it, then drains what is left so that the connection can be reused.
+ */
 
-    /* Find number of days since 1st March 1800 (in the Gregorian calendar). */
-    days = year * 365 + year / 4 - year / 100 + (year / 100 + 2) / 4;
-    days += dayoffset[t->tm_mon] + t->tm_mday - 1;
-    //days -= 25508;            /* 1 jan 1970 is 25508 days since 1 mar 1900 */
+static inline void
+pgstata_cancel_pending (const int debug_mode)
+{
+    if (debug_mode) {
+        SF_display("DEBUG: cleanup(): cancelling pending query\n");
+    }
+    PGcancel *cancel = PQgetCancel(pgstata_conn);
+    if (cancel != NULL) {
+        char errbuf[256];
+        PQcancel(cancel, errbuf, sizeof(errbuf));
+        PQfreeCancel(cancel);
+    }
+    char *buf = NULL;
+    while (PQgetCopyData(pgstata_conn, &buf, 0) > 0) {
+        PQfreemem(buf);
+    }
+    PGresult *res;
+    while ((res = PQgetResult(pgstata_conn)) != NULL) {
+        PQclear(res);
+    }
+    pgstata_in_copy = 0;
+    pgstata_in_stream = 0;
+    pgstata_fetch_in_flight = 0;
+}
 
-    days -= 58379; // 1 Jan 1960 is 58379 days after 1 March 1800
 
-    // No need to think about seconds, minutes, hours...
-    //days = ((days * 24 + t->tm_hour) * 60 + t->tm_min) * 60 + t->tm_sec;
+/*
+ * Monotonic wall-clock time in seconds, for the wait/store accounting.
+ */
 
-    return days;
+static inline double
+pgstata_clock (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 
-// }}}
-// Connect and disconnect {{{
+/*
+ * True once the user has pressed Break. SF_poll() lets Stata notice the key
+ * press, and keeps its window responsive while the plugin waits. Only the
+ * Stata thread may call this.
+ */
 
-pgstata_rc
-pgstata_connect (int argc, char **argv) {
-    USAGE_CHECK(argc, 1, 2, "connect CONNINFO [\"debug\"]");
-    char *conninfo = argv[0];
+static inline int
+pgstata_break_pressed (void)
+{
+    SF_poll();
+    return SW_stopflag != 0;
+}
 
-    // Debugging mode
-    int debug_mode = 0;
-    if (argc >= 2) {
-        if (strncasecmp(argv[1], "debug", 5) == 0) {
-            debug_mode = 1;
-        }
-    }
 
-    if (pgstata_conn != NULL) {
-        SF_error("already connected: closing existing connection first\n");
-        pgstata_teardown(debug_mode);
+/*
+ * Waits up to PGSTATA_POLL_MSECS for the server to send something, and
+ * reads what it has sent into libpq's buffer. Returns pgstata_break if the
+ * user has pressed Break, and pgstata_db_error if the connection failed.
+ */
+
+static pgstata_rc
+pgstata_wait_socket (void)
+{
+    if (pgstata_break_pressed()) {
+        return pgstata_break;
     }
-    pgstata_conn = PQconnectdb(conninfo);
-    PGCONN_CHECK(debug_mode);
-    if (debug_mode) {
-        SF_display("DEBUG: connected successfully\n");
+    struct pollfd pfd;
+    pfd.fd = PQsocket(pgstata_conn);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ready = poll(&pfd, 1, PGSTATA_POLL_MSECS);
+    if (ready < 0 && errno != EINTR) {
+        SF_error("error waiting for the server: ");
+        SF_error(strerror(errno));
+        SF_error("\n");
+        return pgstata_db_error;
+    }
+    if (ready > 0 && ! PQconsumeInput(pgstata_conn)) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        return pgstata_db_error;
     }
     return pgstata_ok;
 }
 
-pgstata_rc
-pgstata_disconnect (int argc, char **argv) {
-    USAGE_CHECK(argc, 0, 1, "disconnect [\"debug\"]");
 
-    // Debugging mode
-    int debug_mode = 0;
-    if (argc >= 1) {
-        if (strncasecmp(argv[0], "debug", 5) == 0) {
-            debug_mode = 1;
-        }
+// Waits until PQgetResult() can return without blocking
+static pgstata_rc
+pgstata_wait_result (void)
+{
+    pgstata_rc rc = pgstata_ok;
+    while (rc == pgstata_ok && PQisBusy(pgstata_conn)) {
+        rc = pgstata_wait_socket();
     }
-
-    pgstata_teardown(debug_mode);
-    return pgstata_ok;
+    return rc;
 }
 
-// }}}
-// Query prep {{{
-
-// Prepare a workspace for pgstata_fetch() to populate: internals only.
-// This needs to be executed by an ADO file which can read the macros
-// it populates, and set up the appropriate variables and blank
-// observations.
 
-pgstata_rc
-pgstata_prepare (int argc, char **argv) {
-    USAGE_CHECK(argc, 1, 2, "prepare SQLQUERY [\"debug\"]");
-    char *sql_query = argv[0];
-    char msgtmp[256];
-    *msgtmp = '\000';
+/*
+ * Waits for the result of the statement just sent and returns it, or NULL
+ * if the user pressed Break, in which case the statement has been
+ * cancelled. A COPY OUT result is returned as soon as it arrives; otherwise
+ * any later results are dropped, as PQexec() would.
+ */
 
-    // Debugging mode
-    int debug_mode = 0;
-    if (argc >= 2) {
-        if (strncasecmp(argv[1], "debug", 5) == 0) {
-            debug_mode = 1;
+static PGresult *
+pgstata_get_result (const int debug_mode)
+{
+    if (pgstata_wait_result() == pgstata_break) {
+        pgstata_cancel_pending(debug_mode);
+        return NULL;
+    }
+    PGresult *res = PQgetResult(pgstata_conn);
+    if (res == NULL) {
+        return PQmakeEmptyPGresult(pgstata_conn, PGRES_FATAL_ERROR);
+    }
+    if (PQresultStatus(res) != PGRES_COPY_OUT) {
+        PGresult *extra;
+        while ((extra = PQgetResult(pgstata_conn)) != NULL) {
+            PQclear(extra);
         }
     }
+    return res;
+}
 
-    PGCONN_CHECK(debug_mode);
-    if (SF_nobs() != 0) {
-        SF_error("no; data in memory would be lost\n");
-        return 4;   /* FIXME: de-hardcode, investigate if error message can
-                       be sent automatically. */
-    }
 
-    PGresult *tmpres;
-    const size_t tmpsql_buf_len = 1024;
-    char tmpsql_buf[tmpsql_buf_len + 1];
-    bzero(tmpsql_buf, tmpsql_buf_len + 1);
+/*
+ * Frees a dictionary, and the per-column state of NCOLS columns.
+ */
 
-    static char *sql_begin_trans = "BEGIN TRANSACTION\n";
-    if (debug_mode) {
-        SF_display(sql_begin_trans);
+static void
+pgstata_dict_free (pgstata_dict *dict)
+{
+    if (dict != NULL) {
+        free(dict->hashes);
+        free(dict->offsets);
+        free(dict->lens);
+        free(dict->text);
+        free(dict->slots);
+        free(dict->by_text);
+        free(dict);
     }
-    tmpres = PQexec(pgstata_conn, sql_begin_trans);
-    PGRESULT_CHECK(tmpres, PGRES_COMMAND_OK, debug_mode);
-    PQclear(tmpres);
-    pgstata_in_transaction = 1;
+}
 
-    snprintf(tmpsql_buf, tmpsql_buf_len,
-             "DECLARE pgstata_cursor CURSOR FOR %s\n",
-             sql_query);
-    if (debug_mode) {
-        SF_display(tmpsql_buf);
+static void
+pgstata_free_columns (pgstata_column *columns, const int ncols)
+{
+    int j;
+    for (j=0; j<ncols; ++j) {
+        pgstata_dict_free(columns[j].dict);
+        free(columns[j].codes);
+        free(columns[j].values);
     }
-    tmpres = PQexec(pgstata_conn, tmpsql_buf);
-    PGRESULT_CHECK(tmpres, PGRES_COMMAND_OK, debug_mode);
-    bzero(tmpsql_buf, tmpsql_buf_len);
-    PQclear(tmpres);
+    free(columns);
+}
 
-    // Step the cursor forward so that we have type information available,
-    // and so that populate_workspace() has something to chew on.
-    snprintf(tmpsql_buf, tmpsql_buf_len,
-             "FETCH FORWARD %d FROM pgstata_cursor\n",
-             PGSTATA_CURSOR_SLURP_ROWS);
-    if (debug_mode) {
-        SF_display(tmpsql_buf);
+// Replaces pgstata_columns with NCOLS zeroed columns
+static int
+pgstata_alloc_columns (const int ncols)
+{
+    if (pgstata_columns != NULL) {
+        pgstata_free_columns(pgstata_columns, pgstata_columns_len);
     }
-    pgstata_res = PQexec(pgstata_conn, tmpsql_buf);
-    PGRESULT_CHECK(pgstata_res, PGRES_TUPLES_OK, debug_mode);
-    pgstata_num_obs_loaded = 0;
-    pgstata_num_obs = PQntuples(pgstata_res);
-
-    // Workspace size
-    int num_vars = PQnfields(pgstata_res);
+    pgstata_columns = calloc(ncols > 0 ? ncols : 1, sizeof(pgstata_column));
+    pgstata_columns_len = pgstata_columns ? ncols : 0;
+    return pgstata_columns == NULL;
+}
 
-    // Column type information
-    column_widths = malloc(sizeof(int) * num_vars);
-    column_oids = malloc(sizeof(Oid) * num_vars);
-    column_mods = malloc(sizeof(int) * num_vars);
-    char *stata_mac_vars  = malloc(num_vars * 33 * sizeof(char));
-    char *stata_mac_types = malloc(num_vars * 12);
-    char *stata_mac_fmts  = malloc(num_vars * 12);
-    *stata_mac_vars = '\000';
-    *stata_mac_types = '\000';
-    *stata_mac_fmts = '\000';
+
+static void
+pgstata_batch_free (pgstata_batch *batch)
+{
+    int j;
+    if (batch == NULL) {
+        return;
+    }
+    if (batch->res != NULL) {
+        PQclear(batch->res);
+    }
+    for (j=0; batch->values != NULL && j<batch->nvars; ++j) {
+        free(batch->values[j]);
+    }
+    free(batch->values);
+    free(batch->stats);
+    free(batch);
+}
+
+
+/*
+ * Parallel mode: stops the workers, cancelling whatever FETCH they are
+ * waiting on, closes their connections, and frees the batches they had
+ * queued.
+ */
+
+static void
+pgstata_stop_workers (const int debug_mode)
+{
+    char errbuf[256];
+    int w;
+    if (pgstata_workers == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pgstata_queue_lock);
+    pgstata_workers_stop = 1;
+    pthread_cond_broadcast(&pgstata_queue_space);
+    pthread_mutex_unlock(&pgstata_queue_lock);
+
+    for (w=0; w<pgstata_num_workers; ++w) {
+        pgstata_worker *worker = &pgstata_workers[w];
+        if (worker->started) {
+            pthread_mutex_lock(&pgstata_queue_lock);
+            int done = worker->done;
+            pthread_mutex_unlock(&pgstata_queue_lock);
+            if (! done && worker->cancel != NULL) {
+                PQcancel(worker->cancel, errbuf, sizeof(errbuf));
+            }
+            pthread_join(worker->thread, NULL);
+        }
+        if (worker->cancel != NULL) {
+            PQfreeCancel(worker->cancel);
+        }
+        if (worker->conn != NULL) {
+            PQfinish(worker->conn);
+        }
+    }
+    if (debug_mode) {
+        SF_display("DEBUG: stopped parallel workers\n");
+    }
+    free(pgstata_workers);
+    pgstata_workers = NULL;
+    pgstata_num_workers = 0;
+
+    while (pgstata_queue_head != NULL) {
+        pgstata_batch *next = pgstata_queue_head->next;
+        pgstata_batch_free(pgstata_queue_head);
+        pgstata_queue_head = next;
+    }
+    pgstata_queue_tail = NULL;
+    pgstata_queued = 0;
+    pgstata_batch_free(pgstata_par_batch);
+    pgstata_par_batch = NULL;
+    pgstata_workers_running = 0;
+    pgstata_workers_stop = 0;
+    pgstata_worker_failed = NULL;
+}
+
+
+// Unmaps the cached result being loaded, if any
+static void
+pgstata_cache_release (void)
+{
+    if (pgstata_cache_map != NULL) {
+        munmap((void *) pgstata_cache_map, pgstata_cache_map_len);
+        pgstata_cache_map = NULL;
+        pgstata_cache_map_len = 0;
+    }
+}
+
+
+/*
+ * Frees and reinitialises all globals except the one to do with the
+ * connection, rolling back any open transaction. After this is called, the
+ * db will still be connected and prepare() and friends can be called again.
+ */
+
+static inline void
+pgstata_cleanup (const int debug_mode)
+{
+    // Workers read the column plans, so go before those are freed
+    pgstata_stop_workers(debug_mode);
+    if (pgstata_strl_file != NULL) {
+        fclose(pgstata_strl_file);
+        pgstata_strl_file = NULL;
+    }
+    if (pgstata_columns != NULL) {
+        pgstata_free_columns(pgstata_columns, pgstata_columns_len);
+        pgstata_columns = NULL;
+        pgstata_columns_len = 0;
+    }
+    if (copy_fields != NULL) {
+        free(copy_fields);
+        free(copy_field_lens);
+        copy_fields = NULL;
+        copy_field_lens = NULL;
+        copy_fields_len = 0;
+    }
+
+    if (pgstata_in_copy || pgstata_in_stream || pgstata_fetch_in_flight) {
+        pgstata_cancel_pending(debug_mode);
+    }
+    if (stream_results != NULL) {
+        pgstata_stream_release();
+        free(stream_results);
+        stream_results = NULL;
+        stream_results_len = 0;
+    }
+    if (copy_bufs != NULL) {
+        pgstata_copy_release();
+        free(copy_bufs);
+        free(copy_tuples);
+        free(copy_lens);
+        copy_bufs = NULL;
+        copy_tuples = NULL;
+        copy_lens = NULL;
+        copy_tuples_len = 0;
+    }
+    copy_header_seen = 0;
+
+    if (pgstata_in_transaction) {
+        if (debug_mode) {
+            SF_display("DEBUG: cleanup(): rolling back transaction\n");
+        }
+        char *rb_sql = "ROLLBACK TRANSACTION\n";
+        if (debug_mode) {
+            SF_display(rb_sql);
+        }
+        PGresult *rb_res = PQexec(pgstata_conn, rb_sql);
+        if (PQresultStatus(rb_res) != PGRES_COMMAND_OK) {
+            SF_error(PQresultErrorMessage(rb_res));
+        }
+        PQclear(rb_res);
+        pgstata_in_transaction = 0;
+    }
+    if (pgstata_res != NULL) {
+        if (debug_mode) {
+            SF_display("DEBUG: cleanup(): freeing query result structs\n");
+        }
+        PQclear(pgstata_res);
+        pgstata_res = NULL;
+    }
+    pgstata_cache_release();
+    free(pgstata_cache_path);
+    pgstata_cache_path = NULL;
+}
+
+
+static void
+pgstata_stmt_clear (pgstata_stmt *stmt)
+{
+    free(stmt->sql);
+    if (stmt->desc != NULL) {
+        PQclear(stmt->desc);
+    }
+    memset(stmt, 0, sizeof(*stmt));
+}
+
+// Forgets the types looked up over SESSION
+static void
+pgstata_types_clear (pgstata_session *session)
+{
+    int i;
+    for (i=0; i<session->ntypes; ++i) {
+        pgstata_dict_free(session->types[i].labels);
+    }
+    free(session->types);
+    session->types = NULL;
+    session->ntypes = 0;
+    session->types_len = 0;
+}
+
+// Ends SESSION's connection and frees its slot
+static void
+pgstata_session_close (pgstata_session *session)
+{
+    int i;
+    if (session->conn != NULL) {
+        PQfinish(session->conn);
+    }
+    for (i=0; i<PGSTATA_STMT_CACHE_LEN; ++i) {
+        pgstata_stmt_clear(&session->stmts[i]);
+    }
+    pgstata_types_clear(session);
+    free(session->conninfo);
+    memset(session, 0, sizeof(*session));
+    if (session == pgstata_cur_session) {
+        pgstata_cur_session = NULL;
+        pgstata_conn = NULL;
+    }
+}
+
+
+/*
+ * Like cleanup(), but also tears down the current database connection,
+ * leaving the program in a state where connect() can be called.
+ */
+
+static inline void
+pgstata_teardown (const int debug_mode) {
+    pgstata_cleanup(debug_mode);
+    if (pgstata_cur_session != NULL) {
+        if (debug_mode) {
+            SF_display("DEBUG: teardown(): ending connection\n");
+        }
+        pgstata_session_close(pgstata_cur_session);
+    }
+    else if (pgstata_conn != NULL) {
+        PQfinish(pgstata_conn);
+    }
+    pgstata_conn = NULL;
+    if (pgstata_scratch != NULL) {
+        free(pgstata_scratch);
+        pgstata_scratch = NULL;
+        pgstata_scratch_len = 0;
+    }
+}
+
+
+/*
+ * Finds what pgstata_resolve_types() found out about type TYPOID over the
+ * current connection, or NULL if it hasn't looked it up.
+ */
+
+static pgstata_typeinfo *
+pgstata_type_find (const Oid typoid)
+{
+    pgstata_session *session = pgstata_cur_session;
+    int i;
+    if (session == NULL) {
+        return NULL;
+    }
+    for (i=0; i<session->ntypes; ++i) {
+        if (session->types[i].oid == typoid) {
+            return &session->types[i];
+        }
+    }
+    return NULL;
+}
+
+// The type under domain TYPOID, or TYPOID itself if it isn't a domain
+static inline Oid
+pgstata_type_base (const Oid typoid)
+{
+    const pgstata_typeinfo *info = pgstata_type_find(typoid);
+    return info != NULL ? info->base : typoid;
+}
+
+
+/*
+ * Converts a type OID to a human-readable type name.
+ */
+
+static inline void
+pgstata_typoid2name (const Oid typoid, const size_t n, char *buf)
+{
+    const pgstata_typeinfo *info = pgstata_type_find(typoid);
+    snprintf(buf, n, "%s", info != NULL ? info->name : "unknown");
+}
+
+
+/*
+ * Drops any cached types which are, or are domains over, TYPOID, so that
+ * they are looked up afresh next time: for instance when an ENUM turns out
+ * to have gained labels.
+ */
+
+static void
+pgstata_type_forget (const Oid typoid)
+{
+    pgstata_session *session = pgstata_cur_session;
+    int i = 0;
+    if (session == NULL) {
+        return;
+    }
+    while (i < session->ntypes) {
+        if (session->types[i].oid == typoid
+            || session->types[i].base == typoid) {
+            pgstata_dict_free(session->types[i].labels);
+            session->types[i] = session->types[--session->ntypes];
+        }
+        else {
+            ++i;
+        }
+    }
+}
+
+
+// }}}
+// Value decoders {{{
+
+/*
+ * Picks the decoder for a column from its (mapped) type and from whether it
+ * arrives in binary. Columns left without a decoder are stored as strings,
+ * truncated to max_len bytes if that is set.
+ */
+
+static void
+pgstata_plan_column (pgstata_column *col)
+{
+    const int binary = col->binary;
+    col->decode = NULL;
+    col->max_len = 0;
+    switch (col->oid) {
+        case BOOLOID:
+            col->decode = binary ? pgstata_decode_bool_binary
+                                 : pgstata_decode_bool_text;
+            break;
+        case INT2OID:
+            col->decode = binary ? pgstata_decode_int2_binary
+                                 : pgstata_decode_int_text;
+            break;
+        case INT4OID:
+            col->decode = binary ? pgstata_decode_int4_binary
+                                 : pgstata_decode_int_text;
+            break;
+        case INT8OID:
+            col->decode = binary ? pgstata_decode_int8_binary
+                                 : pgstata_decode_int_text;
+            break;
+        case FLOAT4OID:
+            col->decode = binary ? pgstata_decode_float4_binary
+                                 : pgstata_decode_float_text;
+            break;
+        case FLOAT8OID:
+            col->decode = binary ? pgstata_decode_float8_binary
+                                 : pgstata_decode_float_text;
+            break;
+        case NUMERICOID:
+            if (pgstata_check_numeric) {
+                col->decode = binary ? pgstata_decode_numeric_binary_checked
+                                     : pgstata_decode_numeric_text_checked;
+            }
+            else {
+                col->decode = binary ? pgstata_decode_numeric_binary
+                                     : pgstata_decode_float_text;
+            }
+            break;
+        case DATEOID:
+            col->decode = binary ? pgstata_decode_date_binary
+                                 : pgstata_decode_date_text;
+            break;
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            col->decode = binary ? pgstata_decode_timestamp_binary
+                                 : pgstata_decode_timestamp_text;
+            break;
+
+        /*
+         * Everything else is imported as a string, in a strN as wide as
+         * the longest value seen. Values longer than Stata's longest strN
+         * are truncated unless they can go into a strL.
+         */
+        case BPCHAROID:
+        case VARCHAROID:
+        case TEXTOID:
+        case CASHOID: // money
+        case INTERVALOID: // interval
+        case TIMEOID: // time without time zone
+        case TIMETZOID: //time with time zone
+        default:
+            col->max_len = pgstata_strl_ok ? 0 : pgstata_max_str;
+            break;
+    }
+}
+
+
+// }}}
+// Dictionary encoding {{{
+
+/*
+ * Encoded columns intern their values in an open-addressed hash table, so
+ * that each distinct string is stored once and each cell becomes a small
+ * integer code. ENUM columns know their values up front and look them up by
+ * binary search instead.
+ */
+
+static inline uint32_t
+pgstata_dict_hash (const char *val, const int len)
+{
+    uint32_t h = 2166136261u;     // FNV-1a
+    int i;
+    for (i=0; i<len; ++i) {
+        h = (h ^ (unsigned char) val[i]) * 16777619u;
+    }
+    return h;
+}
+
+static pgstata_dict *
+pgstata_dict_new (void)
+{
+    return calloc(1, sizeof(pgstata_dict));
+}
+
+// Value CODE of DICT, which is *LEN bytes long and not NUL-terminated
+static inline const char *
+pgstata_dict_value (const pgstata_dict *dict, const int code, int *len)
+{
+    *len = dict->lens[code - 1];
+    return dict->text + dict->offsets[code - 1];
+}
+
+// Appends a value as the next code, without touching the hash table
+static int
+pgstata_dict_append (pgstata_dict *dict, const char *val, const int len,
+                     const uint32_t hash)
+{
+    if (dict->nvalues == dict->values_len) {
+        int want = dict->values_len ? 2 * dict->values_len : 64;
+        uint32_t *hashes = realloc(dict->hashes, want * sizeof(uint32_t));
+        if (hashes == NULL) {
+            return -1;
+        }
+        dict->hashes = hashes;
+        size_t *offsets = realloc(dict->offsets, want * sizeof(size_t));
+        if (offsets == NULL) {
+            return -1;
+        }
+        dict->offsets = offsets;
+        int *lens = realloc(dict->lens, want * sizeof(int));
+        if (lens == NULL) {
+            return -1;
+        }
+        dict->lens = lens;
+        dict->values_len = want;
+    }
+    if (dict->text_used + len > dict->text_len) {
+        size_t want = dict->text_len ? 2 * dict->text_len : 4096;
+        while (want < dict->text_used + len) {
+            want *= 2;
+        }
+        char *text = realloc(dict->text, want);
+        if (text == NULL) {
+            return -1;
+        }
+        dict->text = text;
+        dict->text_len = want;
+    }
+    memcpy(dict->text + dict->text_used, val, len);
+    dict->hashes[dict->nvalues] = hash;
+    dict->offsets[dict->nvalues] = dict->text_used;
+    dict->lens[dict->nvalues] = len;
+    dict->text_used += len;
+    return ++dict->nvalues;
+}
+
+// Rebuilds the hash table at twice the size (or its initial size)
+static int
+pgstata_dict_rehash (pgstata_dict *dict)
+{
+    int nslots = dict->nslots ? 2 * dict->nslots : 256;
+    int *slots = calloc(nslots, sizeof(int));
+    int code;
+    if (slots == NULL) {
+        return -1;
+    }
+    for (code=1; code<=dict->nvalues; ++code) {
+        uint32_t k = dict->hashes[code - 1] & (nslots - 1);
+        while (slots[k] != 0) {
+            k = (k + 1) & (nslots - 1);
+        }
+        slots[k] = code;
+    }
+    free(dict->slots);
+    dict->slots = slots;
+    dict->nslots = nslots;
+    return 0;
+}
+
+/*
+ * Returns the code of the LEN bytes at VAL, adding them to DICT if they are
+ * new. Returns 0 if they are new but DICT already holds MAX_VALUES values,
+ * and -1 if memory runs out.
+ */
+
+static inline int
+pgstata_dict_intern (pgstata_dict *dict, const char *val, const int len,
+                     const int max_values)
+{
+    if (2 * (dict->nvalues + 1) > dict->nslots
+        && pgstata_dict_rehash(dict) != 0) {
+        return -1;
+    }
+    const uint32_t hash = pgstata_dict_hash(val, len);
+    const uint32_t mask = dict->nslots - 1;
+    uint32_t k = hash & mask;
+    int code;
+    while ((code = dict->slots[k]) != 0) {
+        if (dict->hashes[code - 1] == hash && dict->lens[code - 1] == len
+            && memcmp(dict->text + dict->offsets[code - 1], val, len) == 0) {
+            return code;
+        }
+        k = (k + 1) & mask;
+    }
+    if (dict->nvalues >= max_values) {
+        return 0;
+    }
+    code = pgstata_dict_append(dict, val, len, hash);
+    if (code > 0) {
+        dict->slots[k] = code;
+    }
+    return code;
+}
+
+// Orders values byte-wise, shorter first on a common prefix
+static inline int
+pgstata_dict_compare (const char *a, const int alen, const char *b,
+                      const int blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c != 0 ? c : alen - blen;
+}
+
+/*
+ * Returns the code of the LEN bytes at VAL in an ENUM dictionary, or 0 if
+ * it isn't one of the type's labels.
+ */
+
+static inline int
+pgstata_dict_find_sorted (const pgstata_dict *dict, const char *val,
+                          const int len)
+{
+    int lo = 0, hi = dict->nvalues - 1;
+    while (lo <= hi) {
+        const int mid = lo + (hi - lo) / 2;
+        const int code = dict->by_text[mid];
+        int mid_len;
+        const char *mid_val = pgstata_dict_value(dict, code, &mid_len);
+        const int c = pgstata_dict_compare(val, len, mid_val, mid_len);
+        if (c == 0) {
+            return code;
+        }
+        if (c < 0) {
+            hi = mid - 1;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builds the dictionary of ENUM type TYPOID from the labels
+ * pgstata_resolve_types() cached: its labels in sort order, plus an index of
+ * them in byte order for pgstata_dict_find_sorted(). Returns NULL if TYPOID
+ * isn't an ENUM or memory runs out.
+ */
+
+static const pgstata_dict *pgstata_sorting_dict = NULL;
+
+static int
+pgstata_dict_sort_cmp (const void *a, const void *b)
+{
+    int alen, blen;
+    const char *aval = pgstata_dict_value(pgstata_sorting_dict,
+                                          *(const int *) a, &alen);
+    const char *bval = pgstata_dict_value(pgstata_sorting_dict,
+                                          *(const int *) b, &blen);
+    return pgstata_dict_compare(aval, alen, bval, blen);
+}
+
+static pgstata_dict *
+pgstata_enum_dict (const Oid typoid)
+{
+    const pgstata_typeinfo *info = pgstata_type_find(typoid);
+    pgstata_dict *dict;
+    int i, len;
+    if (info == NULL || info->labels == NULL
+        || (dict = pgstata_dict_new()) == NULL) {
+        return NULL;
+    }
+    for (i=1; i<=info->labels->nvalues; ++i) {
+        const char *label = pgstata_dict_value(info->labels, i, &len);
+        if (pgstata_dict_append(dict, label, len, 0) < 0) {
+            pgstata_dict_free(dict);
+            return NULL;
+        }
+    }
+    dict->by_text = malloc(dict->nvalues * sizeof(int));
+    if (dict->by_text == NULL) {
+        pgstata_dict_free(dict);
+        return NULL;
+    }
+    for (i=0; i<dict->nvalues; ++i) {
+        dict->by_text[i] = i + 1;
+    }
+    pgstata_sorting_dict = dict;
+    qsort(dict->by_text, dict->nvalues, sizeof(int), pgstata_dict_sort_cmp);
+    pgstata_sorting_dict = NULL;
+    return dict;
+}
+
+/*
+ * The narrowest Stata type which holds codes 1 to NVALUES, and how the
+ * types rank against each other.
+ */
+
+static inline const char *
+pgstata_code_type (const int nvalues)
+{
+    if (nvalues <= 100) {
+        return "byte";
+    }
+    return nvalues <= 32740 ? "int" : "long";
+}
+
+static inline int
+pgstata_code_type_rank (const char *type)
+{
+    if (strcmp(type, "byte") == 0) {
+        return 1;
+    }
+    return strcmp(type, "int") == 0 ? 2 : 3;
+}
+
+// }}}
+// Column statistics {{{
+
+static inline void
+pgstata_stats_reset (pgstata_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->integral = 1;
+    stats->float_exact = 1;
+}
+
+static inline void
+pgstata_stats_add (pgstata_stats *stats, const double value)
+{
+    if (stats->nonmissing == 0 || value < stats->min) {
+        stats->min = value;
+    }
+    if (stats->nonmissing == 0 || value > stats->max) {
+        stats->max = value;
+    }
+    stats->nonmissing += 1;
+    stats->integral &= (value == floor(value));
+    stats->float_exact &= ((double) (float) value == value);
+}
+
+static void
+pgstata_stats_merge (pgstata_stats *into, const pgstata_stats *from)
+{
+    if (from->nonmissing > 0) {
+        if (into->nonmissing == 0 || from->min < into->min) {
+            into->min = from->min;
+        }
+        if (into->nonmissing == 0 || from->max > into->max) {
+            into->max = from->max;
+        }
+    }
+    into->nonmissing += from->nonmissing;
+    into->missing += from->missing;
+    into->integral &= from->integral;
+    into->float_exact &= from->float_exact;
+    into->lossy += from->lossy;
+}
+
+/*
+ * The narrowest Stata type which holds every value counted in STATS exactly:
+ * byte, int or long for whole numbers in their ranges, then float, then
+ * double. A column with no values yet is a byte, to be widened later.
+ */
+
+static const char *
+pgstata_narrow_type (const pgstata_stats *stats)
+{
+    if (stats->nonmissing == 0) {
+        return "byte";
+    }
+    if (stats->integral) {
+        if (stats->min >= PGSTATA_BYTE_MIN && stats->max <= PGSTATA_BYTE_MAX) {
+            return "byte";
+        }
+        if (stats->min >= PGSTATA_INT_MIN && stats->max <= PGSTATA_INT_MAX) {
+            return "int";
+        }
+        if (stats->min >= PGSTATA_LONG_MIN && stats->max <= PGSTATA_LONG_MAX) {
+            return "long";
+        }
+    }
+    if (stats->float_exact && stats->min >= -PGSTATA_FLOAT_MAX
+        && stats->max <= PGSTATA_FLOAT_MAX) {
+        return "float";
+    }
+    return "double";
+}
+
+// }}}
+// Connect and disconnect {{{
+
+/*
+ * Lets go of the current session. A persistent one stays open in its slot
+ * for the next connect() with the same conninfo; any other is closed.
+ */
+
+static void
+pgstata_detach (const int debug_mode)
+{
+    if (pgstata_cur_session != NULL && pgstata_cur_session->persistent) {
+        pgstata_cleanup(debug_mode);
+        if (debug_mode) {
+            SF_display("DEBUG: detach(): keeping connection open\n");
+        }
+        pgstata_cur_session = NULL;
+        pgstata_conn = NULL;
+    }
+    else {
+        pgstata_teardown(debug_mode);
+    }
+}
+
+pgstata_rc
+pgstata_connect (int argc, char **argv) {
+    USAGE_CHECK(argc, 1, 3, "connect CONNINFO [\"debug\"] [\"persist\"]");
+    char *conninfo = argv[0];
+    int debug_mode = pgstata_has_opt(argc-1, argv+1, "debug");
+    int persist = pgstata_has_opt(argc-1, argv+1, "persist");
+    pgstata_session *session = NULL;
+    int i;
+
+    if (pgstata_conn != NULL) {
+        if (pgstata_cur_session == NULL || ! pgstata_cur_session->persistent) {
+            SF_error("already connected: closing existing connection first\n");
+        }
+        pgstata_detach(debug_mode);
+    }
+
+    // Reuse an open session with the same conninfo, if there is one
+    for (i=0; i<PGSTATA_MAX_SESSIONS; ++i) {
+        if (pgstata_sessions[i].conninfo != NULL
+            && strcmp(pgstata_sessions[i].conninfo, conninfo) == 0) {
+            session = &pgstata_sessions[i];
+            break;
+        }
+    }
+    if (session != NULL && PQstatus(session->conn) != CONNECTION_OK) {
+        if (debug_mode) {
+            SF_display("DEBUG: connect(): resetting dropped connection\n");
+        }
+        // Statements prepared on the old backend are gone with it
+        for (i=0; i<PGSTATA_STMT_CACHE_LEN; ++i) {
+            pgstata_stmt_clear(&session->stmts[i]);
+        }
+        pgstata_types_clear(session);
+        double started = pgstata_clock();
+        PQreset(session->conn);
+        pgstata_prof.connect_secs += pgstata_clock() - started;
+        if (PQstatus(session->conn) != CONNECTION_OK) {
+            pgstata_session_close(session);
+            session = NULL;
+        }
+        else {
+            PQclear(PQexec(session->conn, "SET DateStyle TO ISO"));
+        }
+    }
+    if (session != NULL) {
+        session->persistent = session->persistent || persist;
+        pgstata_cur_session = session;
+        pgstata_conn = session->conn;
+        if (debug_mode) {
+            SF_display("DEBUG: reusing open connection\n");
+        }
+        return pgstata_ok;
+    }
+
+    for (i=0; i<PGSTATA_MAX_SESSIONS; ++i) {
+        if (pgstata_sessions[i].conninfo == NULL) {
+            session = &pgstata_sessions[i];
+            break;
+        }
+    }
+    if (session == NULL) {
+        SF_error("too many open connections: close one with pgdisconnect\n");
+        return pgstata_usage_error;
+    }
+    double started = pgstata_clock();
+    pgstata_conn = PQconnectdb(conninfo);
+    pgstata_prof.connect_secs += pgstata_clock() - started;
+    PGCONN_CHECK(debug_mode);
+    session->conninfo = strdup(conninfo);
+    if (session->conninfo == NULL) {
+        SF_error("out of memory connecting\n");
+        PQfinish(pgstata_conn);
+        pgstata_conn = NULL;
+        return pgstata_db_error;
+    }
+    session->conn = pgstata_conn;
+    session->persistent = persist;
+    pgstata_cur_session = session;
+
+    // The text date and timestamp decoders only read ISO output
+    PQclear(PQexec(pgstata_conn, "SET DateStyle TO ISO"));
+    if (debug_mode) {
+        SF_display("DEBUG: connected successfully\n");
+    }
+    return pgstata_ok;
+}
+
+pgstata_rc
+pgstata_disconnect (int argc, char **argv) {
+    USAGE_CHECK(argc, 0, 1, "disconnect [\"debug\"]");
+    int debug_mode = pgstata_has_opt(argc, argv, "debug");
+
+    pgstata_detach(debug_mode);
+    return pgstata_ok;
+}
+
+
+/*
+ * Closes the persistent session opened on CONNINFO, or every open session
+ * if CONNINFO is empty.
+ */
+
+pgstata_rc
+pgstata_close (int argc, char **argv) {
+    USAGE_CHECK(argc, 0, 2, "close [CONNINFO] [\"debug\"]");
+    const char *conninfo = argc >= 1 ? argv[0] : "";
+    int debug_mode = pgstata_has_opt(argc, argv, "debug");
+    int i, closed = 0;
+
+    if (pgstata_conn != NULL) {
+        pgstata_detach(debug_mode);
+    }
+    for (i=0; i<PGSTATA_MAX_SESSIONS; ++i) {
+        if (pgstata_sessions[i].conninfo != NULL
+            && (conninfo[0] == '\0'
+                || strcmp(pgstata_sessions[i].conninfo, conninfo) == 0)) {
+            pgstata_session_close(&pgstata_sessions[i]);
+            ++closed;
+        }
+    }
+    if (conninfo[0] != '\0' && closed == 0) {
+        SF_error("no open connection with that connection string\n");
+        return pgstata_usage_error;
+    }
+    return pgstata_ok;
+}
+
+// }}}
+// Query parameters {{{
+
+static void
+pgstata_params_free (void)
+{
+    int i;
+    for (i=0; i<pgstata_nparams; ++i) {
+        free(pgstata_params[i]);
+    }
+    free(pgstata_params);
+    pgstata_params = NULL;
+    pgstata_nparams = 0;
+}
+
+
+/*
+ * Prints VALUE in as few digits as read back as the same double, so that
+ * 0.1 is bound as "0.1" and compares equal to a numeric 0.1. Whole numbers
+ * an int8 can hold are printed in full, since int8 rejects "1e+15".
+ */
+
+static void
+pgstata_format_double (char *buf, const size_t n, const double value)
+{
+    int prec;
+    if (value == floor(value) && fabs(value) < 9.2e18) {
+        snprintf(buf, n, "%.0f", value);
+        return;
+    }
+    for (prec=15; prec<17; ++prec) {
+        snprintf(buf, n, "%.*g", prec, value);
+        if (strtod(buf, NULL) == value) {
+            return;
+        }
+    }
+    snprintf(buf, n, "%.17g", value);
+}
+
+
+/*
+ * Builds a Postgres array literal of the values of variable VAR, for use as
+ * "= ANY ($n)". Missing values and empty strings become NULL elements. The
+ * caller frees the result; NULL means memory ran out or Stata failed.
+ */
+
+static char *
+pgstata_param_array (const int var, const int is_str)
+{
+    char sbuf[PGSTATA_SDATA_BUF_LEN];
+    size_t len = 1, cap = 256;
+    char *out = malloc(cap);
+    int obs, any = 0;
+    if (out == NULL) {
+        return NULL;
+    }
+    strcpy(out, "{");
+    for (obs=SF_in1(); obs<=SF_in2(); ++obs) {
+        double value;
+        const char *val = sbuf;
+        size_t i, need;
+        if (is_str) {
+            if (SF_sdata(var, obs, sbuf)) {
+                free(out);
+                return NULL;
+            }
+        }
+        else {
+            if (SF_vdata(var, obs, &value)) {
+                free(out);
+                return NULL;
+            }
+            if (SF_is_missing(value)) {
+                *sbuf = '\000';
+            }
+            else {
+                pgstata_format_double(sbuf, sizeof(sbuf), value);
+            }
+        }
+
+        // Quoted, with quotes and backslashes escaped, so any text will do
+        need = len + 2 * strlen(val) + 8;
+        if (need > cap) {
+            char *grown;
+            while (need > cap) {
+                cap *= 2;
+            }
+            if ((grown = realloc(out, cap)) == NULL) {
+                free(out);
+                return NULL;
+            }
+            out = grown;
+        }
+        if (any) {
+            out[len++] = ',';
+        }
+        any = 1;
+        if (*val == '\000') {
+            memcpy(out + len, "NULL", 4);
+            len += 4;
+            continue;
+        }
+        out[len++] = '"';
+        for (i=0; val[i] != '\000'; ++i) {
+            if (val[i] == '"' || val[i] == '\\') {
+                out[len++] = '\\';
+            }
+            out[len++] = val[i];
+        }
+        out[len++] = '"';
+    }
+    out[len++] = '}';
+    out[len] = '\000';
+    return out;
+}
+
+
+/*
+ * Sets the values of the next query's placeholders, replacing any set
+ * before. Each argument binds one placeholder, in order: "text=VALUE" binds
+ * VALUE as given, "scalar=NAME" the numeric scalar NAME, and "numvar=K" or
+ * "strvar=K" every value of the Kth variable in the plugin call's varlist,
+ * as an array. With no arguments, the next query has no parameters.
+ */
+
+pgstata_rc
+pgstata_bind (int argc, char **argv) {
+    char msg[256];
+    int i;
+
+    pgstata_params_free();
+    if (argc == 0) {
+        return pgstata_ok;
+    }
+    pgstata_params = calloc(argc, sizeof(char *));
+    if (pgstata_params == NULL) {
+        SF_error("out of memory binding parameters\n");
+        return pgstata_db_error;
+    }
+    pgstata_nparams = argc;
+    for (i=0; i<argc; ++i) {
+        const char *val;
+        if ((val = pgstata_opt_value(1, argv + i, "text")) != NULL) {
+            pgstata_params[i] = strdup(val);
+        }
+        else if ((val = pgstata_opt_value(1, argv + i, "scalar")) != NULL) {
+            double value;
+            if (SF_scal_use((char *) val, &value)) {
+                snprintf(msg, 255, "params(): %s is not a numeric scalar\n",
+                         val);
+                SF_error(msg);
+                pgstata_params_free();
+                return pgstata_usage_error;
+            }
+            if (SF_is_missing(value)) {
+                continue;   // binds NULL
+            }
+            pgstata_format_double(msg, sizeof(msg), value);
+            pgstata_params[i] = strdup(msg);
+        }
+        else if ((val = pgstata_opt_value(1, argv + i, "numvar")) != NULL
+                 || (val = pgstata_opt_value(1, argv + i, "strvar")) != NULL) {
+            const int var = atoi(val);
+            if (var < 1 || var > SF_nvars()) {
+                SF_error("usage: bind: no such variable in the varlist\n");
+                pgstata_params_free();
+                return pgstata_usage_error;
+            }
+            pgstata_params[i] = pgstata_param_array(
+                var, strncmp(argv[i], "strvar=", 7) == 0);
+        }
+        else {
+            SF_error("usage: bind [\"text=VALUE\"|\"scalar=NAME\"|"
+                     "\"numvar=K\"|\"strvar=K\"] ...\n");
+            pgstata_params_free();
+            return pgstata_usage_error;
+        }
+        if (pgstata_params[i] == NULL) {
+            SF_error("out of memory binding parameters\n");
+            pgstata_params_free();
+            return pgstata_db_error;
+        }
+    }
+    return pgstata_ok;
+}
+
+static void
+pgstata_keys_free (void)
+{
+    free(pgstata_keys);
+    free(pgstata_keys_data);
+    pgstata_keys = NULL;
+    pgstata_nkeys = 0;
+    pgstata_keys_data = NULL;
+    pgstata_keys_used = 0;
+    pgstata_keys_len = 0;
+}
+
+// Appends LEN bytes of VAL to the key rows, escaped for COPY text format
+static int
+pgstata_keys_put (const char *val, const size_t len, const int escape)
+{
+    size_t i;
+    if (pgstata_keys_used + 2 * len + 2 > pgstata_keys_len) {
+        size_t want = pgstata_keys_len ? 2 * pgstata_keys_len : 65536;
+        char *grown;
+        while (pgstata_keys_used + 2 * len + 2 > want) {
+            want *= 2;
+        }
+        if ((grown = realloc(pgstata_keys_data, want)) == NULL) {
+            return 1;
+        }
+        pgstata_keys_data = grown;
+        pgstata_keys_len = want;
+    }
+    for (i=0; i<len; ++i) {
+        if (escape && (val[i] == '\\' || val[i] == '\t' || val[i] == '\n'
+                       || val[i] == '\r')) {
+            pgstata_keys_data[pgstata_keys_used++] = '\\';
+            pgstata_keys_data[pgstata_keys_used++] =
+                val[i] == '\t' ? 't' : val[i] == '\n' ? 'n'
+                : val[i] == '\r' ? 'r' : '\\';
+        }
+        else {
+            pgstata_keys_data[pgstata_keys_used++] = val[i];
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Sets the key columns the next query is filtered by, replacing any set
+ * before: each argument "num=NAME" or "str=NAME" describes the variable at
+ * the same place in the plugin call's varlist. Their values, one row per
+ * observation, are kept to be uploaded by prepare(). With no arguments, the
+ * next query isn't filtered.
+ */
+
+pgstata_rc
+pgstata_keys_set (int argc, char **argv) {
+    char sbuf[PGSTATA_SDATA_BUF_LEN];
+    int i, obs;
+
+    pgstata_keys_free();
+    if (argc == 0) {
+        return pgstata_ok;
+    }
+    if (argc != SF_nvars()) {
+        SF_error("usage: keys: one \"num=NAME\" or \"str=NAME\" per "
+                 "variable\n");
+        return pgstata_usage_error;
+    }
+    pgstata_keys = calloc(argc, sizeof(pgstata_key));
+    if (pgstata_keys == NULL) {
+        SF_error("out of memory reading keys\n");
+        return pgstata_db_error;
+    }
+    pgstata_nkeys = argc;
+    for (i=0; i<argc; ++i) {
+        const char *name;
+        if ((name = pgstata_opt_value(1, argv + i, "str")) != NULL) {
+            pgstata_keys[i].is_str = 1;
+        }
+        else if ((name = pgstata_opt_value(1, argv + i, "num")) == NULL) {
+            SF_error("usage: keys: one \"num=NAME\" or \"str=NAME\" per "
+                     "variable\n");
+            pgstata_keys_free();
+            return pgstata_usage_error;
+        }
+        snprintf(pgstata_keys[i].name, sizeof(pgstata_keys[i].name), "%s",
+                 name);
+        pgstata_keys[i].integral = ! pgstata_keys[i].is_str;
+    }
+
+    for (obs=SF_in1(); obs<=SF_in2(); ++obs) {
+        for (i=0; i<argc; ++i) {
+            double value;
+            if (pgstata_keys[i].is_str) {
+                if (SF_sdata(i + 1, obs, sbuf)) {
+                    goto FAILED;
+                }
+            }
+            else {
+                if (SF_vdata(i + 1, obs, &value)) {
+                    goto FAILED;
+                }
+                *sbuf = '\000';
+                // Whole numbers are written out in full, as int8 would
+                // reject "1e+15"
+                if (! SF_is_missing(value)) {
+                    const int integral = value == floor(value)
+                                         && fabs(value) < 9.2e18;
+                    if (integral) {
+                        snprintf(sbuf, sizeof(sbuf), "%lld",
+                                 (long long) value);
+                    }
+                    else {
+                        pgstata_format_double(sbuf, sizeof(sbuf), value);
+                    }
+                    pgstata_keys[i].integral &= integral;
+                }
+            }
+            // Missing values and empty strings never match, as NULLs
+            if (pgstata_keys_put(i ? "\t" : "", i ? 1 : 0, 0)
+                || (*sbuf == '\000'
+                    ? pgstata_keys_put("\\N", 2, 0)
+                    : pgstata_keys_put(sbuf, strlen(sbuf), 1))) {
+                goto FAILED;
+            }
+        }
+        if (pgstata_keys_put("\n", 1, 0)) {
+            goto FAILED;
+        }
+    }
+    return pgstata_ok;
+
+  FAILED:
+    SF_error("out of memory reading keys\n");
+    pgstata_keys_free();
+    return pgstata_db_error;
+}
+
+// }}}
+// Result cache {{{
+
+/*
+ * With cachedir(), a query's result is saved once loaded, and a later load
+ * of the same query finds it there instead of asking the database. A result
+ * is keyed by a hash of the conninfo, the query and its parameters and keys,
+ * the options which change what gets loaded, and a freshness token. The file
+ * holds each column contiguously, in the storage type it ended up with, so
+ * it is mapped into memory and stored from directly:
+ *
+ *     pgstata_cache_header
+ *     pgstata_cache_var       one per column
+ *     column data             NOBS doubles, or NOBS strN values of N bytes
+ *     value labels            encoded columns: a length and text per code
+ *
+ * Sections start on 8-byte boundaries. The file is in native byte order: it
+ * is only meant to be read on the machine which wrote it.
+ */
+
+typedef struct _pgstata_cache_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nvars;
+    uint64_t nobs;
+    uint64_t key;
+} pgstata_cache_header;
+
+typedef struct _pgstata_cache_var {
+    char     name[40];   // a Stata name, at most 32 bytes
+    char     type[8];
+    char     fmt[16];
+    int32_t  width;      // strN: N; numeric: 0
+    int32_t  nlabels;    // encoded: codes with a value label
+    uint64_t data_off;
+    uint64_t labels_off;
+} pgstata_cache_var;
+
+static inline uint64_t
+pgstata_cache_hash (uint64_t h, const char *val, const size_t len)
+{
+    size_t i;
+    for (i=0; i<len; ++i) {
+        h = (h ^ (unsigned char) val[i]) * UINT64_C(1099511628211);
+    }
+    // A separator, so that "ab"+"c" and "a"+"bc" differ
+    return (h ^ 0xff) * UINT64_C(1099511628211);
+}
+
+static inline uint64_t
+pgstata_cache_hash_str (const uint64_t h, const char *val)
+{
+    if (val == NULL) {
+        val = "";
+    }
+    return pgstata_cache_hash(h, val, strlen(val));
+}
+
+/*
+ * Maps the cached result at PATH, checks it was saved under KEY, and sets
+ * up pgstata_columns from it, with the dictionaries of encoded columns.
+ * Returns 0 if it can be loaded; anything wrong with it is a cache miss.
+ */
+
+static int
+pgstata_cache_open (const char *path, const uint64_t key)
+{
+    struct stat st;
+    const pgstata_cache_header *hdr;
+    const pgstata_cache_var *vars;
+    void *map;
+    uint32_t j;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    pgstata_cache_release();
+    pgstata_cache_map = map;
+    pgstata_cache_map_len = st.st_size;
+
+    hdr = map;
+    vars = (const pgstata_cache_var *) (hdr + 1);
+    if (memcmp(hdr->magic, PGSTATA_CACHE_MAGIC, 8) != 0
+        || hdr->version != PGSTATA_CACHE_VERSION || hdr->key != key
+        || hdr->nobs > INT32_MAX
+        || sizeof(*hdr) + (uint64_t) hdr->nvars * sizeof(*vars)
+           > pgstata_cache_map_len) {
+        goto MISS;
+    }
+    for (j=0; j<hdr->nvars; ++j) {
+        const uint64_t stride = vars[j].width > 0 ? (uint64_t) vars[j].width
+                                                  : sizeof(double);
+        if (vars[j].width < 0 || vars[j].width >= PGSTATA_SDATA_BUF_LEN
+            || memchr(vars[j].name, '\000', 33) == NULL
+            || vars[j].data_off % 8 != 0
+            || vars[j].data_off + hdr->nobs * stride > pgstata_cache_map_len
+            || vars[j].labels_off > pgstata_cache_map_len) {
+            goto MISS;
+        }
+    }
+
+    if (pgstata_alloc_columns(hdr->nvars)) {
+        goto MISS;
+    }
+    for (j=0; j<hdr->nvars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        snprintf(col->name, sizeof(col->name), "%s", vars[j].name);
+        snprintf(col->type, sizeof(col->type), "%.7s", vars[j].type);
+        col->str_width = vars[j].width;
+        pgstata_stats_reset(&col->stats);
+        if (vars[j].nlabels > 0) {
+            const char *p = (const char *) map + vars[j].labels_off;
+            const char *end = (const char *) map + pgstata_cache_map_len;
+            int32_t code, len;
+            col->dict = pgstata_dict_new();
+            if (col->dict == NULL) {
+                goto MISS;
+            }
+            for (code=1; code<=vars[j].nlabels; ++code) {
+                if (end - p < (ptrdiff_t) sizeof(len)) {
+                    goto MISS;
+                }
+                memcpy(&len, p, sizeof(len));
+                p += sizeof(len);
+                if (len < 0 || end - p < len
+                    || pgstata_dict_append(col->dict, p, len, 0) < 0) {
+                    goto MISS;
+                }
+                p += len;
+            }
+        }
+    }
+    pgstata_num_vars = hdr->nvars;
+    pgstata_num_obs = (int) hdr->nobs;
+    pgstata_num_obs_loaded = 0;
+
+    // Looking it up makes it the most recently used
+    utime(path, NULL);
+    return 0;
+
+  MISS:
+    if (pgstata_columns != NULL) {
+        pgstata_free_columns(pgstata_columns, pgstata_columns_len);
+        pgstata_columns = NULL;
+        pgstata_columns_len = 0;
+    }
+    pgstata_cache_release();
+    return 1;
+}
+
+
+/*
+ * Looks for the current query's result in the cache directory given to
+ * prepare(), under the freshness token TOKEN, and remembers where it will be
+ * saved if it isn't there. On a hit, sets the macros prepare() would for the
+ * columns and switches to loading from the cache, and returns 1.
+ */
+
+static int
+pgstata_cache_lookup (int argc, char **argv, const char *token,
+                      const int debug_mode)
+{
+    static const char *options[] = { "encode", "maxstr", NULL };
+    static const char *flags[] = { "autoencode", "strl", "nocompress",
+                                   NULL };
+    const char *dir = pgstata_opt_value(argc-1, argv+1, "cachedir");
+    uint64_t key = UINT64_C(14695981039346656037);
+    char msg[256];
+    int i;
+
+    key = pgstata_cache_hash_str(key, pgstata_opt_value(argc-1, argv+1,
+                                                        "conninfo"));
+    key = pgstata_cache_hash_str(key, argv[0]);
+    key = pgstata_cache_hash_str(key, token);
+    for (i=0; options[i] != NULL; ++i) {
+        key = pgstata_cache_hash_str(key, pgstata_opt_value(argc-1, argv+1,
+                                                            options[i]));
+    }
+    for (i=0; flags[i] != NULL; ++i) {
+        key = pgstata_cache_hash_str(key, pgstata_has_opt(argc-1, argv+1,
+                                                          flags[i])
+                                          ? flags[i] : "");
+    }
+    for (i=0; i<pgstata_nparams; ++i) {
+        key = pgstata_cache_hash_str(key, pgstata_params[i] != NULL
+                                          ? pgstata_params[i] : "\\N");
+    }
+    if (pgstata_nkeys > 0) {
+        for (i=0; i<pgstata_nkeys; ++i) {
+            key = pgstata_cache_hash_str(key, pgstata_keys[i].name);
+        }
+        key = pgstata_cache_hash(key, pgstata_keys_data, pgstata_keys_used);
+    }
+
+    free(pgstata_cache_path);
+    pgstata_cache_key = key;
+    pgstata_cache_path = malloc(strlen(dir) + 32);
+    if (pgstata_cache_path == NULL) {
+        return 0;
+    }
+    sprintf(pgstata_cache_path, "%s/pgload_%016llx.pgc", dir,
+            (unsigned long long) key);
+    if (debug_mode) {
+        snprintf(msg, 255, "DEBUG: result cache file %s\n",
+                 pgstata_cache_path);
+        SF_display(msg);
+    }
+    if (pgstata_cache_open(pgstata_cache_path, key) != 0) {
+        return 0;
+    }
+
+    // The same macros prepare() sets, from the saved columns
+    const pgstata_cache_var *vars =
+        (const pgstata_cache_var *) ((const pgstata_cache_header *)
+                                     pgstata_cache_map + 1);
+    const size_t name_len = sizeof(pgstata_columns[0].name) + 1;
+    char *mac_vars = malloc(pgstata_num_vars * name_len + 1);
+    char *mac_types = malloc(pgstata_num_vars * 9 + 1);
+    char *mac_fmts = malloc(pgstata_num_vars * 17 + 1);
+    char *mac_encoded = malloc(pgstata_num_vars * name_len + 1);
+    if (mac_vars == NULL || mac_types == NULL || mac_fmts == NULL
+        || mac_encoded == NULL) {
+        free(mac_vars);
+        free(mac_types);
+        free(mac_fmts);
+        free(mac_encoded);
+        pgstata_cleanup(debug_mode);
+        return 0;
+    }
+    *mac_vars = *mac_types = *mac_fmts = *mac_encoded = '\000';
+    for (i=0; i<pgstata_num_vars; ++i) {
+        sprintf(mac_vars + strlen(mac_vars), "%s ", pgstata_columns[i].name);
+        sprintf(mac_types + strlen(mac_types), "%s ",
+                pgstata_columns[i].type);
+        sprintf(mac_fmts + strlen(mac_fmts), "%.15s ", vars[i].fmt);
+        if (pgstata_columns[i].dict != NULL) {
+            sprintf(mac_encoded + strlen(mac_encoded), "%s ",
+                    pgstata_columns[i].name);
+        }
+    }
+    snprintf(msg, 32, "%d", pgstata_num_obs);
+    SF_macro_save("_obs", msg);
+    SF_macro_save("_estimate", msg);
+    SF_macro_save("_vars", mac_vars);
+    SF_macro_save("_types", mac_types);
+    SF_macro_save("_fmts", mac_fmts);
+    SF_macro_save("_encoded", mac_encoded);
+    SF_macro_save("_cached", "1");
+    free(mac_vars);
+    free(mac_types);
+    free(mac_fmts);
+    free(mac_encoded);
+    if (debug_mode) {
+        SF_display("DEBUG: loading the result from the cache\n");
+    }
+    pgstata_load_mode = pgstata_mode_cache;
+    return 1;
+}
+
+
+/*
+ * Stores the whole cached result into the dataset, which the ADO wrapper
+ * has set up from the macros pgstata_cache_lookup() set.
+ */
+
+static pgstata_rc
+pgstata_cache_fill (void)
+{
+    const pgstata_cache_header *hdr = (const void *) pgstata_cache_map;
+    const pgstata_cache_var *vars = (const pgstata_cache_var *) (hdr + 1);
+    char sbuf[PGSTATA_SDATA_BUF_LEN];
+    char msg[64];
+    double started = pgstata_clock();
+    int i, j;
+
+    if (pgstata_num_obs_loaded == pgstata_num_obs) {
+        return pgstata_finished;
+    }
+    for (j=0; j<pgstata_num_vars; ++j) {
+        const char *data = (const char *) pgstata_cache_map + vars[j].data_off;
+        pgstata_column *col = &pgstata_columns[j];
+        const int width = vars[j].width;
+        for (i=0; i<pgstata_num_obs; ++i) {
+            if (width > 0) {
+                memcpy(sbuf, data + (size_t) i * width, width);
+                sbuf[width] = '\000';
+                if (SF_sstore(j + 1, i + 1, sbuf)) {
+                    goto FAILED;
+                }
+                if (*sbuf == '\000') {
+                    col->stats.missing += 1;
+                }
+                else {
+                    col->stats.nonmissing += 1;
+                }
+                continue;
+            }
+            const double value = ((const double *) data)[i];
+            if (SF_vstore(j + 1, i + 1, value)) {
+                goto FAILED;
+            }
+            if (value >= SV_missval) {
+                col->stats.missing += 1;
+            }
+            else {
+                pgstata_stats_add(&col->stats, value);
+            }
+        }
+    }
+    pgstata_num_obs_loaded = pgstata_num_obs;
+    pgstata_store_secs = pgstata_clock() - started;
+    snprintf(msg, 32, "%d", pgstata_num_obs);
+    SF_macro_save("_obs", msg);
+    SF_macro_save("_wait_secs", "0");
+    snprintf(msg, 32, "%.3f", pgstata_store_secs);
+    SF_macro_save("_store_secs", msg);
+    return pgstata_finished;
+
+  FAILED:
+    snprintf(msg, 63, "can't store cached column %d\n", j + 1);
+    SF_error(msg);
+    pgstata_cleanup(0);
+    return pgstata_db_error;
+}
+
+
+// Files in the cache directory, for eviction
+typedef struct _pgstata_cache_file {
+    char  *path;
+    time_t mtime;
+    off_t  size;
+} pgstata_cache_file;
+
+static int
+pgstata_cache_file_cmp (const void *a, const void *b)
+{
+    const time_t ta = ((const pgstata_cache_file *) a)->mtime;
+    const time_t tb = ((const pgstata_cache_file *) b)->mtime;
+    return ta < tb ? -1 : ta > tb;
+}
+
+
+/*
+ * Deletes the least recently used results from cache directory DIR until
+ * the rest take up at most LIMIT bytes.
+ */
+
+static void
+pgstata_cache_evict (const char *dir, const size_t limit,
+                     const int debug_mode)
+{
+    pgstata_cache_file *files = NULL;
+    int nfiles = 0, files_len = 0, i;
+    uint64_t total = 0;
+    struct dirent *ent;
+    struct stat st;
+    char msg[256];
+    DIR *dh = opendir(dir);
+    if (dh == NULL) {
+        return;
+    }
+    while ((ent = readdir(dh)) != NULL) {
+        const size_t len = strlen(ent->d_name);
+        if (strncmp(ent->d_name, "pgload_", 7) != 0 || len < 5
+            || strcmp(ent->d_name + len - 4, ".pgc") != 0) {
+            continue;
+        }
+        if (nfiles == files_len) {
+            int want = files_len ? 2 * files_len : 64;
+            pgstata_cache_file *grown = realloc(files, want * sizeof(*files));
+            if (grown == NULL) {
+                break;
+            }
+            files = grown;
+            files_len = want;
+        }
+        char *path = malloc(strlen(dir) + len + 2);
+        if (path == NULL) {
+            break;
+        }
+        sprintf(path, "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) != 0) {
+            free(path);
+            continue;
+        }
+        files[nfiles].path = path;
+        files[nfiles].mtime = st.st_mtime;
+        files[nfiles].size = st.st_size;
+        total += st.st_size;
+        ++nfiles;
+    }
+    closedir(dh);
+
+    qsort(files, nfiles, sizeof(*files), pgstata_cache_file_cmp);
+    for (i=0; i<nfiles; ++i) {
+        if (total > limit && unlink(files[i].path) == 0) {
+            total -= files[i].size;
+            if (debug_mode) {
+                snprintf(msg, 255, "DEBUG: evicted %s\n", files[i].path);
+                SF_display(msg);
+            }
+        }
+        free(files[i].path);
+    }
+    free(files);
+}
+
+
+/*
+ * Writes the section of the cache file F for column J: its values, read
+ * back from the dataset, and the value labels of an encoded column.
+ */
+
+static int
+pgstata_cache_write_column (FILE *f, pgstata_cache_var *var, const int j,
+                            const int nobs, const pgstata_dict *dict)
+{
+    char sbuf[PGSTATA_SDATA_BUF_LEN];
+    double values[512];
+    static const char zeros[8] = { 0 };
+    long pos = ftell(f);
+    int i, n = 0;
+
+    if (pos < 0 || fwrite(zeros, 1, (8 - pos % 8) % 8, f)
+                   != (size_t) (8 - pos % 8) % 8) {
+        return 1;
+    }
+    var->data_off = (uint64_t) ftell(f);
+    for (i=0; i<nobs; ++i) {
+        if (var->width > 0) {
+            memset(sbuf, 0, var->width + 1);
+            if (SF_sdata(j + 1, i + 1, sbuf)
+                || fwrite(sbuf, 1, var->width, f) != (size_t) var->width) {
+                return 1;
+            }
+            continue;
+        }
+        if (SF_vdata(j + 1, i + 1, &values[n])) {
+            return 1;
+        }
+        if (++n == 512 || i == nobs - 1) {
+            if (fwrite(values, sizeof(double), n, f) != (size_t) n) {
+                return 1;
+            }
+            n = 0;
+        }
+    }
+
+    var->labels_off = (uint64_t) ftell(f);
+    for (i=1; dict != NULL && i<=dict->nvalues; ++i) {
+        int len;
+        const char *val = pgstata_dict_value(dict, i, &len);
+        const int32_t len32 = len;
+        if (fwrite(&len32, sizeof(len32), 1, f) != 1
+            || fwrite(val, 1, len, f) != (size_t) len) {
+            return 1;
+        }
+    }
+    var->nlabels = dict != NULL ? dict->nvalues : 0;
+    return 0;
+}
+
+
+/*
+ * Saves the result just loaded to the cache file prepare() chose, then
+ * evicts old results. TYPES and FORMATS are the variables' storage types
+ * and display formats as they ended up, and ENCODED lists those with value
+ * labels from the column's dictionary. Results with strLs aren't cached,
+ * because the plugin interface can't read them back.
+ */
+
+pgstata_rc
+pgstata_cache_save (int argc, char **argv) {
+    USAGE_CHECK(argc, 3, 5, "cache_save TYPES FORMATS ENCODED [debug] "
+                            "[cachesize=N[k|m|g]]");
+    const int debug_mode = pgstata_has_opt(argc-3, argv+3, "debug");
+    const char *optval = pgstata_opt_value(argc-3, argv+3, "cachesize");
+    const int nvars = pgstata_num_vars;
+    const int nobs = pgstata_num_obs_loaded;
+    const char *types = argv[0], *fmts = argv[1];
+    size_t limit = PGSTATA_CACHE_BYTES;
+    pgstata_cache_header hdr;
+    pgstata_cache_var *vars;
+    char *tmp_path, *dir, *slash;
+    int j, n, failed = 0;
+    FILE *f;
+
+    if (pgstata_cache_path == NULL || pgstata_columns == NULL
+        || pgstata_load_mode == pgstata_mode_cache) {
+        return pgstata_ok;
+    }
+    if (optval != NULL && *optval != '\000'
+        && pgstata_parse_bytes(optval, &limit) != 0) {
+        SF_error("cachesize must be a size such as 512m or 2g\n");
+        return pgstata_usage_error;
+    }
+    vars = calloc(nvars > 0 ? nvars : 1, sizeof(*vars));
+    tmp_path = malloc(strlen(pgstata_cache_path) + 8);
+    if (vars == NULL || tmp_path == NULL) {
+        free(vars);
+        free(tmp_path);
+        return pgstata_ok;
+    }
+
+    for (j=0; j<nvars; ++j) {
+        if (sscanf(types, " %7s%n", vars[j].type, &n) != 1
+            || strcmp(vars[j].type, "strL") == 0) {
+            if (debug_mode) {
+                SF_display("DEBUG: not caching a result with strLs\n");
+            }
+            free(vars);
+            free(tmp_path);
+            return pgstata_ok;
+        }
+        types += n;
+        if (sscanf(fmts, " %15s%n", vars[j].fmt, &n) != 1) {
+            strcpy(vars[j].fmt, "default");
+        }
+        else {
+            fmts += n;
+        }
+        // The ADO wrapper made a variable of each column, so its name fits
+        snprintf(vars[j].name, sizeof(vars[j].name), "%.32s",
+                 pgstata_columns[j].name);
+        if (strncmp(vars[j].type, "str", 3) == 0) {
+            vars[j].width = atoi(vars[j].type + 3);
+        }
+    }
+
+    // Written under a temporary name, so that a half-written file is never
+    // found by a lookup
+    sprintf(tmp_path, "%s.tmp", pgstata_cache_path);
+    f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        SF_display("Note: couldn't save the result to the cache\n");
+        free(vars);
+        free(tmp_path);
+        return pgstata_ok;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PGSTATA_CACHE_MAGIC, 8);
+    hdr.version = PGSTATA_CACHE_VERSION;
+    hdr.nvars = nvars;
+    hdr.nobs = nobs;
+    hdr.key = pgstata_cache_key;
+    failed = fwrite(&hdr, sizeof(hdr), 1, f) != 1
+             || fwrite(vars, sizeof(*vars), nvars, f) != (size_t) nvars;
+    for (j=0; ! failed && j<nvars; ++j) {
+        const pgstata_dict *dict =
+            pgstata_word_in_list(argv[2], pgstata_columns[j].name)
+            ? pgstata_columns[j].dict : NULL;
+        failed = pgstata_cache_write_column(f, &vars[j], j, nobs, dict);
+    }
+    if (! failed) {
+        failed = fseek(f, sizeof(hdr), SEEK_SET) != 0
+                 || fwrite(vars, sizeof(*vars), nvars, f) != (size_t) nvars;
+    }
+    failed |= fclose(f) != 0;
+    if (failed || rename(tmp_path, pgstata_cache_path) != 0) {
+        SF_display("Note: couldn't save the result to the cache\n");
+        unlink(tmp_path);
+    }
+    else {
+        if (debug_mode) {
+            SF_display("DEBUG: saved the result to the cache\n");
+        }
+        dir = strdup(pgstata_cache_path);
+        if (dir != NULL && (slash = strrchr(dir, '/')) != NULL) {
+            *slash = '\000';
+            pgstata_cache_evict(dir, limit, debug_mode);
+        }
+        free(dir);
+    }
+    free(vars);
+    free(tmp_path);
+    return pgstata_ok;
+}
+
+// }}}
+// Scripts {{{
+
+/*
+ * A script is a string of statements separated by semicolons. Splitting it
+ * needs just enough of PostgreSQL's lexer to tell which semicolons are
+ * inside quotes, dollar quotes and comments. Strings are taken to follow
+ * standard_conforming_strings, apart from E'' ones.
+ */
+
+static inline int
+pgstata_sql_ident_char (const char c)
+{
+    return isalnum((unsigned char) c) || c == '_' || c == '$'
+           || (unsigned char) c >= 0x80;
+}
+
+/*
+ * Skips the quoted token at P, delimited by QUOTE, in which a doubled QUOTE
+ * stands for itself, as does any character after a backslash if BACKSLASHES
+ * is set. Returns the end of the token, or of the script if it isn't closed.
+ */
+
+static const char *
+pgstata_sql_skip_quoted (const char *p, const char quote,
+                         const int backslashes)
+{
+    for (++p; *p != '\000'; ++p) {
+        if (backslashes && *p == '\\' && p[1] != '\000') {
+            ++p;
+        }
+        else if (*p == quote) {
+            if (p[1] != quote) {
+                return p + 1;
+            }
+            ++p;
+        }
+    }
+    return p;
+}
+
+// Returns the end of the token starting at P, which isn't a comment
+static const char *
+pgstata_sql_token_end (const char *p)
+{
+    if (*p == '\'' || *p == '"') {
+        return pgstata_sql_skip_quoted(p, *p, 0);
+    }
+    if (*p == '$') {
+        // $tag$ ... $tag$, where the tag may be empty; $1 is a parameter
+        const char *q = p + 1;
+        if (! isdigit((unsigned char) *q)) {
+            while (*q != '$' && pgstata_sql_ident_char(*q)) {
+                ++q;
+            }
+        }
+        if (*q != '$') {
+            return p + 1;
+        }
+        size_t tag_len = q + 1 - p;
+        const char *close = q + 1;
+        while ((close = strchr(close, '$')) != NULL
+               && strncmp(close, p, tag_len) != 0) {
+            ++close;
+        }
+        return close != NULL ? close + tag_len : p + strlen(p);
+    }
+    if (pgstata_sql_ident_char(*p)) {
+        const char *q = p;
+        while (pgstata_sql_ident_char(*q)) {
+            ++q;
+        }
+        if (q == p + 1 && (*p == 'E' || *p == 'e') && *q == '\'') {
+            return pgstata_sql_skip_quoted(q, '\'', 1);
+        }
+        return q;
+    }
+    return p + 1;
+}
+
+static void
+pgstata_free_stmts (char **stmts, const int n)
+{
+    int i;
+    for (i=0; i<n; ++i) {
+        free(stmts[i]);
+    }
+    free(stmts);
+}
+
+/*
+ * Splits SCRIPT into its statements, without the comments and whitespace
+ * around them, leaving out empty ones. Puts them in *STMTS, which the
+ * caller frees with pgstata_free_stmts(), and returns how many there are,
+ * or -1 if out of memory.
+ */
+
+static int
+pgstata_split_script (const char *script, char ***stmts)
+{
+    const char *p = script;
+    const char *start = NULL, *end = NULL;
+    char **list = NULL;
+    int n = 0, list_len = 0;
+    for (;;) {
+        if (*p == '-' && p[1] == '-') {
+            p += strcspn(p, "\n");
+            continue;
+        }
+        if (*p == '/' && p[1] == '*') {
+            // Block comments nest
+            int depth = 0;
+            do {
+                if (*p == '/' && p[1] == '*') {
+                    ++depth;
+                    p += 2;
+                }
+                else if (*p == '*' && p[1] == '/') {
+                    --depth;
+                    p += 2;
+                }
+                else {
+                    ++p;
+                }
+            } while (depth > 0 && *p != '\000');
+            continue;
+        }
+        if (*p == ';' || *p == '\000') {
+            if (start != NULL) {
+                if (n == list_len) {
+                    int want = list_len ? 2 * list_len : 16;
+                    char **grown = realloc(list, want * sizeof(char *));
+                    if (grown == NULL) {
+                        pgstata_free_stmts(list, n);
+                        return -1;
+                    }
+                    list = grown;
+                    list_len = want;
+                }
+                list[n] = malloc(end - start + 1);
+                if (list[n] == NULL) {
+                    pgstata_free_stmts(list, n);
+                    return -1;
+                }
+                memcpy(list[n], start, end - start);
+                list[n][end - start] = '\000';
+                ++n;
+                start = NULL;
+            }
+            if (*p == '\000') {
+                break;
+            }
+            ++p;
+            continue;
+        }
+        if (isspace((unsigned char) *p)) {
+            ++p;
+            continue;
+        }
+        if (start == NULL) {
+            start = p;
+        }
+        p = end = pgstata_sql_token_end(p);
+    }
+    *stmts = list;
+    return n;
+}
+
+// True if STMT is a query whose rows can be loaded
+static int
+pgstata_sql_is_query (const char *stmt)
+{
+    static const char *keywords[] = { "select", "with", "values", "table",
+                                      NULL };
+    size_t len = pgstata_sql_token_end(stmt) - stmt;
+    int i;
+    if (*stmt == '(') {
+        return 1;
+    }
+    for (i=0; keywords[i] != NULL; ++i) {
+        if (strlen(keywords[i]) == len
+            && strncasecmp(stmt, keywords[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Runs the N statements STMTS, in that order, in a single round trip. They
+ * run as one transaction, unless they open their own, so either all of
+ * them take effect or none does; the first to fail is reported, numbered
+ * from 1. With a libpq which can pipeline, each goes as a statement of its
+ * own, with one sync after the last. Otherwise they go as one
+ * multi-statement query, which can't tell which of them failed.
+ */
+
+static pgstata_rc
+pgstata_run_statements (char **stmts, const int n, const int debug_mode)
+{
+    pgstata_rc rc = pgstata_ok;
+    int i;
+    double started = pgstata_clock();
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if (! PQenterPipelineMode(pgstata_conn)) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        return pgstata_db_error;
+    }
+    for (i=0; i<n; ++i) {
+        if (debug_mode) {
+            SF_display(stmts[i]);
+            SF_display("\n");
+        }
+        if (! PQsendQueryParams(pgstata_conn, stmts[i], 0, NULL, NULL, NULL,
+                                NULL, 0)) {
+            break;
+        }
+    }
+    // Only a lost connection stops libpq queueing them, or reading their
+    // results back. Such a connection is left in pipeline mode with results
+    // outstanding, so its session is dropped and the next call reconnects.
+    if (i < n || ! PQpipelineSync(pgstata_conn)) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        pgstata_teardown(debug_mode);
+        return pgstata_db_error;
+    }
+
+    // A NULL ends each statement's results, and the sync's result the lot.
+    // After Break or a failure the rest are skipped by the server.
+    char msg[256];
+    int stmt = 0, cancelled = 0;
+    for (;;) {
+        if (! cancelled) {
+            pgstata_rc wait_rc = pgstata_wait_result();
+            if (wait_rc == pgstata_db_error) {
+                pgstata_teardown(debug_mode);
+                return wait_rc;
+            }
+            if (wait_rc == pgstata_break) {
+                pgstata_cancel_pending(debug_mode);
+                cancelled = 1;
+                rc = pgstata_break;
+                continue;
+            }
+        }
+        PGresult *res = PQgetResult(pgstata_conn);
+        if (res == NULL) {
+            ++stmt;
+            continue;
+        }
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_FATAL_ERROR && rc == pgstata_ok) {
+            snprintf(msg, 255, "statement %d of the script failed: ",
+                     stmt + 1);
+            SF_error(msg);
+            SF_error(PQresultErrorMessage(res));
+            rc = pgstata_db_error;
+        }
+        PQclear(res);
+        if (status == PGRES_PIPELINE_SYNC) {
+            break;
+        }
+    }
+    PQexitPipelineMode(pgstata_conn);
+#else
+    size_t sql_len = 1;
+    for (i=0; i<n; ++i) {
+        sql_len += strlen(stmts[i]) + 2;
+    }
+    char *sql = malloc(sql_len);
+    if (sql == NULL) {
+        SF_error("out of memory joining the script's statements\n");
+        return pgstata_db_error;
+    }
+    *sql = '\000';
+    for (i=0; i<n; ++i) {
+        strcat(sql, stmts[i]);
+        strcat(sql, ";\n");
+    }
+    if (debug_mode) {
+        SF_display(sql);
+    }
+    if (! PQsendQuery(pgstata_conn, sql)) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        free(sql);
+        return pgstata_db_error;
+    }
+    free(sql);
+    PGresult *res;
+    for (;;) {
+        pgstata_rc wait_rc = pgstata_wait_result();
+        if (wait_rc == pgstata_break) {
+            pgstata_cancel_pending(debug_mode);
+        }
+        if (wait_rc != pgstata_ok) {
+            rc = wait_rc;
+            break;
+        }
+        if ((res = PQgetResult(pgstata_conn)) == NULL) {
+            break;
+        }
+        if (PQresultStatus(res) == PGRES_FATAL_ERROR && rc == pgstata_ok) {
+            SF_error(PQresultErrorMessage(res));
+            rc = pgstata_db_error;
+        }
+        PQclear(res);
+    }
+#endif
+
+    pgstata_wait_secs += pgstata_clock() - started;
+    return rc;
+}
+
+
+/*
+ * Runs all but the last statement of the script *SQL_QUERY, and points
+ * *SQL_QUERY at the last, which the caller frees, for loading. If the last
+ * is not a query it is run with the others, and *SQL_QUERY set to NULL.
+ */
+
+static pgstata_rc
+pgstata_run_script (char **sql_query, const int debug_mode)
+{
+    char **stmts = NULL;
+    int n = pgstata_split_script(*sql_query, &stmts);
+    if (n < 0) {
+        SF_error("out of memory splitting the script\n");
+        return pgstata_db_error;
+    }
+    if (n == 0) {
+        SF_error("the script has no statements\n");
+        return pgstata_usage_error;
+    }
+    int load_last = pgstata_sql_is_query(stmts[n-1]);
+    int nrun = load_last ? n - 1 : n;
+    pgstata_rc rc = pgstata_ok;
+    if (nrun > 0) {
+        rc = pgstata_run_statements(stmts, nrun, debug_mode);
+    }
+    *sql_query = NULL;
+    if (rc == pgstata_ok && load_last) {
+        *sql_query = stmts[n-1];
+        stmts[n-1] = NULL;
+    }
+    pgstata_free_stmts(stmts, n);
+    return rc;
+}
+
+// }}}
+// Query prep {{{
+
+/*
+ * Estimates how many rows SQL_QUERY will return, so that the ADO wrapper can
+ * size the dataset up front. The planner's estimate comes from EXPLAIN; if
+ * EXACT is set the rows are counted instead. Returns 0 if nothing could be
+ * found out. Runs outside any transaction, so a failure here is harmless.
+ * Counting can take a while, so Break cancels it; the caller looks at
+ * SW_stopflag afterwards.
+ */
+
+static double
+pgstata_estimate_rows (const char *sql_query, const int exact,
+                       const int debug_mode)
+{
+    const char *fmt = exact ? "SELECT count(*) FROM (%s) AS pgstata_count\n"
+                            : "EXPLAIN %s\n";
+    size_t sql_len = strlen(fmt) + strlen(sql_query) + 1;
+    char *sql = malloc(sql_len);
+    double estimate = 0;
+    if (sql == NULL) {
+        return 0;
+    }
+    snprintf(sql, sql_len, fmt, sql_query);
+    if (debug_mode) {
+        SF_display(sql);
+    }
+    int sent = pgstata_nparams == 0
+        ? PQsendQuery(pgstata_conn, sql)
+        : PQsendQueryParams(pgstata_conn, sql, pgstata_nparams, NULL,
+                            (const char * const *) pgstata_params, NULL, NULL,
+                            0);
+    free(sql);
+    PGresult *res = sent ? pgstata_get_result(debug_mode) : NULL;
+    if (res == NULL) {
+        return 0;
+    }
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0) {
+        const char *val = PQgetvalue(res, 0, 0);
+        if (exact) {
+            estimate = strtod(val, NULL);
+        }
+        else {
+            // The top plan node reads "... (cost=a..b rows=N width=W)"
+            const char *rows = strstr(val, " rows=");
+            if (rows != NULL) {
+                estimate = strtod(rows + 6, NULL);
+            }
+        }
+    }
+    else if (debug_mode) {
+        SF_display("DEBUG: row estimate failed: ");
+        SF_display(PQresultErrorMessage(res));
+    }
+    PQclear(res);
+    return estimate;
+}
+
+
+/*
+ * Types which the copy mode can decode from their binary send format. All
+ * other columns are cast to text in the COPY query and parsed the same way
+ * as in cursor mode.
+ */
+
+static inline int
+pgstata_binary_decodable (const Oid typoid)
+{
+    switch (typoid) {
+        case BOOLOID:
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case NUMERICOID:
+        case DATEOID:
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+        case BPCHAROID:
+        case VARCHAROID:
+        case TEXTOID:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+
+/*
+ * Reads tuples from the COPY stream into the copy_* buffers until they hold
+ * pgstata_batch_bytes, or batchrows() tuples if that was given. When the
+ * stream ends, the COPY command's own result is collected and
+ * pgstata_in_copy is cleared.
+ */
+
+static pgstata_rc
+pgstata_copy_fetch_batch (const int debug_mode)
+{
+    int max_rows = pgstata_batch_rows > 0 ? pgstata_batch_rows
+                                          : PGSTATA_MAX_BATCH_ROWS;
+    size_t batch_bytes = 0;
+    pgstata_copy_release();
+
+    while (pgstata_in_copy && copy_ntuples < max_rows
+           && batch_bytes < pgstata_batch_bytes) {
+        if (copy_ntuples == copy_tuples_len) {
+            int want = copy_tuples_len ? 2 * copy_tuples_len : 1024;
+            char **bufs = realloc(copy_bufs, sizeof(char *) * want);
+            if (bufs != NULL) {
+                copy_bufs = bufs;
+            }
+            char **tuples = realloc(copy_tuples, sizeof(char *) * want);
+            if (tuples != NULL) {
+                copy_tuples = tuples;
+            }
+            int *lens = realloc(copy_lens, sizeof(int) * want);
+            if (lens != NULL) {
+                copy_lens = lens;
+            }
+            if (bufs == NULL || tuples == NULL || lens == NULL) {
+                SF_error("out of memory allocating COPY buffers\n");
+                return pgstata_db_error;
+            }
+            copy_tuples_len = want;
+        }
+
+        // Wait for the next row without blocking, so that Break is seen
+        char *buf = NULL;
+        int len;
+        while ((len = PQgetCopyData(pgstata_conn, &buf, 1)) == 0) {
+            pgstata_rc rc = pgstata_wait_socket();
+            if (rc != pgstata_ok) {
+                return rc;
+            }
+        }
+        if (len == -1) {
+            // End of the stream: pick up the COPY's completion status
+            pgstata_rc rc = pgstata_ok;
+            PGresult *res;
+            pgstata_in_copy = 0;
+            while ((res = PQgetResult(pgstata_conn)) != NULL) {
+                if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+                    SF_error(PQresultErrorMessage(res));
+                    rc = pgstata_db_error;
+                }
+                PQclear(res);
+            }
+            if (debug_mode) {
+                SF_display("DEBUG: end of COPY stream\n");
+            }
+            return rc;
+        }
+        else if (len < 0) {
+            SF_error(PQerrorMessage(pgstata_conn));
+            return pgstata_db_error;
+        }
+
+        // The header arrives in front of the first tuple
+        char *tuple = buf;
+        if (! copy_header_seen) {
+            if (len < PGSTATA_COPY_SIGNATURE_LEN + 8
+                || memcmp(buf, PGSTATA_COPY_SIGNATURE,
+                          PGSTATA_COPY_SIGNATURE_LEN) != 0) {
+                SF_error("unrecognised binary COPY header\n");
+                PQfreemem(buf);
+                return pgstata_db_error;
+            }
+            int32_t extlen = pgstata_get_int32(buf + PGSTATA_COPY_SIGNATURE_LEN
+                                               + 4);
+            tuple += PGSTATA_COPY_SIGNATURE_LEN + 8 + extlen;
+            copy_header_seen = 1;
+        }
+        int tuple_len = len - (int) (tuple - buf);
+
+        // A field count of -1 is the trailer
+        if (tuple_len < 2 || pgstata_get_int16(tuple) == -1) {
+            PQfreemem(buf);
+            continue;
+        }
+        copy_bufs[copy_ntuples] = buf;
+        copy_tuples[copy_ntuples] = tuple;
+        copy_lens[copy_ntuples] = tuple_len;
+        ++copy_ntuples;
+        batch_bytes += len;
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * pgstata_copy_fetch_batch(), with the time spent counted as waiting.
+ */
+
+static pgstata_rc
+pgstata_copy_fetch (const int debug_mode)
+{
+    double started = pgstata_clock();
+    pgstata_rc rc = pgstata_copy_fetch_batch(debug_mode);
+    pgstata_wait_secs += pgstata_clock() - started;
+    return rc;
+}
+
+
+/*
+ * Finds the fields of each tuple in the current copy batch, filling in
+ * copy_fields and copy_field_lens row by row. A binary tuple is an int16
+ * field count, then per field an int32 length (-1 for NULL) followed by that
+ * many bytes.
+ */
+
+static pgstata_rc
+pgstata_split_copy_batch (const int ntups)
+{
+    const int nvars = pgstata_num_vars;
+    char msg[256];
+    size_t want = (size_t) ntups * nvars;
+    int i, j;
+
+    if (want > copy_fields_len) {
+        const char **fields = realloc(copy_fields, sizeof(char *) * want);
+        if (fields != NULL) {
+            copy_fields = fields;
+        }
+        int *lens = realloc(copy_field_lens, sizeof(int) * want);
+        if (lens != NULL) {
+            copy_field_lens = lens;
+        }
+        if (fields == NULL || lens == NULL) {
+            SF_error("out of memory splitting COPY tuples\n");
+            return pgstata_db_error;
+        }
+        copy_fields_len = want;
+    }
+
+    for (i=0; i<ntups; ++i) {
+        const char *p = copy_tuples[i];
+        const char *end = p + copy_lens[i];
+        const char **fields = copy_fields + (size_t) i * nvars;
+        int *lens = copy_field_lens + (size_t) i * nvars;
+        if (pgstata_in_copy && i % PGSTATA_COPY_CONSUME_ROWS == 0) {
+            PQconsumeInput(pgstata_conn);
+        }
+        if (pgstata_get_int16(p) != nvars) {
+            snprintf(msg, 255, "COPY tuple at obs %d has %d fields, "
+                     "expected %d\n", 1 + i + pgstata_num_obs_loaded,
+                     pgstata_get_int16(p), nvars);
+            SF_error(msg);
+            return pgstata_db_error;
+        }
+        p += 2;
+        for (j=0; j<nvars; ++j) {
+            if (end - p < 4) {
+                goto TRUNCATED;
+            }
+            int32_t flen = pgstata_get_int32(p);
+            p += 4;
+            fields[j] = p;
+            lens[j] = flen < 0 ? -1 : flen;
+            if (flen > 0) {
+                if (end - p < flen) {
+                    goto TRUNCATED;
+                }
+                p += flen;
+            }
+        }
+    }
+    return pgstata_ok;
+
+  TRUNCATED:
+    snprintf(msg, 255, "truncated COPY tuple at obs %d\n",
+             1 + i + pgstata_num_obs_loaded);
+    SF_error(msg);
+    return pgstata_db_error;
+}
+
+
+/*
+ * Finds SQL_QUERY among the current session's prepared statements, or
+ * prepares and describes it there, evicting the least recently used entry
+ * if the cache is full. Returns NULL, with the error shown, if the server
+ * rejects the query.
+ */
+
+static pgstata_stmt *
+pgstata_stmt_lookup (const char *sql_query, const int debug_mode)
+{
+    pgstata_session *session = pgstata_cur_session;
+    pgstata_stmt *stmt = NULL;
+    char sql[64];
+    int i;
+
+    if (session == NULL) {
+        SF_error("not connected to a database\n");
+        return NULL;
+    }
+    for (i=0; i<PGSTATA_STMT_CACHE_LEN; ++i) {
+        if (session->stmts[i].sql != NULL
+            && strcmp(session->stmts[i].sql, sql_query) == 0) {
+            session->stmts[i].last_used = ++session->stmt_clock;
+            if (debug_mode) {
+                SF_display("DEBUG: reusing prepared statement ");
+                SF_display(session->stmts[i].name);
+                SF_display("\n");
+            }
+            return &session->stmts[i];
+        }
+        if (stmt == NULL || session->stmts[i].last_used < stmt->last_used) {
+            stmt = &session->stmts[i];
+        }
+    }
+
+    if (stmt->sql != NULL) {
+        snprintf(sql, sizeof(sql), "DEALLOCATE %s", stmt->name);
+        PQclear(PQexec(session->conn, sql));
+        pgstata_stmt_clear(stmt);
+    }
+    snprintf(stmt->name, sizeof(stmt->name), "pgstata_stmt_%lu",
+             ++session->stmt_serial);
+    if (debug_mode) {
+        SF_display("DEBUG: preparing statement ");
+        SF_display(stmt->name);
+        SF_display("\n");
+    }
+    PGresult *tmpres = PQprepare(session->conn, stmt->name, sql_query, 0,
+                                 NULL);
+    if (PQresultStatus(tmpres) != PGRES_COMMAND_OK) {
+        SF_error(PQresultErrorMessage(tmpres));
+        PQclear(tmpres);
+        memset(stmt, 0, sizeof(*stmt));
+        return NULL;
+    }
+    PQclear(tmpres);
+    stmt->desc = PQdescribePrepared(session->conn, stmt->name);
+    stmt->sql = strdup(sql_query);
+    if (PQresultStatus(stmt->desc) != PGRES_COMMAND_OK || stmt->sql == NULL) {
+        SF_error(stmt->sql == NULL ? "out of memory preparing statement\n"
+                                   : PQresultErrorMessage(stmt->desc));
+        snprintf(sql, sizeof(sql), "DEALLOCATE %s", stmt->name);
+        PQclear(PQexec(session->conn, sql));
+        pgstata_stmt_clear(stmt);
+        return NULL;
+    }
+    stmt->last_used = ++session->stmt_clock;
+    return stmt;
+}
+
+
+/*
+ * Drops SQL_QUERY from the statement cache after a failure, so that a
+ * statement left stale by a schema change is prepared afresh next time.
+ */
+
+static void
+pgstata_stmt_forget (const char *sql_query)
+{
+    pgstata_session *session = pgstata_cur_session;
+    char sql[64];
+    int i;
+    if (session == NULL || PQstatus(session->conn) != CONNECTION_OK) {
+        return;
+    }
+    for (i=0; i<PGSTATA_STMT_CACHE_LEN; ++i) {
+        if (session->stmts[i].sql != NULL
+            && strcmp(session->stmts[i].sql, sql_query) == 0) {
+            snprintf(sql, sizeof(sql), "DEALLOCATE %s",
+                     session->stmts[i].name);
+            PQclear(PQexec(session->conn, sql));
+            pgstata_stmt_clear(&session->stmts[i]);
+        }
+    }
+}
+
+
+/*
+ * Describes the columns SQL_QUERY returns, without running it, from the
+ * session's prepared statement for it. The caller frees *DESC.
+ */
+
+static pgstata_rc
+pgstata_describe_query (const char *sql_query, const int debug_mode,
+                        PGresult **desc)
+{
+    if (debug_mode) {
+        SF_display("DEBUG: describing query\n");
+    }
+    pgstata_stmt *stmt = pgstata_stmt_lookup(sql_query, debug_mode);
+    if (stmt == NULL) {
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    *desc = PQcopyResult(stmt->desc, PG_COPYRES_ATTRS);
+    if (*desc == NULL) {
+        SF_error("out of memory describing query\n");
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * Whether prepare() knows how to load type TYPOID without asking the
+ * catalog about it.
+ */
+
+static inline int
+pgstata_type_builtin (const Oid typoid)
+{
+    switch (typoid) {
+        case BOOLOID:
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case NUMERICOID:
+        case BPCHAROID:
+        case VARCHAROID:
+        case TEXTOID:
+        case DATEOID:
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Looks up every type among the columns described by DESC that isn't
+ * built in or already cached for the current connection, in one catalog
+ * query: its name, the type underneath it if it is a domain, and its labels
+ * in sort order if it (or that type) is an ENUM. A failed lookup only
+ * leaves the types unresolved, so they load as strings.
+ */
+
+static void
+pgstata_resolve_types (const PGresult *desc, const int debug_mode)
+{
+    pgstata_session *session = pgstata_cur_session;
+    const int nfields = PQnfields(desc);
+    char *oids;
+    int i, k, any = 0;
+    if (session == NULL || (oids = malloc(nfields * 12 + 3)) == NULL) {
+        return;
+    }
+    strcpy(oids, "{");
+    for (i=0; i<nfields; ++i) {
+        const Oid ftype = PQftype(desc, i);
+        if (pgstata_type_builtin(ftype) || pgstata_type_find(ftype) != NULL) {
+            continue;
+        }
+        for (k=0; k<i; ++k) {
+            if (PQftype(desc, k) == ftype) {
+                break;
+            }
+        }
+        if (k == i) {
+            sprintf(oids + strlen(oids), "%s%u", any ? "," : "", ftype);
+            any = 1;
+        }
+    }
+    strcat(oids, "}");
+    if (! any) {
+        free(oids);
+        return;
+    }
+
+    // Domains can be over other domains, so are followed down to the type
+    // at the bottom. WITH RECURSIVE arrived in 8.4, and enumsortorder in
+    // 9.1; before that, OID order was label order.
+    const int version = PQserverVersion(pgstata_conn);
+    const char *sql = version >= 80400
+        ? "WITH RECURSIVE d (oid, base) AS ("
+          " SELECT oid, oid FROM pg_type WHERE oid = ANY ($1::oid[])"
+          " UNION ALL"
+          " SELECT d.oid, t.typbasetype FROM d"
+          " JOIN pg_type t ON t.oid = d.base WHERE t.typtype = 'd')"
+          " SELECT d.oid, t.typname, d.base, e.enumlabel FROM d"
+          " JOIN pg_type t ON t.oid = d.oid"
+          " JOIN pg_type b ON b.oid = d.base AND b.typtype <> 'd'"
+          " LEFT JOIN pg_enum e ON e.enumtypid = d.base"
+          " ORDER BY d.oid, e.%s"
+        : "SELECT t.oid, t.typname,"
+          " CASE WHEN t.typtype = 'd' THEN t.typbasetype ELSE t.oid END,"
+          " NULL FROM pg_type t WHERE t.oid = ANY ($1::oid[])";
+    char sqlbuf[640];
+    snprintf(sqlbuf, sizeof(sqlbuf), sql,
+             version >= 90100 ? "enumsortorder" : "oid");
+    if (debug_mode) {
+        SF_display("DEBUG: looking up column types\n");
+    }
+    const char *params[1] = { oids };
+    PGresult *res = PQexecParams(pgstata_conn, sqlbuf, 1, NULL, params,
+                                 NULL, NULL, 0);
+    free(oids);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        SF_error(PQresultErrorMessage(res));
+        PQclear(res);
+        return;
+    }
+
+    pgstata_typeinfo *info = NULL;
+    for (i=0; i<PQntuples(res); ++i) {
+        const Oid typoid = (Oid) strtoul(PQgetvalue(res, i, 0), NULL, 10);
+        if (info == NULL || info->oid != typoid) {
+            if (session->ntypes == session->types_len) {
+                int want = session->types_len ? 2 * session->types_len : 32;
+                pgstata_typeinfo *types = realloc(session->types,
+                                                  want * sizeof(*types));
+                if (types == NULL) {
+                    break;
+                }
+                session->types = types;
+                session->types_len = want;
+            }
+            info = &session->types[session->ntypes++];
+            info->oid = typoid;
+            info->base = (Oid) strtoul(PQgetvalue(res, i, 2), NULL, 10);
+            snprintf(info->name, sizeof(info->name), "%s",
+                     PQgetvalue(res, i, 1));
+            info->labels = NULL;
+        }
+        if (PQgetisnull(res, i, 3)) {
+            continue;
+        }
+        if (info->labels == NULL
+            && (info->labels = pgstata_dict_new()) == NULL) {
+            continue;
+        }
+        pgstata_dict_append(info->labels, PQgetvalue(res, i, 3),
+                            PQgetlength(res, i, 3), 0);
+    }
+    PQclear(res);
+}
+
+
+/*
+ * Finds the next "KEY": "value" pair in the JSON text at *P, and returns a
+ * malloc()ed, unescaped copy of the value, leaving *P just past it. Returns
+ * NULL at the end of the text, and sets *BAD if the value can't be read.
+ */
+
+static char *
+pgstata_json_next (const char **p, const char *key, int *bad)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+    const char *start = strstr(*p, pattern);
+    if (start == NULL) {
+        return NULL;
+    }
+    start += strlen(pattern);
+    char *val = malloc(strlen(start) + 1);
+    const char *s = start;
+    size_t n = 0;
+    if (val == NULL) {
+        *bad = 1;
+        return NULL;
+    }
+    for (; *s != '"'; ++s) {
+        if (*s == '\000') {
+            break;
+        }
+        if (*s != '\\') {
+            val[n++] = *s;
+            continue;
+        }
+        switch (*++s) {
+            case '"':  val[n++] = '"'; break;
+            case '\\': val[n++] = '\\'; break;
+            case '/':  val[n++] = '/'; break;
+            default:   s = ""; break;   // Nothing else is in a plain name
+        }
+        if (*s == '\000') {
+            break;
+        }
+    }
+    if (*s != '"') {
+        free(val);
+        *bad = 1;
+        return NULL;
+    }
+    val[n] = '\000';
+    *p = s + 1;
+    return val;
+}
+
+
+/*
+ * Derives a freshness token for the result cache, for cachetoken(auto),
+ * from every table SQL_QUERY's plan reads, views included as the tables
+ * under them: their storage files, which TRUNCATE and CLUSTER replace,
+ * counts of the rows ever inserted, updated and deleted in them, and when
+ * those counts were last reset. Returns NULL, for no caching, if the plan
+ * reads no tables, or calls a set-returning function or reads a foreign
+ * table, whose changes the token wouldn't see, or if the token can't be
+ * had; the caller frees it otherwise.
+ */
+
+static char *
+pgstata_cache_token (const char *sql_query, const int debug_mode)
+{
+    pgstata_stmt *stmt = pgstata_stmt_lookup(sql_query, debug_mode);
+    char *token = NULL;
+    int i;
+    if (stmt == NULL) {
+        return NULL;
+    }
+
+    // "EXPLAIN (VERBOSE, FORMAT JSON) EXECUTE stmt('$1', NULL, ...)"
+    size_t len = strlen(stmt->name) + 64;
+    for (i=0; i<pgstata_nparams; ++i) {
+        len += pgstata_params[i] != NULL
+               ? 2 * strlen(pgstata_params[i]) + 8 : 8;
+    }
+    char *sql = malloc(len);
+    if (sql == NULL) {
+        return NULL;
+    }
+    snprintf(sql, len, "EXPLAIN (VERBOSE, FORMAT JSON) EXECUTE %s",
+             stmt->name);
+    for (i=0; i<pgstata_nparams; ++i) {
+        char *lit = NULL;
+        if (pgstata_params[i] != NULL) {
+            lit = PQescapeLiteral(pgstata_conn, pgstata_params[i],
+                                  strlen(pgstata_params[i]));
+            if (lit == NULL) {
+                free(sql);
+                return NULL;
+            }
+        }
+        strcat(sql, i > 0 ? ", " : "(");
+        strcat(sql, lit != NULL ? lit : "NULL");
+        PQfreemem(lit);
+    }
+    strcat(sql, pgstata_nparams > 0 ? ")" : "");
+    if (debug_mode) {
+        SF_display("DEBUG: listing the tables the query reads\n");
+    }
+    PGresult *res = PQexec(pgstata_conn, sql);
+    free(sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+        if (debug_mode) {
+            SF_display("DEBUG: explaining the query failed: ");
+            SF_display(PQresultErrorMessage(res));
+        }
+        PQclear(res);
+        return NULL;
+    }
+
+    // Each scan's "Relation Name" is followed by its "Schema"; the names
+    // are sent back one per line, as "schema.table"
+    const char *plan = PQgetvalue(res, 0, 0);
+    const char *p = plan;
+    char *rel, *nsp, *names = NULL;
+    size_t names_len = 0;
+    int bad = strstr(plan, "\"Function Name\": ") != NULL;
+    while (! bad && (rel = pgstata_json_next(&p, "Relation Name", &bad))) {
+        nsp = pgstata_json_next(&p, "Schema", &bad);
+        char *more = nsp == NULL ? NULL
+            : realloc(names, names_len + strlen(nsp) + strlen(rel) + 3);
+        if (more != NULL) {
+            names = more;
+            names_len += sprintf(names + names_len, "%s%s.%s",
+                                 names_len > 0 ? "\n" : "", nsp, rel);
+        }
+        bad |= more == NULL;
+        free(nsp);
+        free(rel);
+    }
+    PQclear(res);
+    if (bad || names == NULL) {
+        free(names);
+        if (debug_mode) {
+            SF_display(bad ? "DEBUG: the query's plan reads data the cache "
+                             "token can't follow\n"
+                           : "DEBUG: no tables to derive a cache token "
+                             "from\n");
+        }
+        return NULL;
+    }
+
+    // NULL unless every table was found, and none of them is foreign
+    const char *token_sql =
+        "WITH r AS"
+        " (SELECT DISTINCT unnest(string_to_array($1, E'\\n')) AS name)"
+        " SELECT CASE WHEN count(*) = (SELECT count(*) FROM r)"
+        " AND NOT bool_or(c.relkind = 'f') THEN"
+        " string_agg(c.oid || ':' || c.relfilenode || ':'"
+        " || pg_stat_get_tuples_inserted(c.oid)"
+        " || ':' || pg_stat_get_tuples_updated(c.oid)"
+        " || ':' || pg_stat_get_tuples_deleted(c.oid), ',' ORDER BY c.oid)"
+        " || ';' || coalesce((SELECT stats_reset::text FROM pg_stat_database"
+        " WHERE datname = current_database()), '') END"
+        " FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace"
+        " WHERE n.nspname || '.' || c.relname IN (SELECT name FROM r)";
+    const char *params[1] = { names };
+    res = PQexecParams(pgstata_conn, token_sql, 1, NULL, params, NULL, NULL,
+                       0);
+    free(names);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1
+        && ! PQgetisnull(res, 0, 0)) {
+        token = strdup(PQgetvalue(res, 0, 0));
+    }
+    else if (debug_mode) {
+        SF_display("DEBUG: cache token lookup failed: ");
+        SF_display(PQresultErrorMessage(res));
+    }
+    PQclear(res);
+    return token;
+}
+
+
+/*
+ * Copy-mode counterpart of the BEGIN/DECLARE/FETCH sequence: starts a binary
+ * COPY of the query described by DESC, and buffers the first batch of
+ * tuples.
+ */
+
+static pgstata_rc
+pgstata_prepare_copy (const char *sql_query, const int debug_mode,
+                      const PGresult *desc)
+{
+    PGresult *tmpres;
+    int nfields = PQnfields(desc);
+    int need_casts = 0;
+    int i, k;
+    if (pgstata_alloc_columns(nfields)) {
+        SF_error("out of memory describing columns\n");
+        return pgstata_db_error;
+    }
+    for (i=0; i<nfields; ++i) {
+        pgstata_columns[i].binary =
+            pgstata_binary_decodable(pgstata_type_base(PQftype(desc, i)));
+        need_casts |= ! pgstata_columns[i].binary;
+    }
+
+    // Columns without a binary decoder are cast to text by name, which
+    // requires the names to be unique.
+    if (need_casts) {
+        for (i=0; i<nfields; ++i) {
+            for (k=0; k<i; ++k) {
+                if (strcmp(PQfname(desc, i), PQfname(desc, k)) == 0) {
+                    SF_display("Note: duplicate column names; "
+                               "falling back to cursor mode\n");
+                    pgstata_load_mode = pgstata_mode_cursor;
+                    return pgstata_ok;
+                }
+            }
+        }
+    }
+
+    // Build "COPY (SELECT ... FROM (query) AS pgstata_query) TO STDOUT ..."
+    size_t sql_len = strlen(sql_query) + 128;
+    for (i=0; need_casts && i<nfields; ++i) {
+        sql_len += 2 * strlen(PQfname(desc, i)) + 16;
+    }
+    char *copy_sql = malloc(sql_len);
+    if (copy_sql == NULL) {
+        SF_error("out of memory building COPY statement\n");
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    strcpy(copy_sql, "COPY (");
+    if (need_casts) {
+        strcat(copy_sql, "SELECT ");
+        for (i=0; i<nfields; ++i) {
+            const char *fname = PQfname(desc, i);
+            char *ident = PQescapeIdentifier(pgstata_conn, fname,
+                                             strlen(fname));
+            if (i > 0) {
+                strcat(copy_sql, ", ");
+            }
+            strcat(copy_sql, ident);
+            if (! pgstata_columns[i].binary) {
+                strcat(copy_sql, "::text");
+            }
+            PQfreemem(ident);
+        }
+        strcat(copy_sql, " FROM (");
+        strcat(copy_sql, sql_query);
+        strcat(copy_sql, ") AS pgstata_query");
+    }
+    else {
+        strcat(copy_sql, sql_query);
+    }
+    strcat(copy_sql, ") TO STDOUT WITH (FORMAT binary)\n");
+
+    if (debug_mode) {
+        SF_display(copy_sql);
+    }
+    tmpres = PQsendQuery(pgstata_conn, copy_sql)
+             ? pgstata_get_result(debug_mode)
+             : PQmakeEmptyPGresult(pgstata_conn, PGRES_FATAL_ERROR);
+    free(copy_sql);
+    if (tmpres == NULL) {
+        pgstata_cleanup(debug_mode);
+        return pgstata_break;
+    }
+    if (PQresultStatus(tmpres) != PGRES_COPY_OUT) {
+        SF_error(PQresultErrorMessage(tmpres));
+        PQclear(tmpres);
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    PQclear(tmpres);
+    pgstata_in_copy = 1;
+    copy_header_seen = 0;
+
+    pgstata_rc rc = pgstata_copy_fetch(debug_mode);
+    if (rc != pgstata_ok) {
+        pgstata_cleanup(debug_mode);
+        return rc;
+    }
+    pgstata_num_obs_loaded = 0;
+    pgstata_num_obs = copy_ntuples;
+    return pgstata_ok;
+}
+
+
+/*
+ * Reads results from the streamed query into stream_results until they hold
+ * pgstata_batch_bytes, or batchrows() rows if that was given, or the query
+ * has finished. The last result of
+ * the query carries no rows and is dropped, unless the whole query returned
+ * no rows, in which case it is kept for its column descriptions.
+ */
+
+static pgstata_rc
+pgstata_stream_fetch_batch (const int debug_mode)
+{
+    int max_rows = pgstata_batch_rows > 0 ? pgstata_batch_rows
+                                          : PGSTATA_MAX_BATCH_ROWS;
+    size_t batch_bytes = 0;
+    pgstata_stream_release();
+
+    while (pgstata_in_stream && stream_ntuples < max_rows
+           && batch_bytes < pgstata_batch_bytes) {
+        pgstata_rc rc = pgstata_wait_result();
+        if (rc != pgstata_ok) {
+            return rc;
+        }
+        PGresult *res = PQgetResult(pgstata_conn);
+        if (res == NULL) {
+            pgstata_in_stream = 0;
+            if (debug_mode) {
+                SF_display("DEBUG: end of streamed query\n");
+            }
+            break;
+        }
+        switch (PQresultStatus(res)) {
+            case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            case PGRES_TUPLES_CHUNK:
+#endif
+                break;
+            case PGRES_TUPLES_OK:
+                if (stream_nresults > 0 || pgstata_num_vars > 0) {
+                    PQclear(res);
+                    continue;
+                }
+                break;
+            default:
+                SF_error(PQresultErrorMessage(res));
+                PQclear(res);
+                return pgstata_db_error;
+        }
+
+        if (stream_nresults == stream_results_len) {
+            int want = stream_results_len ? 2 * stream_results_len : 1024;
+            PGresult **tmp = realloc(stream_results, sizeof(PGresult *) * want);
+            if (tmp == NULL) {
+                SF_error("out of memory buffering streamed rows\n");
+                PQclear(res);
+                return pgstata_db_error;
+            }
+            stream_results = tmp;
+            stream_results_len = want;
+        }
+        stream_results[stream_nresults++] = res;
+        stream_ntuples += PQntuples(res);
+        batch_bytes += PQresultMemorySize(res);
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * pgstata_stream_fetch_batch(), with the time spent counted as waiting.
+ */
+
+static pgstata_rc
+pgstata_stream_fetch (const int debug_mode)
+{
+    double started = pgstata_clock();
+    pgstata_rc rc = pgstata_stream_fetch_batch(debug_mode);
+    pgstata_wait_secs += pgstata_clock() - started;
+    return rc;
+}
+
+
+/*
+ * Stream-mode counterpart of the BEGIN/DECLARE/FETCH sequence: sends the
+ * query on its own, switches libpq to returning its rows as they arrive, and
+ * buffers the first batch. Column descriptions come from the first result.
+ */
+
+static pgstata_rc
+pgstata_prepare_stream (const char *sql_query, const int debug_mode)
+{
+    if (debug_mode) {
+        SF_display((char *) sql_query);
+        SF_display("\n");
+    }
+    pgstata_stmt *stmt = pgstata_stmt_lookup(sql_query, debug_mode);
+    if (stmt == NULL) {
+        return pgstata_db_error;
+    }
+    if (! PQsendQueryPrepared(pgstata_conn, stmt->name, pgstata_nparams,
+                              (const char * const *) pgstata_params,
+                              NULL, NULL, 0)) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        return pgstata_db_error;
+    }
+    pgstata_in_stream = 1;
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    int row_mode_set = PQsetChunkedRowsMode(pgstata_conn,
+                                            PGSTATA_STREAM_CHUNK_ROWS);
+#else
+    int row_mode_set = PQsetSingleRowMode(pgstata_conn);
+#endif
+    if (! row_mode_set) {
+        SF_error("Internal error: could not enter single-row mode\n");
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+
+    pgstata_num_vars = 0;
+    pgstata_rc rc = pgstata_stream_fetch(debug_mode);
+    if (rc != pgstata_ok) {
+        pgstata_cleanup(debug_mode);
+        return rc;
+    }
+    pgstata_num_obs_loaded = 0;
+    pgstata_num_obs = stream_ntuples;
+    return pgstata_ok;
+}
+
+
+/*
+ * Sends the FETCH for the next cursor batch without waiting for its result,
+ * so that the server and the network work on it while the current batch is
+ * being stored. pgstata_collect_fetch() picks it up.
+ */
+
+static pgstata_rc
+pgstata_send_fetch (const int debug_mode)
+{
+    char fetch_sql[256];
+    *fetch_sql = '\000';
+    snprintf(fetch_sql, 255, "FETCH FORWARD %d FROM pgstata_cursor\n",
+             pgstata_fetch_rows);
+    if (debug_mode) {
+        SF_display(fetch_sql);
+    }
+    if (! PQsendQuery(pgstata_conn, fetch_sql)) {
+        SF_error("error: ");
+        SF_error(PQerrorMessage(pgstata_conn));
+        return pgstata_db_error;
+    }
+    pgstata_fetch_in_flight = 1;
+    return pgstata_ok;
+}
+
+
+/*
+ * Waits for the FETCH sent by pgstata_send_fetch() and makes its result the
+ * current batch in pgstata_res. If no FETCH is in flight, the cursor is
+ * known to be exhausted and the current batch becomes an empty result.
+ */
+
+static pgstata_rc
+pgstata_collect_fetch (const int debug_mode)
+{
+    if (! pgstata_fetch_in_flight) {
+        pgstata_res = PQmakeEmptyPGresult(pgstata_conn, PGRES_TUPLES_OK);
+        return pgstata_ok;
+    }
+
+    // A FETCH left in flight is cancelled by pgstata_cleanup()
+    double started = pgstata_clock();
+    pgstata_rc rc = pgstata_wait_result();
+    if (rc != pgstata_ok) {
+        pgstata_wait_secs += pgstata_clock() - started;
+        return rc;
+    }
+    pgstata_res = PQgetResult(pgstata_conn);
+    PGresult *extra;
+    while ((extra = PQgetResult(pgstata_conn)) != NULL) {
+        PQclear(extra);
+    }
+    pgstata_fetch_in_flight = 0;
+    pgstata_wait_secs += pgstata_clock() - started;
+
+    if (PQresultStatus(pgstata_res) != PGRES_TUPLES_OK) {
+        SF_error("error: ");
+        SF_error(PQresultErrorMessage(pgstata_res));
+        return pgstata_db_error;
+    }
+    if (debug_mode) {
+        SF_display("DEBUG: collected prefetched batch\n");
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * A FETCH which returns fewer rows than were asked for has exhausted the
+ * cursor. Otherwise the next FETCH is sized from RES and put in flight
+ * straight away.
+ */
+
+static inline pgstata_rc
+pgstata_prefetch_after (const PGresult *res, const int debug_mode)
+{
+    if (PQntuples(res) < pgstata_fetch_rows) {
+        return pgstata_ok;
+    }
+    pgstata_fetch_rows = pgstata_next_fetch_rows(res);
+    return pgstata_send_fetch(debug_mode);
+}
+
+
+/*
+ * Opens a transaction, DECLAREs the query cursor and FETCHes the first batch
+ * into pgstata_res. The FETCH for the second batch is sent before returning.
+ */
+
+static pgstata_rc
+pgstata_prepare_cursor (const char *sql_query, const int debug_mode)
+{
+    PGresult *tmpres;
+    char fetch_sql[64];
+
+    static char *sql_begin_trans = "BEGIN TRANSACTION\n";
+    if (debug_mode) {
+        SF_display(sql_begin_trans);
+    }
+    tmpres = PQexec(pgstata_conn, sql_begin_trans);
+    PGRESULT_CHECK(tmpres, PGRES_COMMAND_OK, debug_mode);
+    PQclear(tmpres);
+    pgstata_in_transaction = 1;
+
+    const char *fmt = "DECLARE pgstata_cursor CURSOR FOR %s\n";
+    size_t declare_len = strlen(fmt) + strlen(sql_query) + 1;
+    char *declare_sql = malloc(declare_len);
+    if (declare_sql == NULL) {
+        SF_error("out of memory building DECLARE statement\n");
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    snprintf(declare_sql, declare_len, fmt, sql_query);
+    if (debug_mode) {
+        SF_display(declare_sql);
+    }
+    tmpres = PQexec(pgstata_conn, declare_sql);
+    free(declare_sql);
+    PGRESULT_CHECK(tmpres, PGRES_COMMAND_OK, debug_mode);
+    PQclear(tmpres);
+
+    // Step the cursor forward so that we have type information available,
+    // and so that populate_workspace() has something to chew on.
+    snprintf(fetch_sql, sizeof(fetch_sql),
+             "FETCH FORWARD %d FROM pgstata_cursor\n",
+             pgstata_fetch_rows);
+    if (debug_mode) {
+        SF_display(fetch_sql);
+    }
+    double started = pgstata_clock();
+    if (! PQsendQuery(pgstata_conn, fetch_sql)) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    pgstata_res = pgstata_get_result(debug_mode);
+    pgstata_wait_secs += pgstata_clock() - started;
+    if (pgstata_res == NULL) {
+        pgstata_cleanup(debug_mode);
+        return pgstata_break;
+    }
+    PGRESULT_CHECK(pgstata_res, PGRES_TUPLES_OK, debug_mode);
+    pgstata_num_obs_loaded = 0;
+    pgstata_num_obs = PQntuples(pgstata_res);
+    return pgstata_prefetch_after(pgstata_res, debug_mode);
+}
+
+
+/*
+ * Works out the codes of the encoded columns' values in the current batch,
+ * adding any new values to their dictionaries. NULLs get code 0. A column
+ * whose dictionary fills up is flagged as overflowing, and its codes for
+ * the batch mean nothing. Coding a batch a second time gives the same
+ * codes. In copy mode the batch must have been split into fields.
+ */
+
+static inline pgstata_rc
+pgstata_encode_value (pgstata_column *col, const int row, const char *val,
+                      const int len)
+{
+    int code;
+    char msg[256];
+    if (col->encode == pgstata_encode_enum) {
+        code = pgstata_dict_find_sorted(col->dict, val, len);
+        if (code == 0) {
+            snprintf(msg, 255, "%s: value is not a label of its ENUM type\n",
+                     col->name);
+            SF_error(msg);
+            pgstata_type_forget(col->oid);
+            return pgstata_db_error;
+        }
+    }
+    else {
+        code = pgstata_dict_intern(col->dict, val, len,
+                                   PGSTATA_MAX_ENCODE_VALUES);
+        if (code < 0) {
+            SF_error("out of memory encoding values\n");
+            return pgstata_db_error;
+        }
+        col->overflow |= (code == 0);
+    }
+    col->codes[row] = code;
+    return pgstata_ok;
+}
+
+static pgstata_rc
+pgstata_encode_result (const PGresult *res, const int first_row)
+{
+    const int ntups = PQntuples(res);
+    int i, j;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        if (col->encode == pgstata_encode_none || col->overflow) {
+            continue;
+        }
+        for (i=0; i<ntups; ++i) {
+            if (PQgetisnull(res, i, j)) {
+                col->codes[first_row + i] = 0;
+            }
+            else if (pgstata_encode_value(col, first_row + i,
+                                          PQgetvalue(res, i, j),
+                                          PQgetlength(res, i, j))) {
+                return pgstata_db_error;
+            }
+        }
+    }
+    return pgstata_ok;
+}
+
+static pgstata_rc
+pgstata_encode_copy_batch (const int ntups)
+{
+    const int nvars = pgstata_num_vars;
+    int i, j;
+    for (j=0; j<nvars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        if (col->encode == pgstata_encode_none || col->overflow) {
+            continue;
+        }
+        for (i=0; i<ntups; ++i) {
+            const int len = copy_field_lens[(size_t) i * nvars + j];
+            if (len < 0) {
+                col->codes[i] = 0;
+            }
+            else if (pgstata_encode_value(col, i,
+                         copy_fields[(size_t) i * nvars + j], len)) {
+                return pgstata_db_error;
+            }
+        }
+    }
+    return pgstata_ok;
+}
+
+static pgstata_rc
+pgstata_encode_batch (const int ntups)
+{
+    int i, j, any = 0;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        if (col->encode == pgstata_encode_none) {
+            continue;
+        }
+        any = 1;
+        if (col->codes_len < ntups) {
+            int *codes = realloc(col->codes, ntups * sizeof(int));
+            if (codes == NULL) {
+                SF_error("out of memory encoding values\n");
+                return pgstata_db_error;
+            }
+            col->codes = codes;
+            col->codes_len = ntups;
+        }
+    }
+    if (! any) {
+        return pgstata_ok;
+    }
+
+    switch (pgstata_load_mode) {
+        case pgstata_mode_copy:
+            return pgstata_encode_copy_batch(ntups);
+        case pgstata_mode_stream: {
+            int first_row = 0;
+            for (i=0; i<stream_nresults; ++i) {
+                if (pgstata_encode_result(stream_results[i], first_row)) {
+                    return pgstata_db_error;
+                }
+                first_row += PQntuples(stream_results[i]);
+            }
+            return pgstata_ok;
+        }
+        default:
+            return pgstata_encode_result(pgstata_res, 0);
+    }
+}
+
+
+/*
+ * Finds the longest value in the current batch of each string column which
+ * is still a strN, into batch_len. In copy mode the batch must have been
+ * split into fields.
+ */
+
+static inline int
+pgstata_measured (const pgstata_column *col)
+{
+    return col->decode == NULL && col->encode == pgstata_encode_none
+           && ! col->strl;
+}
+
+static void
+pgstata_measure_result (const PGresult *res)
+{
+    const int ntups = PQntuples(res);
+    int i, j;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        if (! pgstata_measured(col)) {
+            continue;
+        }
+        int longest = col->batch_len;
+        for (i=0; i<ntups; ++i) {
+            const int len = PQgetlength(res, i, j);
+            if (len > longest) {
+                longest = len;
+            }
+        }
+        col->batch_len = longest;
+    }
+}
+
+static void
+pgstata_measure_batch (const int ntups)
+{
+    const int nvars = pgstata_num_vars;
+    int i, j;
+    for (j=0; j<nvars; ++j) {
+        pgstata_columns[j].batch_len = 0;
+    }
+    switch (pgstata_load_mode) {
+        case pgstata_mode_copy:
+            for (j=0; j<nvars; ++j) {
+                pgstata_column *col = &pgstata_columns[j];
+                if (! pgstata_measured(col)) {
+                    continue;
+                }
+                int longest = 0;
+                for (i=0; i<ntups; ++i) {
+                    const int len = copy_field_lens[(size_t) i * nvars + j];
+                    if (len > longest) {
+                        longest = len;
+                    }
+                }
+                col->batch_len = longest;
+            }
+            break;
+        case pgstata_mode_stream:
+            for (i=0; i<stream_nresults; ++i) {
+                pgstata_measure_result(stream_results[i]);
+            }
+            break;
+        default:
+            pgstata_measure_result(pgstata_res);
+            break;
+    }
+}
+
+
+/*
+ * Reports a value which could not be converted or stored.
+ */
+
+static void
+pgstata_store_failed (const int j, const int stata_obs, const int parse_error)
+{
+    char msg[256];
+    if (parse_error) {
+        snprintf(msg, 255, "failed to parse oid:%d value at (%d,%d)\n",
+                 pgstata_columns[j].oid, stata_obs, j + 1);
+    }
+    else {
+        snprintf(msg, 255, "failed to store oid:%d at (%d,%d)\n",
+                 pgstata_columns[j].oid, stata_obs, j + 1);
+    }
+    SF_error(msg);
+}
+
+
+/*
+ * Decodes the current batch of each numeric column into its values buffer,
+ * leaving NULLs missing, and counts up the batch's statistics for every
+ * column. Decoding the same batch again gives the same values and counts.
+ * In copy mode the batch must have been split into fields.
+ */
+
+static inline void
+pgstata_count_value (pgstata_stats *stats, const double value)
+{
+    if (value >= SV_missval) {
+        stats->missing += 1;
+    }
+    else {
+        pgstata_stats_add(stats, value);
+    }
+}
+
+// Decodes numeric column J of RES into VALUES, counting into STATS. Returns
+// the row of a value which can't be parsed, or -1. Called by parallel()
+// workers too, so mustn't call into Stata.
+static int
+pgstata_decode_column (const PGresult *res, const int j, double *values,
+                       pgstata_stats *stats)
+{
+    const pgstata_decoder decode = pgstata_columns[j].decode;
+    const int ntups = PQntuples(res);
+    int i;
+    for (i=0; i<ntups; ++i) {
+        if (PQgetisnull(res, i, j)) {
+            values[i] = SV_missval;
+            stats->missing += 1;
+            continue;
+        }
+        int drc = decode(PQgetvalue(res, i, j), PQgetlength(res, i, j),
+                         &values[i]);
+        if (drc < 0) {
+            return i;
+        }
+        stats->lossy += drc;
+        pgstata_count_value(stats, values[i]);
+    }
+    return -1;
+}
+
+// The profile option: which kind of column COL counts as
+static inline pgstata_prof_class
+pgstata_prof_class_of (const pgstata_column *col)
+{
+    if (col->decode == NULL) {
+        return pgstata_prof_string;
+    }
+    switch (col->oid) {
+        case BOOLOID:
+            return pgstata_prof_bool;
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+            return pgstata_prof_int;
+        case FLOAT4OID:
+        case FLOAT8OID:
+            return pgstata_prof_float;
+        case NUMERICOID:
+            return pgstata_prof_numeric;
+        default:
+            return pgstata_prof_datetime;
+    }
+}
+
+// The profile option: charges the time since SINCE to the kind of column J,
+// if J is a column, and returns the time now
+static inline double
+pgstata_prof_lap (const double since, const int j)
+{
+    const double now = pgstata_clock();
+    if (j >= 0) {
+        pgstata_prof.decode_secs[pgstata_prof_class_of(&pgstata_columns[j])]
+            += now - since;
+    }
+    return now;
+}
+
+static pgstata_rc
+pgstata_decode_result (const PGresult *res, const int first_row)
+{
+    const int first_obs = 1 + pgstata_num_obs_loaded + first_row;
+    const int ntups = PQntuples(res);
+    double lap = pgstata_prof.on ? pgstata_clock() : 0;
+    int i, j;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        const pgstata_decoder decode = col->decode;
+        if (pgstata_prof.on) {
+            lap = pgstata_prof_lap(lap, j - 1);
+        }
+        if (decode == NULL) {
+            int nulls = 0;
+            for (i=0; i<ntups; ++i) {
+                nulls += col->encode != pgstata_encode_none
+                         ? col->codes[first_row + i] == 0
+                         : PQgetisnull(res, i, j);
+            }
+            col->batch_stats.missing += nulls;
+            col->batch_stats.nonmissing += ntups - nulls;
+            continue;
+        }
+
+        // Parallel mode: a worker has decoded the batch already
+        if (pgstata_par_batch != NULL) {
+            memcpy(col->values + first_row, pgstata_par_batch->values[j],
+                   ntups * sizeof(double));
+            pgstata_stats_merge(&col->batch_stats,
+                                &pgstata_par_batch->stats[j]);
+            continue;
+        }
+        i = pgstata_decode_column(res, j, col->values + first_row,
+                                  &col->batch_stats);
+        if (i >= 0) {
+            pgstata_store_failed(j, first_obs + i, 1);
+            return pgstata_db_error;
+        }
+    }
+    if (pgstata_prof.on) {
+        pgstata_prof_lap(lap, j - 1);
+    }
+    return pgstata_ok;
+}
+
+
+static pgstata_rc
+pgstata_decode_copy_batch (const int ntups)
+{
+    const int first_obs = 1 + pgstata_num_obs_loaded;
+    const int nvars = pgstata_num_vars;
+    double lap = pgstata_prof.on ? pgstata_clock() : 0;
+    int i, j;
+    for (j=0; j<nvars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        const pgstata_decoder decode = col->decode;
+        if (pgstata_prof.on) {
+            lap = pgstata_prof_lap(lap, j - 1);
+        }
+        if (pgstata_in_copy) {
+            PQconsumeInput(pgstata_conn);
+        }
+        if (decode == NULL) {
+            int nulls = 0;
+            for (i=0; i<ntups; ++i) {
+                nulls += col->encode != pgstata_encode_none
+                         ? col->codes[i] == 0
+                         : copy_field_lens[(size_t) i * nvars + j] < 0;
+            }
+            col->batch_stats.missing += nulls;
+            col->batch_stats.nonmissing += ntups - nulls;
+            continue;
+        }
+        for (i=0; i<ntups; ++i) {
+            const char *val = copy_fields[(size_t) i * nvars + j];
+            const int len = copy_field_lens[(size_t) i * nvars + j];
+            if (len < 0) {
+                col->values[i] = SV_missval;
+                col->batch_stats.missing += 1;
+                continue;
+            }
+
+            // Text-cast columns need NUL-terminating for the text decoders
+            if (! col->binary) {
+                val = pgstata_scratch_copy(val, len);
+                if (val == NULL) {
+                    SF_error("out of memory decoding COPY value\n");
+                    return pgstata_db_error;
+                }
+            }
+            int drc = decode(val, len, &col->values[i]);
+            if (drc < 0) {
+                pgstata_store_failed(j, first_obs + i, 1);
+                return pgstata_db_error;
+            }
+            col->batch_stats.lossy += drc;
+            pgstata_count_value(&col->batch_stats, col->values[i]);
+        }
+    }
+    if (pgstata_prof.on) {
+        pgstata_prof_lap(lap, j - 1);
+    }
+    return pgstata_ok;
+}
+
+static pgstata_rc
+pgstata_decode_batch (const int ntups)
+{
+    int i, j;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        pgstata_stats_reset(&col->batch_stats);
+        if (col->decode != NULL && col->values_len < ntups) {
+            double *values = realloc(col->values, ntups * sizeof(double));
+            if (values == NULL) {
+                SF_error("out of memory decoding values\n");
+                return pgstata_db_error;
+            }
+            col->values = values;
+            col->values_len = ntups;
+        }
+    }
+
+    switch (pgstata_load_mode) {
+        case pgstata_mode_copy:
+            return pgstata_decode_copy_batch(ntups);
+        case pgstata_mode_stream: {
+            int first_row = 0;
+            for (i=0; i<stream_nresults; ++i) {
+                if (pgstata_decode_result(stream_results[i], first_row)) {
+                    return pgstata_db_error;
+                }
+                first_row += PQntuples(stream_results[i]);
+                if (pgstata_in_stream && i % PGSTATA_COPY_CONSUME_ROWS == 0) {
+                    PQconsumeInput(pgstata_conn);
+                }
+            }
+            return pgstata_ok;
+        }
+        default:
+            return pgstata_decode_result(pgstata_res, 0);
+    }
+}
+
+
+/*
+ * Widens the Stata type of string column COL to hold the longest value in
+ * the batch: to a longer strN, up to Stata's limit, and beyond that to a
+ * strL if the running Stata has them. Returns true if the type changed.
+ */
+
+static int
+pgstata_fit_string (pgstata_column *col)
+{
+    if (col->strl || col->batch_len <= col->str_width) {
+        return 0;
+    }
+    if (col->batch_len > pgstata_max_str && pgstata_strl_ok) {
+        col->strl = 1;
+        strcpy(col->type, "strL");
+        return 1;
+    }
+    int width = col->batch_len < pgstata_max_str ? col->batch_len
+                                                 : pgstata_max_str;
+    if (width <= col->str_width || width < 1 || width > PGSTATA_MAX_STRN) {
+        return 0;
+    }
+    col->str_width = width;
+    snprintf(col->type, sizeof(col->type), "str%d", width);
+    return 1;
+}
+
+
+/*
+ * Decides whether column COL, whose type mapping and conversion plan are
+ * done, is to be encoded: it is if encode() names it or autoencode was
+ * given, it is a string column, and (for autoencode) its first batch turns
+ * out repetitive enough. ENUM_DICT is its ENUM type's dictionary, if it has
+ * one, and is either taken over by COL or freed. Returns non-zero if
+ * encode() names a column which can't be encoded.
+ */
+
+static int
+pgstata_plan_encoding (pgstata_column *col, pgstata_dict *enum_dict,
+                       const char *encode_names, const int autoencode)
+{
+    const int named = pgstata_word_in_list(encode_names, col->name);
+    char msg[256];
+    if (enum_dict != NULL && (named || autoencode)) {
+        col->encode = pgstata_encode_enum;
+        col->dict = enum_dict;
+        return 0;
+    }
+    pgstata_dict_free(enum_dict);
+    if (col->decode != NULL) {
+        if (named) {
+            snprintf(msg, 255, "encode(): column %s is not a string\n",
+                     col->name);
+            SF_error(msg);
+            return 1;
+        }
+        return 0;
+    }
+    if (named || autoencode) {
+        col->dict = pgstata_dict_new();
+        if (col->dict == NULL) {
+            SF_error("out of memory encoding values\n");
+            return 1;
+        }
+        col->encode = pgstata_encode_hash;
+    }
+    return 0;
+}
+
+
+/*
+ * Sizes the Stata types of string columns from the first batch. Codes the
+ * first batch of the encoded columns, drops the autoencode ones whose values
+ * don't repeat enough (or any with too many of them), and gives the rest the
+ * narrowest integer type for their codes. The other string columns get the
+ * narrowest strN which holds their values, and the narrowed numeric columns
+ * the narrowest type which holds theirs exactly. Rewrites TYPES, the _types
+ * macro, to match, and lists the encoded columns in ENCODED. Checks that
+ * encode() only names columns which exist.
+ */
+
+static pgstata_rc
+pgstata_plan_first_batch (char *types, char *encoded,
+                          const char *encode_names)
+{
+    char msg[256];
+    int j, ntups;
+    const char *p;
+
+    for (p=encode_names; *p != '\000'; ) {
+        char word[64];
+        int n = 0;
+        while (*p == ' ') {
+            ++p;
+        }
+        while (*p != '\000' && *p != ' ') {
+            if (n < 63) {
+                word[n++] = *p;
+            }
+            ++p;
+        }
+        word[n] = '\000';
+        for (j=0; n > 0 && j<pgstata_num_vars; ++j) {
+            if (strcmp(word, pgstata_columns[j].name) == 0) {
+                break;
+            }
+        }
+        if (n > 0 && j == pgstata_num_vars) {
+            snprintf(msg, 255, "encode(): no column named %s\n", word);
+            SF_error(msg);
+            return pgstata_usage_error;
+        }
+    }
+
+    switch (pgstata_load_mode) {
+        case pgstata_mode_copy:   ntups = copy_ntuples; break;
+        case pgstata_mode_stream: ntups = stream_ntuples; break;
+        default:                  ntups = PQntuples(pgstata_res); break;
+    }
+    if (pgstata_load_mode == pgstata_mode_copy && ntups > 0) {
+        pgstata_rc rc = pgstata_split_copy_batch(ntups);
+        if (rc) {
+            return rc;
+        }
+    }
+    if (pgstata_encode_batch(ntups)) {
+        return pgstata_db_error;
+    }
+
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        if (col->encode == pgstata_encode_hash) {
+            const int repeats = ntups >= PGSTATA_AUTOENCODE_MIN_ROWS
+                && col->dict->nvalues * PGSTATA_AUTOENCODE_REPEATS <= ntups;
+            if (col->overflow) {
+                snprintf(msg, 255, "note: %s has more than %d distinct "
+                         "values; loading it as a string\n",
+                         col->name, PGSTATA_MAX_ENCODE_VALUES);
+                SF_display(msg);
+            }
+            if (col->overflow || (! repeats
+                    && ! pgstata_word_in_list(encode_names, col->name))) {
+                pgstata_dict_free(col->dict);
+                col->dict = NULL;
+                col->encode = pgstata_encode_none;
+                col->overflow = 0;
+            }
+        }
+        if (col->encode != pgstata_encode_none) {
+            strcpy(col->type, pgstata_code_type(col->dict->nvalues));
+            strcat(encoded, col->name);
+            strcat(encoded, " ");
+        }
+    }
+
+    pgstata_measure_batch(ntups);
+    if (pgstata_decode_batch(ntups)) {
+        return pgstata_db_error;
+    }
+    *types = '\000';
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        if (pgstata_measured(col)) {
+            if (! pgstata_fit_string(col) && col->str_width == 0) {
+                col->str_width = 1;
+                strcpy(col->type, "str1");
+            }
+        }
+        if (col->narrow) {
+            strcpy(col->type, pgstata_narrow_type(&col->batch_stats));
+        }
+        strcat(types, col->type);
+        strcat(types, " ");
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * Parallel mode. The query is split into ranges of a key column, one per
+ * worker, between the key's minimum and maximum; rows with a NULL key go
+ * with the lowest range. Each worker has its own connection, in a
+ * transaction using the snapshot exported by the main connection's, so that
+ * between them they see just what a single cursor would. A worker FETCHes
+ * its range a batch at a time, decodes the numeric columns and queues the
+ * batch; pgstata_collect_batch() hands them to populate_next() to store, in
+ * whatever order they turn up.
+ */
+
+static void
+pgstata_worker_fail (pgstata_worker *worker, const char *msg)
+{
+    pthread_mutex_lock(&pgstata_queue_lock);
+    snprintf(worker->error, sizeof(worker->error), "%s", msg);
+    if (pgstata_worker_failed == NULL) {
+        pgstata_worker_failed = worker;
+    }
+    pthread_cond_signal(&pgstata_queue_ready);
+    pthread_mutex_unlock(&pgstata_queue_lock);
+}
+
+// Decodes the numeric columns of RES, which the batch returned takes over.
+// Returns NULL, having freed RES, if that fails.
+static pgstata_batch *
+pgstata_worker_decode (pgstata_worker *worker, PGresult *res)
+{
+    const int ntups = PQntuples(res);
+    char msg[256];
+    int j;
+
+    pgstata_batch *batch = calloc(1, sizeof(pgstata_batch));
+    if (batch == NULL) {
+        PQclear(res);
+        pgstata_worker_fail(worker, "out of memory decoding values\n");
+        return NULL;
+    }
+    batch->res = res;
+    batch->nvars = pgstata_num_vars;
+    batch->values = calloc(pgstata_num_vars, sizeof(double *));
+    batch->stats = malloc(pgstata_num_vars * sizeof(pgstata_stats));
+    if (batch->values == NULL || batch->stats == NULL) {
+        pgstata_batch_free(batch);
+        pgstata_worker_fail(worker, "out of memory decoding values\n");
+        return NULL;
+    }
+    for (j=0; j<pgstata_num_vars; ++j) {
+        const pgstata_column *col = &pgstata_columns[j];
+        pgstata_stats_reset(&batch->stats[j]);
+        if (col->decode == NULL) {
+            continue;
+        }
+        batch->values[j] = malloc((ntups > 0 ? ntups : 1) * sizeof(double));
+        if (batch->values[j] == NULL) {
+            pgstata_batch_free(batch);
+            pgstata_worker_fail(worker, "out of memory decoding values\n");
+            return NULL;
+        }
+        int row = pgstata_decode_column(res, j, batch->values[j],
+                                        &batch->stats[j]);
+        if (row >= 0) {
+            snprintf(msg, 255, "failed to parse oid:%d value \"%.32s\" of "
+                     "column %s\n", col->oid, PQgetvalue(res, row, j),
+                     col->name);
+            pgstata_batch_free(batch);
+            pgstata_worker_fail(worker, msg);
+            return NULL;
+        }
+    }
+    return batch;
+}
+
+// Queues BATCH, waiting for room. Returns non-zero if the workers are being
+// stopped, in which case BATCH is left to the caller.
+static int
+pgstata_queue_push (pgstata_batch *batch)
+{
+    pthread_mutex_lock(&pgstata_queue_lock);
+    while (pgstata_queued >= PGSTATA_QUEUED_BATCHES * pgstata_num_workers
+           && ! pgstata_workers_stop) {
+        pthread_cond_wait(&pgstata_queue_space, &pgstata_queue_lock);
+    }
+    if (pgstata_workers_stop) {
+        pthread_mutex_unlock(&pgstata_queue_lock);
+        return 1;
+    }
+    if (pgstata_queue_tail != NULL) {
+        pgstata_queue_tail->next = batch;
+    }
+    else {
+        pgstata_queue_head = batch;
+    }
+    pgstata_queue_tail = batch;
+    ++pgstata_queued;
+    pthread_cond_signal(&pgstata_queue_ready);
+    pthread_mutex_unlock(&pgstata_queue_lock);
+    return 0;
+}
+
+static void *
+pgstata_worker_main (void *arg)
+{
+    pgstata_worker *worker = arg;
+    int rows = pgstata_fetch_rows;
+    char fetch_sql[64];
+
+    for (;;) {
+        pthread_mutex_lock(&pgstata_queue_lock);
+        int stop = pgstata_workers_stop;
+        pthread_mutex_unlock(&pgstata_queue_lock);
+        if (stop) {
+            break;
+        }
+
+        snprintf(fetch_sql, sizeof(fetch_sql),
+                 "FETCH FORWARD %d FROM pgstata_cursor", rows);
+        PGresult *res = PQexec(worker->conn, fetch_sql);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            pgstata_worker_fail(worker, PQresultErrorMessage(res));
+            PQclear(res);
+            break;
+        }
+        const int ntups = PQntuples(res);
+        const int next_rows = pgstata_next_fetch_rows(res);
+        if (ntups == 0) {
+            PQclear(res);
+            break;
+        }
+        pgstata_batch *batch = pgstata_worker_decode(worker, res);
+        if (batch == NULL) {
+            break;
+        }
+        if (pgstata_queue_push(batch)) {
+            pgstata_batch_free(batch);
+            break;
+        }
+        if (ntups < rows) {
+            break;
+        }
+        rows = next_rows;
+    }
+
+    pthread_mutex_lock(&pgstata_queue_lock);
+    worker->done = 1;
+    --pgstata_workers_running;
+    pthread_cond_signal(&pgstata_queue_ready);
+    pthread_mutex_unlock(&pgstata_queue_lock);
+    return NULL;
+}
+
+
+// Runs SQL, which returns no rows, on CONN
+static pgstata_rc
+pgstata_exec_command (PGconn *conn, const char *sql, const int debug_mode)
+{
+    if (debug_mode) {
+        SF_display((char *) sql);
+        SF_display("\n");
+    }
+    PGresult *res = PQexec(conn, sql);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        SF_error(PQresultErrorMessage(res));
+        PQclear(res);
+        return pgstata_db_error;
+    }
+    PQclear(res);
+    return pgstata_ok;
+}
+
+
+/*
+ * Opens a transaction on the main connection and exports its snapshot,
+ * splits SQL_QUERY into NWORKERS ranges of column KEY, and connects a
+ * worker for each, with a cursor DECLAREd over its range. The workers don't
+ * start FETCHing until pgstata_start_workers(), once the columns have been
+ * planned.
+ */
+
+static pgstata_rc
+pgstata_prepare_parallel (const char *sql_query, const char *key,
+                          int nworkers, const int debug_mode)
+{
+    char msg[256];
+    char snapshot[64];
+    pgstata_rc rc = pgstata_ok;
+    int w;
+
+    rc = pgstata_exec_command(pgstata_conn, "BEGIN TRANSACTION ISOLATION "
+                              "LEVEL REPEATABLE READ", debug_mode);
+    if (rc) {
+        pgstata_cleanup(debug_mode);
+        return rc;
+    }
+    pgstata_in_transaction = 1;
+
+    PGresult *res = PQexec(pgstata_conn, "SELECT pg_export_snapshot()");
+    PGRESULT_CHECK(res, PGRES_TUPLES_OK, debug_mode);
+    snprintf(snapshot, sizeof(snapshot), "%s", PQgetvalue(res, 0, 0));
+    PQclear(res);
+
+    // The key's range, as seen by the snapshot
+    char *ident = PQescapeIdentifier(pgstata_conn, key, strlen(key));
+    if (ident == NULL) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        pgstata_cleanup(debug_mode);
+        return pgstata_usage_error;
+    }
+    const size_t sql_len = strlen(sql_query) + 2 * strlen(ident) + 160;
+    char *sql = malloc(sql_len);
+    if (sql == NULL) {
+        PQfreemem(ident);
+        SF_error("out of memory splitting the query\n");
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    snprintf(sql, sql_len, "SELECT min(%s)::float8, max(%s)::float8 "
+             "FROM (%s) AS pgstata_q", ident, ident, sql_query);
+    if (debug_mode) {
+        SF_display(sql);
+        SF_display("\n");
+    }
+    double started = pgstata_clock();
+    res = PQexec(pgstata_conn, sql);
+    pgstata_wait_secs += pgstata_clock() - started;
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        snprintf(msg, 255, "parallel(): can't split the query by key %s\n",
+                 key);
+        SF_error(msg);
+        SF_error(PQresultErrorMessage(res));
+        PQclear(res);
+        PQfreemem(ident);
+        free(sql);
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    double lo = 0, hi = 0;
+    if (PQgetisnull(res, 0, 0)) {
+        nworkers = 1;
+    }
+    else {
+        lo = strtod(PQgetvalue(res, 0, 0), NULL);
+        hi = strtod(PQgetvalue(res, 0, 1), NULL);
+    }
+    PQclear(res);
+
+    pgstata_workers = calloc(nworkers, sizeof(pgstata_worker));
+    if (pgstata_workers == NULL) {
+        PQfreemem(ident);
+        free(sql);
+        SF_error("out of memory starting workers\n");
+        pgstata_cleanup(debug_mode);
+        return pgstata_db_error;
+    }
+    pgstata_num_workers = nworkers;
+
+    for (w=0; w<nworkers && rc == pgstata_ok; ++w) {
+        pgstata_worker *worker = &pgstata_workers[w];
+        worker->conn = PQconnectdb(pgstata_cur_session->conninfo);
+        if (PQstatus(worker->conn) != CONNECTION_OK) {
+            SF_error("Database error: worker connection failed.\n");
+            SF_error(PQerrorMessage(worker->conn));
+            rc = pgstata_db_error;
+            break;
+        }
+        worker->cancel = PQgetCancel(worker->conn);
+
+        // Range W runs from boundary W to boundary W+1, where boundary 0
+        // and boundary NWORKERS are open
+        double from = ceil(lo + (hi - lo) * w / nworkers);
+        double to = ceil(lo + (hi - lo) * (w + 1) / nworkers);
+        int n = snprintf(sql, sql_len, "DECLARE pgstata_cursor NO SCROLL "
+                         "CURSOR FOR SELECT * FROM (%s) AS pgstata_q",
+                         sql_query);
+        if (nworkers == 1) {
+            // the whole query
+        }
+        else if (w == 0) {
+            snprintf(sql + n, sql_len - n, " WHERE %s < %.0f OR %s IS NULL",
+                     ident, to, ident);
+        }
+        else if (w == nworkers - 1) {
+            snprintf(sql + n, sql_len - n, " WHERE %s >= %.0f", ident, from);
+        }
+        else {
+            snprintf(sql + n, sql_len - n, " WHERE %s >= %.0f AND %s < %.0f",
+                     ident, from, ident, to);
+        }
+
+        snprintf(msg, 255, "SET TRANSACTION SNAPSHOT '%s'", snapshot);
+        if (pgstata_exec_command(worker->conn, "SET DateStyle TO ISO",
+                                 debug_mode)
+            || pgstata_exec_command(worker->conn, "BEGIN TRANSACTION "
+                                    "ISOLATION LEVEL REPEATABLE READ "
+                                    "READ ONLY", debug_mode)
+            || pgstata_exec_command(worker->conn, msg, debug_mode)
+            || pgstata_exec_command(worker->conn, sql, debug_mode)) {
+            rc = pgstata_db_error;
+        }
+    }
+    PQfreemem(ident);
+    free(sql);
+    if (rc) {
+        pgstata_cleanup(debug_mode);
+    }
+    return rc;
+}
+
+
+/*
+ * Waits for a worker to queue a batch and makes it the current one, with
+ * its rows in pgstata_res. Once the workers have all finished and their
+ * batches have been taken, they are stopped and the current batch becomes
+ * an empty result.
+ */
+
+static pgstata_rc
+pgstata_collect_batch (const int debug_mode)
+{
+    double started = pgstata_clock();
+    pgstata_batch *batch = NULL;
+    int interrupted = 0;
+    pthread_mutex_lock(&pgstata_queue_lock);
+    while (pgstata_queue_head == NULL && pgstata_workers_running > 0
+           && pgstata_worker_failed == NULL && ! interrupted) {
+        // Wake up now and then to look for Break
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += PGSTATA_POLL_MSECS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_nsec -= 1000000000L;
+            ++until.tv_sec;
+        }
+        pthread_cond_timedwait(&pgstata_queue_ready, &pgstata_queue_lock,
+                               &until);
+        interrupted = pgstata_break_pressed();
+    }
+    pgstata_worker *failed = pgstata_worker_failed;
+    if (interrupted) {
+        pthread_mutex_unlock(&pgstata_queue_lock);
+        pgstata_wait_secs += pgstata_clock() - started;
+        return pgstata_break;   // pgstata_cleanup() cancels the workers
+    }
+    if (failed == NULL && pgstata_queue_head != NULL) {
+        batch = pgstata_queue_head;
+        pgstata_queue_head = batch->next;
+        if (pgstata_queue_head == NULL) {
+            pgstata_queue_tail = NULL;
+        }
+        --pgstata_queued;
+        pthread_cond_broadcast(&pgstata_queue_space);
+    }
+    pthread_mutex_unlock(&pgstata_queue_lock);
+    pgstata_wait_secs += pgstata_clock() - started;
+
+    if (failed != NULL) {
+        SF_error("error: ");
+        SF_error(failed->error);
+        return pgstata_db_error;
+    }
+    if (batch == NULL) {
+        pgstata_stop_workers(debug_mode);
+        pgstata_res = PQmakeEmptyPGresult(pgstata_conn, PGRES_TUPLES_OK);
+        return pgstata_ok;
+    }
+    pgstata_res = batch->res;
+    batch->res = NULL;
+    pgstata_par_batch = batch;
+    if (debug_mode) {
+        SF_display("DEBUG: collected a worker's batch\n");
+    }
+    return pgstata_ok;
+}
+
+
+// Sets the workers going, and waits for the first batch
+static pgstata_rc
+pgstata_start_workers (const int debug_mode)
+{
+    int w;
+    pthread_mutex_lock(&pgstata_queue_lock);
+    pgstata_workers_running = pgstata_num_workers;
+    pthread_mutex_unlock(&pgstata_queue_lock);
+    for (w=0; w<pgstata_num_workers; ++w) {
+        pgstata_worker *worker = &pgstata_workers[w];
+        if (pthread_create(&worker->thread, NULL, pgstata_worker_main,
+                           worker) != 0) {
+            pthread_mutex_lock(&pgstata_queue_lock);
+            pgstata_workers_running -= pgstata_num_workers - w;
+            pthread_mutex_unlock(&pgstata_queue_lock);
+            SF_error("couldn't start a worker thread\n");
+            return pgstata_db_error;
+        }
+        worker->started = 1;
+    }
+    return pgstata_collect_batch(debug_mode);
+}
+
+
+/*
+ * Uploads the rows set by keys() into a temporary table on the current
+ * connection and analyzes it, then makes *SQL_QUERY into SQL_QUERY filtered
+ * down to the rows whose key columns match one of them. The caller frees the
+ * new *SQL_QUERY.
+ */
+
+static pgstata_rc
+pgstata_upload_keys (char **sql_query, const int debug_mode)
+{
+    const char *table = "pg_temp.pgstata_keys";
+    size_t sql_len = strlen(*sql_query) + 256;
+    char *create, *filter;
+    char **idents;
+    pgstata_rc rc = pgstata_db_error;
+    int i, n = 0;
+
+    idents = calloc(pgstata_nkeys, sizeof(char *));
+    if (idents == NULL) {
+        SF_error("out of memory uploading keys\n");
+        return pgstata_db_error;
+    }
+    for (n=0; n<pgstata_nkeys; ++n) {
+        idents[n] = PQescapeIdentifier(pgstata_conn, pgstata_keys[n].name,
+                                       strlen(pgstata_keys[n].name));
+        if (idents[n] == NULL) {
+            SF_error(PQerrorMessage(pgstata_conn));
+            goto DONE;
+        }
+        sql_len += 3 * strlen(idents[n]) + 48;
+    }
+    create = malloc(sql_len);
+    filter = malloc(sql_len);
+    if (create == NULL || filter == NULL) {
+        SF_error("out of memory uploading keys\n");
+        free(create);
+        free(filter);
+        goto DONE;
+    }
+
+    // "CREATE TEMP TABLE pgstata_keys (a int8, b text)", and the query as
+    // "SELECT * FROM (query) AS q WHERE EXISTS (SELECT 1 FROM pgstata_keys k
+    // WHERE k.a = q.a AND k.b = q.b)", which the planner turns into a
+    // semi-join and can push into the query
+    strcpy(create, "CREATE TEMP TABLE pgstata_keys (");
+    snprintf(filter, sql_len, "SELECT pgstata_query.* FROM (%s) AS "
+             "pgstata_query WHERE EXISTS (SELECT 1 FROM %s AS pgstata_key "
+             "WHERE ", *sql_query, table);
+    for (i=0; i<pgstata_nkeys; ++i) {
+        const char *type = pgstata_keys[i].is_str ? "text"
+                         : pgstata_keys[i].integral ? "int8" : "float8";
+        sprintf(create + strlen(create), "%s%s %s", i ? ", " : "",
+                idents[i], type);
+        sprintf(filter + strlen(filter),
+                "%spgstata_key.%s = pgstata_query.%s", i ? " AND " : "",
+                idents[i], idents[i]);
+    }
+    strcat(create, ")");
+    strcat(filter, ")");
+
+    if (debug_mode) {
+        SF_display("DEBUG: uploading keys\n");
+    }
+    PQclear(PQexec(pgstata_conn, "DROP TABLE IF EXISTS pg_temp.pgstata_keys"));
+    rc = pgstata_exec_command(pgstata_conn, create, debug_mode);
+    if (rc == pgstata_ok) {
+        PGresult *res = PQexec(pgstata_conn,
+                               "COPY pg_temp.pgstata_keys FROM STDIN");
+        if (PQresultStatus(res) != PGRES_COPY_IN) {
+            SF_error(PQresultErrorMessage(res));
+            rc = pgstata_db_error;
+        }
+        PQclear(res);
+    }
+    if (rc == pgstata_ok) {
+        if (pgstata_keys_used > 0
+            && PQputCopyData(pgstata_conn, pgstata_keys_data,
+                             (int) pgstata_keys_used) != 1) {
+            SF_error(PQerrorMessage(pgstata_conn));
+            rc = pgstata_db_error;
+        }
+        PQputCopyEnd(pgstata_conn, rc == pgstata_ok ? NULL
+                                                    : "pgload failed");
+        PGresult *res;
+        while ((res = PQgetResult(pgstata_conn)) != NULL) {
+            if (PQresultStatus(res) != PGRES_COMMAND_OK && rc == pgstata_ok) {
+                SF_error(PQresultErrorMessage(res));
+                rc = pgstata_db_error;
+            }
+            PQclear(res);
+        }
+    }
+    if (rc == pgstata_ok) {
+        rc = pgstata_exec_command(pgstata_conn, "ANALYZE pg_temp.pgstata_keys",
+                                  debug_mode);
+    }
+    free(create);
+    if (rc == pgstata_ok) {
+        *sql_query = filter;
+    }
+    else {
+        free(filter);
+    }
+
+  DONE:
+    for (i=0; i<n; ++i) {
+        PQfreemem(idents[i]);
+    }
+    free(idents);
+    return rc;
+}
+
+
+// Prepare a workspace for pgstata_fetch() to populate: internals only.
+// This needs to be executed by an ADO file which can read the macros
+// it populates, and set up the appropriate variables and blank
+// observations.
+
+pgstata_rc
+pgstata_prepare (int argc, char **argv) {
+    USAGE_CHECK(argc, 1, -1,
+                "prepare SQLQUERY [\"debug\"] [\"binary\"|\"stream\"] "
+                "[\"batchrows=N\"] [\"batchbytes=N[k|m|g]\"] [\"count\"] "
+                "[\"encode=NAMES\"] [\"autoencode\"] [\"maxstr=N\"] "
+                "[\"strl\"] [\"nocompress\"] [\"parallel=N\"] "
+                "[\"key=NAME\"] [\"cachedir=DIR\"] [\"cachetoken=TOKEN\"] "
+                "[\"conninfo=CONNINFO\"] [\"export\"] [\"noprogress\"] "
+                "[\"script\"] [\"precision\"]");
+    char *sql_query = argv[0];
+    char msgtmp[256];
+    *msgtmp = '\000';
+    const double prepare_started = pgstata_clock();
+
+    // Debugging mode, progress reports and load mode
+    int debug_mode = pgstata_has_opt(argc-1, argv+1, "debug");
+    pgstata_progress = ! pgstata_has_opt(argc-1, argv+1, "noprogress");
+    pgstata_load_started = prepare_started;
+    pgstata_progress_mark = prepare_started;
+    pgstata_load_mode = pgstata_mode_cursor;
+    if (pgstata_has_opt(argc-1, argv+1, "binary")) {
+        pgstata_load_mode = pgstata_mode_copy;
+    }
+    else if (pgstata_has_opt(argc-1, argv+1, "stream")) {
+        pgstata_load_mode = pgstata_mode_stream;
+    }
+
+    // Batch sizing
+    const char *optval;
+    pgstata_batch_rows = 0;
+    pgstata_batch_bytes = PGSTATA_BATCH_BYTES;
+    if ((optval = pgstata_opt_value(argc-1, argv+1, "batchrows")) != NULL
+        && *optval != '\000') {
+        pgstata_batch_rows = atoi(optval);
+        if (pgstata_batch_rows < 0) {
+            SF_error("batchrows must be a positive number of rows\n");
+            return pgstata_usage_error;
+        }
+    }
+    if ((optval = pgstata_opt_value(argc-1, argv+1, "batchbytes")) != NULL
+        && *optval != '\000') {
+        if (pgstata_parse_bytes(optval, &pgstata_batch_bytes) != 0) {
+            SF_error("batchbytes must be a size such as 8m or 65536\n");
+            return pgstata_usage_error;
+        }
+    }
+    pgstata_fetch_rows = pgstata_batch_rows > 0 ? pgstata_batch_rows
+                                                : PGSTATA_CURSOR_SLURP_ROWS;
+
+    // String columns to store as value-labelled codes
+    const char *encode_names = pgstata_opt_value(argc-1, argv+1, "encode");
+    if (encode_names == NULL) {
+        encode_names = "";
+    }
+    int autoencode = pgstata_has_opt(argc-1, argv+1, "autoencode");
+    int encoding = autoencode || *encode_names != '\000';
+
+    // What the running Stata can hold in a string variable
+    pgstata_max_str = PGSTATA_MAX_STR_DEFAULT;
+    if ((optval = pgstata_opt_value(argc-1, argv+1, "maxstr")) != NULL
+        && atoi(optval) > 0) {
+        pgstata_max_str = atoi(optval) < PGSTATA_MAX_STRN ? atoi(optval)
+                                                          : PGSTATA_MAX_STRN;
+    }
+    pgstata_strl_ok = pgstata_has_opt(argc-1, argv+1, "strl");
+    pgstata_compress = ! pgstata_has_opt(argc-1, argv+1, "nocompress");
+    pgstata_check_numeric = pgstata_has_opt(argc-1, argv+1, "precision");
+
+    // pgexport writes to a file, leaving the data in memory alone
+    if (SF_nobs() != 0 && ! pgstata_has_opt(argc-1, argv+1, "export")) {
+        SF_error("no; data in memory would be lost\n");
+        return 4;   /* FIXME: de-hardcode, investigate if error message can
+                       be sent automatically. */
+    }
+
+    // A result cached under the caller's own freshness token is loaded
+    // without the database. If it isn't there and the ADO wrapper hasn't
+    // connected, it does so and calls again. Without a token there's no
+    // telling whether a cached result is stale, so nothing is cached.
+    const char *cache_dir = pgstata_opt_value(argc-1, argv+1, "cachedir");
+    const char *cache_token = pgstata_opt_value(argc-1, argv+1, "cachetoken");
+    int caching = cache_dir != NULL && *cache_dir != '\000';
+    int auto_token = cache_token != NULL && strcmp(cache_token, "auto") == 0;
+    if (caching && (cache_token == NULL || *cache_token == '\000')) {
+        SF_display("Note: cachedir() needs cachetoken(); not caching\n");
+        caching = 0;
+    }
+    free(pgstata_cache_path);
+    pgstata_cache_path = NULL;
+    free(pgstata_cache_query);
+    pgstata_cache_query = NULL;
+
+    // A script which is just one query is cached, and loaded, as that
+    // query. One which runs other statements first isn't: what they do
+    // isn't part of the result's key.
+    int script = pgstata_has_opt(argc-1, argv+1, "script");
+    if (caching && script) {
+        char **stmts = NULL;
+        int n = pgstata_split_script(sql_query, &stmts);
+        if (n == 1 && pgstata_sql_is_query(stmts[0])) {
+            sql_query = pgstata_cache_query = stmts[0];
+            stmts[0] = NULL;
+            script = 0;
+        }
+        else {
+            SF_display("Note: a script with statements before its query "
+                       "is not cached\n");
+            caching = 0;
+        }
+        pgstata_free_stmts(stmts, n);
+    }
+    SF_macro_save("_cached", "0");
+    SF_macro_save("_noquery", "0");
+    if (caching && ! auto_token) {
+        if (pgstata_cache_lookup(argc, argv, cache_token, debug_mode)) {
+            pgstata_params_free();
+            pgstata_keys_free();
+            return pgstata_ok;
+        }
+        if (pgstata_conn == NULL) {
+            return pgstata_ok;
+        }
+        caching = 0;
+    }
+    PGCONN_CHECK(debug_mode);
+
+    // Result whose column descriptions drive the type mapping below
+    PGresult *desc = NULL;
+    pgstata_wait_secs = 0;
+    pgstata_store_secs = 0;
+    pgstata_prof.wait_mark = 0;
+    pgstata_prof.batch_decode = 0;
+
+    if (pgstata_load_mode == pgstata_mode_copy
+        && PQserverVersion(pgstata_conn) < 90000) {
+        SF_display("Note: binary COPY needs PostgreSQL 9.0 or later; "
+                   "falling back to cursor mode\n");
+        pgstata_load_mode = pgstata_mode_cursor;
+    }
+
+    // Workers splitting the query between them by ranges of a key column
+    int nworkers = 0;
+    const char *key = pgstata_opt_value(argc-1, argv+1, "key");
+    if ((optval = pgstata_opt_value(argc-1, argv+1, "parallel")) != NULL) {
+        nworkers = atoi(optval);
+    }
+    if (nworkers > 1) {
+        if (key == NULL || *key == '\000') {
+            SF_error("parallel() needs key() to split the query by\n");
+            return pgstata_usage_error;
+        }
+        if (nworkers > PGSTATA_MAX_WORKERS) {
+            snprintf(msgtmp, 255, "parallel() takes at most %d workers\n",
+                     PGSTATA_MAX_WORKERS);
+            SF_error(msgtmp);
+            return pgstata_usage_error;
+        }
+        if (pgstata_load_mode != pgstata_mode_cursor) {
+            SF_error("parallel() can't be combined with binary or "
+                     "stream\n");
+            return pgstata_usage_error;
+        }
+        if (PQserverVersion(pgstata_conn) < 90200) {
+            SF_display("Note: parallel() needs PostgreSQL 9.2 or later; "
+                       "loading over one connection\n");
+        }
+        else {
+            pgstata_load_mode = pgstata_mode_parallel;
+        }
+    }
+
+    // cachetoken(auto) takes the token from the tables the query reads
+    if (caching) {
+        char *token = pgstata_cache_token(sql_query, debug_mode);
+        int hit = token != NULL
+                  && pgstata_cache_lookup(argc, argv, token, debug_mode);
+        free(token);
+        if (hit) {
+            pgstata_params_free();
+            pgstata_keys_free();
+            return pgstata_ok;
+        }
+    }
+
+    // A script's statements before its final query are run first, in one
+    // round trip, and the query is then loaded as any other. A script which
+    // doesn't end in a query is just run. The workers' connections wouldn't
+    // see the temporary tables it makes.
+    char *script_query = NULL;
+    if (script) {
+        if (pgstata_load_mode == pgstata_mode_parallel) {
+            SF_display("Note: a script loads over one connection\n");
+            pgstata_load_mode = pgstata_mode_cursor;
+        }
+        script_query = sql_query;
+        pgstata_rc script_rc = pgstata_run_script(&script_query, debug_mode);
+        if (script_rc != pgstata_ok || script_query == NULL) {
+            pgstata_params_free();
+            pgstata_keys_free();
+            if (script_rc == pgstata_ok) {
+                SF_macro_save("_noquery", "1");
+            }
+            return script_rc;
+        }
+        sql_query = script_query;
+    }
+
+    // Keys go into a temporary table, which only this connection can see
+    char *keyed_query = NULL;
+    if (pgstata_nkeys > 0) {
+        if (pgstata_load_mode == pgstata_mode_parallel) {
+            SF_display("Note: keys() loads over one connection\n");
+            pgstata_load_mode = pgstata_mode_cursor;
+        }
+        char *filtered = sql_query;
+        pgstata_rc keys_rc = pgstata_upload_keys(&filtered, debug_mode);
+        pgstata_keys_free();
+        if (keys_rc != pgstata_ok) {
+            pgstata_params_free();
+            free(script_query);
+            return keys_rc;
+        }
+        sql_query = keyed_query = filtered;
+    }
+
+    // How big the dataset is likely to get
+    double estimate = pgstata_estimate_rows(sql_query,
+                          pgstata_has_opt(argc-1, argv+1, "count"),
+                          debug_mode);
+    pgstata_rows_expected = estimate;
+
+    // Bound parameters go to the session's prepared statement for the query,
+    // which only the stream mode runs as it is
+    if (pgstata_nparams > 0 && pgstata_load_mode != pgstata_mode_stream) {
+        if (pgstata_load_mode != pgstata_mode_cursor) {
+            SF_display("Note: params() loads over one connection, "
+                       "in stream mode\n");
+        }
+        pgstata_load_mode = pgstata_mode_stream;
+    }
+
+    // The copy and parallel modes need the columns described before they
+    // start, and the stream mode has to look up their types while the
+    // connection is still free. Describing a query the session has seen
+    // before costs no round trip.
+    PGresult *stmt_desc = NULL;
+    pgstata_rc rc = pgstata_ok;
+    if (SW_stopflag) {
+        rc = pgstata_break;   // while the rows were being counted
+        goto DONE;
+    }
+    if (pgstata_load_mode != pgstata_mode_cursor || encoding) {
+        rc = pgstata_describe_query(sql_query, debug_mode, &stmt_desc);
+        if (rc != pgstata_ok) {
+            goto DONE;
+        }
+        pgstata_resolve_types(stmt_desc, debug_mode);
+    }
+
+    if (pgstata_load_mode == pgstata_mode_copy) {
+        rc = pgstata_prepare_copy(sql_query, debug_mode, stmt_desc);
+        if (rc != pgstata_ok) {
+            goto DONE;
+        }
+        desc = stmt_desc;
+    }
+
+    if (pgstata_load_mode == pgstata_mode_stream) {
+        rc = pgstata_prepare_stream(sql_query, debug_mode);
+        if (rc != pgstata_ok) {
+            goto DONE;
+        }
+        desc = stream_results[0];
+    }
+
+    if (pgstata_load_mode == pgstata_mode_parallel) {
+        rc = pgstata_prepare_parallel(sql_query, key, nworkers, debug_mode);
+        if (rc != pgstata_ok) {
+            goto DONE;
+        }
+        desc = stmt_desc;
+    }
+
+    if (pgstata_load_mode == pgstata_mode_cursor) {
+        rc = pgstata_prepare_cursor(sql_query, debug_mode);
+        if (rc != pgstata_ok) {
+            goto DONE;
+        }
+        desc = pgstata_res;
+        if (stmt_desc == NULL) {
+            pgstata_resolve_types(desc, debug_mode);
+        }
+    }
+
+    // Workspace size
+    int num_vars = PQnfields(desc);
+    pgstata_num_vars = num_vars;
+
+    // Column type information; copy mode has already filled in the binary
+    // flags
+    if (pgstata_load_mode != pgstata_mode_copy
+        && pgstata_alloc_columns(num_vars)) {
+        SF_error("out of memory describing columns\n");
+        pgstata_cleanup(debug_mode);
+        rc = pgstata_db_error;
+        goto DONE;
+    }
+    char *stata_mac_vars  = malloc(num_vars * 33 * sizeof(char));
+    char *stata_mac_types = malloc(num_vars * 12);
+    char *stata_mac_fmts  = malloc(num_vars * 12);
+    *stata_mac_vars = '\000';
+    *stata_mac_types = '\000';
+    *stata_mac_fmts = '\000';
 
     char typetmp[256];
     bzero(typetmp, 256);
     int i;
-    for (i=0; i<num_vars; ++i) {
-        char *fname = PQfname(pgstata_res, i);
-        Oid ftype = PQftype(pgstata_res, i);   // postgres's internal type
-        int fsize = PQfsize(pgstata_res, i);
-        int fmod = PQfmod(pgstata_res, i);
-        
-        strcat(stata_mac_vars, fname);
-        strcat(stata_mac_vars, " ");
+    for (i=0; i<num_vars; ++i) {
+        char *fname = PQfname(desc, i);
+        Oid ftype = PQftype(desc, i);   // postgres's internal type
+        int fsize = PQfsize(desc, i);
+        int fmod = PQfmod(desc, i);
+        
+        strcat(stata_mac_vars, fname);
+        strcat(stata_mac_vars, " ");
+
+        pgstata_dict *enum_dict = encoding ? pgstata_enum_dict(ftype) : NULL;
+
+        // Domains load as the type underneath
+        ftype = pgstata_type_base(ftype);
+        size_t type_start = strlen(stata_mac_types);
+        char statafmt_tmp[13];
+        bzero(statafmt_tmp, 13);
+        switch (ftype) {
+            
+            // pg bool -> stata byte
+            case BOOLOID:
+                strcat(stata_mac_types, "byte ");
+                break;
+
+            // pg smallint -> stata long
+            // sadly a stata int is just a little too narrow
+            case INT2OID:
+                strcat(stata_mac_types, "long ");
+                break;
+
+            // other pg numeric types -> stata double
+            case INT4OID:
+            case INT8OID:
+            case FLOAT4OID:
+            case FLOAT8OID:
+            case NUMERICOID:
+                strcat(stata_mac_types, "double ");
+                break;
+
+            // character strings: strN, resized by plan_first_batch() to
+            // the longest value seen. A char(N) or varchar(N) typmod counts
+            // characters rather than bytes, so isn't much help.
+            case BPCHAROID:
+            case VARCHAROID:
+                ftype = TEXTOID;
+                // FALLTHRU
+            case TEXTOID:
+                strcat(stata_mac_types, "str1 ");
+                break;
+
+            // Dates and times: days, or milliseconds for %tc
+            case DATEOID:
+                strcat(stata_mac_types, "long ");
+                strcat(statafmt_tmp, "%d");
+                break;
+            case TIMESTAMPOID:
+            case TIMESTAMPTZOID:
+                strcat(stata_mac_types, "double ");
+                strcat(statafmt_tmp, "%tc");
+                break;
+
+            /*
+             * Unknown types. The explicitly-named ones might get some proper
+             * conversion code at some point.
+             */
+
+            case CASHOID: // money
+            case INTERVALOID: // interval
+            case TIMEOID: // time without time zone
+            case TIMETZOID: //time with time zone
+            default:
+                if (enum_dict != NULL) {
+                    strcat(stata_mac_types, "str1 ");
+                    break;
+                }
+                pgstata_typoid2name(PQftype(desc, i), 255, typetmp);
+                snprintf(msgtmp, 255,
+                         "Type \"%.100s\" (column %.63s) is only partially "
+                         "supported: treating it as a string\n",
+                         typetmp, fname);
+                SF_error(msgtmp);
+                *msgtmp = '\000';
+                strcat(stata_mac_types, "str1 ");
+                break;
+        }
+
+        // Remember what we discovered, and plan the conversions
+        pgstata_columns[i].width = fsize;
+        pgstata_columns[i].oid = ftype;
+        pgstata_columns[i].mod = fmod;
+        snprintf(pgstata_columns[i].name, sizeof(pgstata_columns[i].name),
+                 "%s", fname);
+        sscanf(stata_mac_types + type_start, "%7s", pgstata_columns[i].type);
+        pgstata_plan_column(&pgstata_columns[i]);
+
+        // Encoded columns get their codes' type once the first batch is in
+        if (pgstata_plan_encoding(&pgstata_columns[i], enum_dict,
+                                  encode_names, autoencode)) {
+            pgstata_cleanup(debug_mode);
+            free(stata_mac_vars);
+            free(stata_mac_types);
+            free(stata_mac_fmts);
+            rc = pgstata_usage_error;
+            goto DONE;
+        }
+
+        // So do numeric ones, unless they are %tc clock values, which need
+        // a double whatever their range
+        pgstata_stats_reset(&pgstata_columns[i].stats);
+        pgstata_columns[i].narrow = pgstata_compress
+            && pgstata_columns[i].decode != NULL
+            && strcmp(statafmt_tmp, "%tc") != 0;
+
+        if (*statafmt_tmp != '\000') {
+            strcat(stata_mac_fmts, statafmt_tmp);
+        }
+        else {
+            strcat(stata_mac_fmts, "default");
+        }
+        strcat(stata_mac_fmts, " ");
+        if (debug_mode) {
+            char message[256];
+            snprintf(message, 255,
+                     "DEBUG: name=%s size=%d oid=%d mod=%d\n",
+                     fname, fsize, ftype, fmod);
+            SF_display(message);
+        }
+    }
+
+    // The workers can start decoding now that the columns are planned
+    if (pgstata_load_mode == pgstata_mode_parallel) {
+        rc = pgstata_start_workers(debug_mode);
+        if (rc != pgstata_ok) {
+            pgstata_cleanup(debug_mode);
+            free(stata_mac_vars);
+            free(stata_mac_types);
+            free(stata_mac_fmts);
+            goto DONE;
+        }
+        pgstata_num_obs_loaded = 0;
+        pgstata_num_obs = PQntuples(pgstata_res);
+    }
+
+    // Size string columns from the first batch, see which autoencode
+    // columns repeat enough, and pick the types of the codes
+    char *stata_mac_encoded = malloc(num_vars * 65 + 1);
+    *stata_mac_encoded = '\000';
+    rc = pgstata_plan_first_batch(stata_mac_types, stata_mac_encoded,
+                                  encode_names);
+    if (rc != pgstata_ok) {
+        pgstata_cleanup(debug_mode);
+        free(stata_mac_vars);
+        free(stata_mac_types);
+        free(stata_mac_fmts);
+        free(stata_mac_encoded);
+        goto DONE;
+    }
+
+    // save type info
+    char tmpbuf[256];
+    bzero(tmpbuf, 256);
+    sprintf(tmpbuf, "%i", pgstata_num_obs);
+    if (debug_mode) {
+        SF_display("DEBUG: _vars: ");
+        SF_display(stata_mac_vars);
+        SF_display("\nDEBUG: _types: ");
+        SF_display(stata_mac_types);
+        SF_display("\nDEBUG: _fmts: ");
+        SF_display(stata_mac_fmts);
+        SF_display("\nDEBUG: _obs: ");
+        SF_display(tmpbuf);
+        SF_display("\n");
+    }
+    SF_macro_save("_obs", tmpbuf);
+    snprintf(tmpbuf, 255, "%.0f", estimate);
+    if (debug_mode) {
+        SF_display("DEBUG: _estimate: ");
+        SF_display(tmpbuf);
+        SF_display("\n");
+    }
+    SF_macro_save("_estimate", tmpbuf);
+    SF_macro_save("_vars", stata_mac_vars);
+    SF_macro_save("_types", stata_mac_types);
+    SF_macro_save("_fmts", stata_mac_fmts);
+    if (debug_mode && encoding) {
+        SF_display("DEBUG: _encoded: ");
+        SF_display(stata_mac_encoded);
+        SF_display("\n");
+    }
+    SF_macro_save("_encoded", stata_mac_encoded);
+
+    free(stata_mac_vars);
+    free(stata_mac_types);
+    free(stata_mac_fmts);
+    free(stata_mac_encoded);
+
+  DONE:
+    pgstata_params_free();
+    if (rc != pgstata_ok) {
+        pgstata_stmt_forget(sql_query);
+    }
+    if (pgstata_prof.on) {
+        pgstata_prof.prepare_secs +=
+            pgstata_clock() - prepare_started - pgstata_wait_secs;
+    }
+    if (stmt_desc != NULL) {
+        PQclear(stmt_desc);
+    }
+    free(keyed_query);
+    free(script_query);
+    return rc;
+}
+
+// }}}
+// Query execution, and population of Stata workspace {{{
+
+/*
+ * The plugin interface can't store into strL variables, so their values are
+ * written to the file named by populate_next's strlfile= option instead, and
+ * the ADO wrapper stores them from Mata. Each value is written as three
+ * native doubles, the variable, observation and length, followed by that
+ * many bytes.
+ */
+
+static ST_retcode
+pgstata_store_strl (const int stata_var, const int stata_obs,
+                    const char *val, const int len)
+{
+    if (pgstata_strl_file == NULL) {
+        SF_error("strL values need populate_next's strlfile= option\n");
+        return -1;
+    }
+    const double header[3] = { stata_var, stata_obs, len };
+    if (fwrite(header, sizeof(double), 3, pgstata_strl_file) != 3
+        || fwrite(val, 1, len, pgstata_strl_file) != (size_t) len) {
+        SF_error("failed to write strL values\n");
+        return -1;
+    }
+    ++pgstata_strl_count;
+    return 0;
+}
+
+
+/*
+ * Length of the part of string value VAL of column COL which is kept: all
+ * LEN bytes, or if that's more than the column keeps, as many as fit, cut
+ * back to the start of a UTF-8 character.
+ */
+
+static inline int
+pgstata_clip_string (const pgstata_column *col, const char *val, int len)
+{
+    if (col->strl) {
+        return len;
+    }
+    return pgstata_utf8_clip(val, len, col->max_len);
+}
+
+
+/*
+ * Stores one string value. Values from libpq results are already
+ * NUL-terminated (TERMINATED set); values from the COPY stream are copied so
+ * that they can be. A value too long for the column is truncated.
+ */
+
+static inline ST_retcode
+pgstata_store_string (const pgstata_column *col, const int stata_var,
+                      const int stata_obs, const char *val, int len,
+                      int terminated)
+{
+    if (col->strl) {
+        return pgstata_store_strl(stata_var, stata_obs, val, len);
+    }
+    const int kept = pgstata_clip_string(col, val, len);
+    if (kept < len) {
+        len = kept;
+        terminated = 0;
+    }
+    if (! terminated) {
+        val = pgstata_scratch_copy(val, len);
+        if (val == NULL) {
+            return -1;
+        }
+    }
+    return SF_sstore(stata_var, stata_obs, (char *) val);
+}
+
+
+/*
+ * Stores NTUPS codes of an encoded column, from observation FIRST_OBS on.
+ * Code 0 is a NULL, and left missing.
+ */
+
+static pgstata_rc
+pgstata_store_codes (const pgstata_column *col, const int stata_var,
+                     const int first_obs, const int *codes, const int ntups)
+{
+    int i;
+    for (i=0; i<ntups; ++i) {
+        if (codes[i] != 0 && SF_vstore(stata_var, first_obs + i, codes[i])) {
+            pgstata_store_failed(stata_var - 1, first_obs + i, 0);
+            return pgstata_db_error;
+        }
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * Stores NTUPS decoded values of a numeric column, from observation
+ * FIRST_OBS on. Missing values are left as they are.
+ */
+
+static pgstata_rc
+pgstata_store_values (const pgstata_column *col, const int stata_var,
+                      const int first_obs, const double *values,
+                      const int ntups)
+{
+    const double missval = SV_missval;
+    int i;
+    for (i=0; i<ntups; ++i) {
+        if (values[i] < missval
+            && SF_vstore(stata_var, first_obs + i, values[i])) {
+            pgstata_store_failed(stata_var - 1, first_obs + i, 0);
+            return pgstata_db_error;
+        }
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * Stores the rows of a text-format result, starting at observation
+ * FIRST_OBS. In cursor mode the result is the whole batch; in stream mode a
+ * batch is made up of many of them. Works a column at a time, from the
+ * values pgstata_decode_batch() has left for the numeric columns.
+ */
+
+static pgstata_rc
+pgstata_store_result (const PGresult *res, const int first_obs)
+{
+    const int ntups = PQntuples(res);
+    const int first_row = first_obs - 1 - pgstata_num_obs_loaded;
+    int i, j;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        const int stata_var = 1 + j;
+        if (col->encode != pgstata_encode_none) {
+            if (pgstata_store_codes(col, stata_var, first_obs,
+                                    col->codes + first_row, ntups)) {
+                return pgstata_db_error;
+            }
+        }
+        else if (col->decode != NULL) {
+            if (pgstata_store_values(col, stata_var, first_obs,
+                                     col->values + first_row, ntups)) {
+                return pgstata_db_error;
+            }
+        }
+        else {
+            for (i=0; i<ntups; ++i) {
+                if (PQgetisnull(res, i, j)) {
+                    continue;
+                }
+                if (pgstata_store_string(col, stata_var, first_obs + i,
+                                         PQgetvalue(res, i, j),
+                                         PQgetlength(res, i, j), 1)) {
+                    pgstata_store_failed(j, first_obs + i, 0);
+                    return pgstata_db_error;
+                }
+            }
+        }
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * Stores the results making up the current stream batch. While doing so it
+ * lets libpq read ahead from the socket, as the copy mode does.
+ */
+
+static pgstata_rc
+pgstata_store_stream_batch (void)
+{
+    int first_obs = 1 + pgstata_num_obs_loaded;
+    int i;
+    for (i=0; i<stream_nresults; ++i) {
+        pgstata_rc rc = pgstata_store_result(stream_results[i], first_obs);
+        if (rc) {
+            return rc;
+        }
+        first_obs += PQntuples(stream_results[i]);
+        if (pgstata_in_stream && i % PGSTATA_COPY_CONSUME_ROWS == 0) {
+            PQconsumeInput(pgstata_conn);
+        }
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * Stores the rows of the current copy batch, a column at a time. The batch
+ * has already been split into fields and decoded.
+ */
+
+static pgstata_rc
+pgstata_store_copy_batch (const int ntups)
+{
+    const int nvars = pgstata_num_vars;
+    int i, j;
+
+    for (j=0; j<nvars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        const int stata_var = 1 + j;
+        const int first_obs = 1 + pgstata_num_obs_loaded;
+        if (pgstata_in_copy) {
+            PQconsumeInput(pgstata_conn);
+        }
+        if (col->encode != pgstata_encode_none) {
+            if (pgstata_store_codes(col, stata_var, first_obs, col->codes,
+                                    ntups)) {
+                return pgstata_db_error;
+            }
+            continue;
+        }
+        if (col->decode != NULL) {
+            if (pgstata_store_values(col, stata_var, first_obs, col->values,
+                                     ntups)) {
+                return pgstata_db_error;
+            }
+            continue;
+        }
+        for (i=0; i<ntups; ++i) {
+            const char *val = copy_fields[(size_t) i * nvars + j];
+            const int len = copy_field_lens[(size_t) i * nvars + j];
+            if (len < 0) {
+                continue;
+            }
+            if (pgstata_store_string(col, stata_var, first_obs + i, val, len,
+                                     0)) {
+                pgstata_store_failed(j, first_obs + i, 0);
+                return pgstata_db_error;
+            }
+        }
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * pgexport: writes the rows of the current batch to the spool file, a row
+ * at a time, as pgstata_spool_tag values. The .dta file is only written
+ * from the spool once every batch is in, since until then a column's type
+ * may still widen, or an encoded column go back to being a string.
+ */
+
+static pgstata_rc
+pgstata_spool_batch (const int ntups)
+{
+    const int nvars = pgstata_num_vars;
+    const double missval = SV_missval;
+    FILE *f = pgstata_export_spool;
+    const PGresult *res = pgstata_load_mode == pgstata_mode_stream
+                          ? stream_results[0] : pgstata_res;
+    int r = 0, row = 0;   // result of the batch, and row within it
+    int i, j;
+
+    for (i=0; i<ntups; ++i, ++row) {
+        if (pgstata_load_mode == pgstata_mode_stream) {
+            while (row == PQntuples(res)) {
+                res = stream_results[++r];
+                row = 0;
+            }
+        }
+        for (j=0; j<nvars; ++j) {
+            const pgstata_column *col = &pgstata_columns[j];
+            if (col->encode != pgstata_encode_none) {
+                const int32_t code = col->codes[i];
+                if (code == 0) {
+                    putc(pgstata_spool_null, f);
+                    continue;
+                }
+                putc(pgstata_spool_code, f);
+                fwrite(&code, sizeof(code), 1, f);
+                continue;
+            }
+            if (col->decode != NULL) {
+                if (col->values[i] >= missval) {
+                    putc(pgstata_spool_null, f);
+                    continue;
+                }
+                putc(pgstata_spool_number, f);
+                fwrite(&col->values[i], sizeof(double), 1, f);
+                continue;
+            }
+            const char *val;
+            int32_t len;
+            if (pgstata_load_mode == pgstata_mode_copy) {
+                val = copy_fields[(size_t) i * nvars + j];
+                len = copy_field_lens[(size_t) i * nvars + j];
+            }
+            else {
+                val = PQgetvalue(res, row, j);
+                len = PQgetisnull(res, row, j) ? -1 : PQgetlength(res, row, j);
+            }
+            if (len < 0) {
+                putc(pgstata_spool_null, f);
+                continue;
+            }
+            len = pgstata_clip_string(col, val, len);
+            putc(pgstata_spool_string, f);
+            fwrite(&len, sizeof(len), 1, f);
+            fwrite(val, 1, len, f);
+        }
+        if ((pgstata_in_copy || pgstata_in_stream)
+            && i % PGSTATA_COPY_CONSUME_ROWS == 0) {
+            PQconsumeInput(pgstata_conn);
+        }
+    }
+    if (ferror(f)) {
+        SF_error("failed to write the export spool file\n");
+        return pgstata_db_error;
+    }
+    return pgstata_ok;
+}
+
+
+/*
+ * The profile option: bytes of the values in the current batch, as they
+ * came from the server, NULLs counting nothing.
+ */
+
+static double
+pgstata_result_bytes (const PGresult *res)
+{
+    const int ntups = PQntuples(res), nfields = PQnfields(res);
+    double bytes = 0;
+    int i, j;
+    for (i=0; i<ntups; ++i) {
+        for (j=0; j<nfields; ++j) {
+            bytes += PQgetlength(res, i, j);
+        }
+    }
+    return bytes;
+}
+
+static double
+pgstata_batch_value_bytes (const int ntups)
+{
+    double bytes = 0;
+    size_t i;
+    switch (pgstata_load_mode) {
+        case pgstata_mode_copy:
+            for (i=0; i<(size_t) ntups * pgstata_num_vars; ++i) {
+                if (copy_field_lens[i] > 0) {
+                    bytes += copy_field_lens[i];
+                }
+            }
+            return bytes;
+        case pgstata_mode_stream:
+            for (i=0; i<(size_t) stream_nresults; ++i) {
+                bytes += pgstata_result_bytes(stream_results[i]);
+            }
+            return bytes;
+        default:
+            return pgstata_result_bytes(pgstata_res);
+    }
+}
+
+
+/*
+ * The profile option: records the batch of NTUPS rows just stored, which
+ * took STORE_SECS to store. Its fetch time is the time spent waiting since
+ * the batch before it was stored.
+ */
+
+static void
+pgstata_prof_batch (const int ntups, const double store_secs)
+{
+    if (pgstata_prof.nbatches == pgstata_prof.batches_len) {
+        int want = pgstata_prof.batches_len ? 2 * pgstata_prof.batches_len
+                                            : 64;
+        pgstata_batch_prof *grown =
+            realloc(pgstata_prof.batches, want * sizeof(*grown));
+        if (grown == NULL) {
+            return;
+        }
+        pgstata_prof.batches = grown;
+        pgstata_prof.batches_len = want;
+    }
+    pgstata_batch_prof *batch = &pgstata_prof.batches[pgstata_prof.nbatches++];
+    batch->rows = ntups;
+    batch->bytes = pgstata_batch_value_bytes(ntups);
+    batch->fetch_secs = pgstata_wait_secs - pgstata_prof.wait_mark;
+    batch->decode_secs = pgstata_prof.batch_decode;
+    batch->store_secs = store_secs;
+    pgstata_prof.wait_mark = pgstata_wait_secs;
+    pgstata_prof.batch_decode = 0;
+}
+
+
+/*
+ * Checks the column types against the batch after pgstata_encode_batch(),
+ * pgstata_measure_batch() and pgstata_decode_batch(). A string column with
+ * longer values than its strN holds, an encoded column with more values than
+ * its Stata type has room for, or a narrowed numeric column with a value its
+ * type can't hold exactly, is listed in the _recast macro, as "name type"
+ * pairs, for the ADO wrapper to widen. An encoded column with more than a
+ * value label can hold becomes a string column again, and is listed in _decode
+ * along with its string type. Returns true if either list is non-empty, in
+ * which case the batch must not be stored yet.
+ */
+
+static int
+pgstata_retype_columns (const int debug_mode)
+{
+    size_t len = 1;
+    int j;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        len += strlen(pgstata_columns[j].name) + 12;
+    }
+    char *recast = malloc(len);
+    char *decode = malloc(len);
+    char msg[256];
+    if (recast == NULL || decode == NULL) {
+        free(recast);
+        free(decode);
+        return 0;
+    }
+    *recast = '\000';
+    *decode = '\000';
+
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_column *col = &pgstata_columns[j];
+        if (pgstata_measured(col)) {
+            if (pgstata_fit_string(col)) {
+                strcat(recast, col->name);
+                strcat(recast, " ");
+                strcat(recast, col->type);
+                strcat(recast, " ");
+            }
+            continue;
+        }
+        if (col->narrow) {
+            pgstata_stats merged = col->stats;
+            pgstata_stats_merge(&merged, &col->batch_stats);
+            const char *type = pgstata_narrow_type(&merged);
+            if (strcmp(type, col->type) != 0) {
+                strcpy(col->type, type);
+                strcat(recast, col->name);
+                strcat(recast, " ");
+                strcat(recast, type);
+                strcat(recast, " ");
+            }
+            continue;
+        }
+        if (col->encode == pgstata_encode_none) {
+            continue;
+        }
+        if (col->overflow) {
+            snprintf(msg, 255, "note: %s has more than %d distinct values; "
+                     "loading it as a string\n",
+                     col->name, PGSTATA_MAX_ENCODE_VALUES);
+            SF_display(msg);
+
+            // Decoding gives a strN as wide as the longest value so far
+            int code, longest = 0;
+            for (code=1; code<=col->dict->nvalues; ++code) {
+                if (col->dict->lens[code - 1] > longest) {
+                    longest = col->dict->lens[code - 1];
+                }
+            }
+            col->encode = pgstata_encode_none;
+            col->batch_len = longest > 0 ? longest : 1;
+            col->str_width = 0;
+            pgstata_fit_string(col);
+            strcat(decode, col->name);
+            strcat(decode, " ");
+            strcat(decode, col->type);
+            strcat(decode, " ");
+            continue;
+        }
+        const char *type = pgstata_code_type(col->dict->nvalues);
+        if (pgstata_code_type_rank(type) > pgstata_code_type_rank(col->type)) {
+            strcpy(col->type, type);
+            strcat(recast, col->name);
+            strcat(recast, " ");
+            strcat(recast, type);
+            strcat(recast, " ");
+        }
+    }
+    if (debug_mode && (*recast != '\000' || *decode != '\000')) {
+        snprintf(msg, 255, "DEBUG: _recast: %.100s _decode: %.100s\n",
+                 recast, decode);
+        SF_display(msg);
+    }
+    SF_macro_save("_recast", recast);
+    SF_macro_save("_decode", decode);
+    int changed = (*recast != '\000' || *decode != '\000');
+    free(recast);
+    free(decode);
+    return changed;
+}
+
+
+/*
+ * Notes the columns which had values that could only be stored rounded,
+ * such as int8 ids beyond 2^53, or with the precision option NUMERICs of
+ * more digits than a double keeps.
+ */
+
+static void
+pgstata_report_lossy (void)
+{
+    char msg[256];
+    int j;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        if (pgstata_columns[j].stats.lossy > 0) {
+            snprintf(msg, 255,
+                     "note: %ld values of %s exceed double precision and "
+                     "were rounded\n",
+                     pgstata_columns[j].stats.lossy,
+                     pgstata_columns[j].name);
+            SF_display(msg);
+        }
+    }
+}
+
+
+// SECS as "1h 02m", "3m 20s" or "45s"
+static void
+pgstata_format_secs (char *buf, const size_t n, const double secs)
+{
+    const long whole = (long) (secs + 0.5);
+    if (whole >= 3600) {
+        snprintf(buf, n, "%ldh %02ldm", whole / 3600, whole / 60 % 60);
+    }
+    else if (whole >= 60) {
+        snprintf(buf, n, "%ldm %02lds", whole / 60, whole % 60);
+    }
+    else {
+        snprintf(buf, n, "%lds", whole);
+    }
+}
+
+
+/*
+ * Every PGSTATA_PROGRESS_SECS, says how many rows have been loaded and how
+ * fast, and if the planner's estimate is ahead of that, roughly how much is
+ * left and how long it should take.
+ */
+
+static void
+pgstata_show_progress (void)
+{
+    const double now = pgstata_clock();
+    if (! pgstata_progress
+        || now - pgstata_progress_mark < PGSTATA_PROGRESS_SECS) {
+        return;
+    }
+    pgstata_progress_mark = now;
+
+    char msg[256], took[32], left[32];
+    const double secs = now - pgstata_load_started;
+    const double rate = pgstata_num_obs_loaded / secs;
+    pgstata_format_secs(took, sizeof(took), secs);
+    int len = snprintf(msg, sizeof(msg), "(%d rows loaded in %s, %.0f rows/s",
+                       pgstata_num_obs_loaded, took, rate);
+    if (pgstata_rows_expected > pgstata_num_obs_loaded && rate > 0) {
+        pgstata_format_secs(left, sizeof(left),
+                            (pgstata_rows_expected - pgstata_num_obs_loaded)
+                            / rate);
+        len += snprintf(msg + len, sizeof(msg) - len,
+                        "; about %.0f%% done, %s to go",
+                        100 * pgstata_num_obs_loaded / pgstata_rows_expected,
+                        left);
+    }
+    snprintf(msg + len, sizeof(msg) - len, ")\n");
+    SF_display(msg);
+}
+
+
+pgstata_rc
+pgstata_populate_next (int argc, char **argv) {
+    USAGE_CHECK(argc, 0, 2, "populate_next [debug] [strlfile=PATH]");
+
+    // Debugging mode, and where strL values go
+    int debug_mode = pgstata_has_opt(argc, argv, "debug");
+    const char *strl_path = pgstata_opt_value(argc, argv, "strlfile");
+    SF_macro_save("_strls", "0");
+
+    if (pgstata_load_mode == pgstata_mode_cache) {
+        if (pgstata_cache_map == NULL) {
+            SF_error("Must call \"prepare\" before calling "
+                     "\"populate_next\"\n");
+            return pgstata_usage_error;
+        }
+        return pgstata_cache_fill();
+    }
+    PGCONN_CHECK(debug_mode);
+
+    pgstata_rc rc = pgstata_ok;
+    int cursor_mode = (pgstata_load_mode == pgstata_mode_cursor
+                       || pgstata_load_mode == pgstata_mode_parallel);
+    if (pgstata_columns == NULL || (cursor_mode && ! pgstata_res)) {
+        SF_error("Must call \"prepare\" before calling \"populate_next\"\n");
+        pgstata_cleanup(debug_mode);
+        return pgstata_usage_error;
+    }
+
+    char msg[256];    // message buffer for errors
+    bzero(msg, 256);
+    int pending = 0;
+
+    // Stop between batches if the user has pressed Break
+    if (pgstata_break_pressed()) {
+        rc = pgstata_break;
+        goto CLEANUP;
+    }
+
+    // #rows in this slurp
+    int ntups;
+    switch (pgstata_load_mode) {
+        case pgstata_mode_copy:   ntups = copy_ntuples; break;
+        case pgstata_mode_stream: ntups = stream_ntuples; break;
+        default:                  ntups = PQntuples(pgstata_res); break;
+    }
+    if (ntups == 0) {
+        return pgstata_finished;
+    }
+
+    // Code the encoded columns' values, measure the string columns and
+    // decode the numeric ones first. If that means widening a variable or
+    // turning one back into a string, leave the batch for the next call,
+    // once the ADO wrapper has done so.
+    if (pgstata_load_mode == pgstata_mode_copy) {
+        rc = pgstata_split_copy_batch(ntups);
+        if (rc) {
+            goto CLEANUP;
+        }
+    }
+    double started = pgstata_clock();
+    rc = pgstata_encode_batch(ntups);
+    if (rc) {
+        goto CLEANUP;
+    }
+    pgstata_measure_batch(ntups);
+    if (pgstata_prof.on) {
+        const double now = pgstata_clock();
+        pgstata_prof.decode_secs[pgstata_prof_string] += now - started;
+        pgstata_prof.batch_decode += now - started;
+        started = now;
+    }
+    rc = pgstata_decode_batch(ntups);
+    double elapsed = pgstata_clock() - started;
+    pgstata_store_secs += elapsed;
+    pgstata_prof.batch_decode += elapsed;
+    if (rc) {
+        goto CLEANUP;
+    }
+    if (pgstata_retype_columns(debug_mode)) {
+        return pgstata_ok;
+    }
+
+    // Any strL values go to the file for the ADO wrapper
+    int j;
+    for (j=0; j<pgstata_num_vars && ! pgstata_columns[j].strl; ++j)
+        ;
+    pgstata_strl_count = 0;
+    if (j < pgstata_num_vars && strl_path != NULL && *strl_path != '\000') {
+        pgstata_strl_file = fopen(strl_path, "wb");
+        if (pgstata_strl_file == NULL) {
+            SF_error("can't open the file for strL values\n");
+            rc = pgstata_db_error;
+            goto CLEANUP;
+        }
+    }
+
+    // In cursor mode the next FETCH is already in flight while this runs
+    started = pgstata_clock();
+    if (pgstata_export_spool != NULL) {
+        rc = pgstata_spool_batch(ntups);
+    }
+    else {
+        switch (pgstata_load_mode) {
+            case pgstata_mode_copy:
+                rc = pgstata_store_copy_batch(ntups);
+                break;
+            case pgstata_mode_stream:
+                rc = pgstata_store_stream_batch();
+                break;
+            default:
+                rc = pgstata_store_result(pgstata_res,
+                                          1 + pgstata_num_obs_loaded);
+                break;
+        }
+    }
+    elapsed = pgstata_clock() - started;
+    pgstata_store_secs += elapsed;
+    if (pgstata_strl_file != NULL) {
+        if (fclose(pgstata_strl_file) != 0 && rc == pgstata_ok) {
+            SF_error("failed to write strL values\n");
+            rc = pgstata_db_error;
+        }
+        pgstata_strl_file = NULL;
+        snprintf(msg, 32, "%d", pgstata_strl_count);
+        SF_macro_save("_strls", msg);
+    }
+    if (rc) {
+        goto CLEANUP;
+    }
+    if (pgstata_prof.on) {
+        pgstata_prof_batch(ntups, elapsed);
+    }
+    pgstata_num_obs_loaded += ntups;
+    for (j=0; j<pgstata_num_vars; ++j) {
+        pgstata_stats_merge(&pgstata_columns[j].stats,
+                            &pgstata_columns[j].batch_stats);
+    }
+    pgstata_show_progress();
+
+    if (pgstata_load_mode == pgstata_mode_copy) {
+        /* Read the next batch from the COPY stream */
+        rc = pgstata_copy_fetch(debug_mode);
+        if (rc) {
+            goto CLEANUP;
+        }
+        pending = copy_ntuples;
+    }
+    else if (pgstata_load_mode == pgstata_mode_stream) {
+        /* Read the next batch of streamed results */
+        rc = pgstata_stream_fetch(debug_mode);
+        if (rc) {
+            goto CLEANUP;
+        }
+        pending = stream_ntuples;
+    }
+    else if (pgstata_load_mode == pgstata_mode_parallel) {
+        PQclear(pgstata_res);
+        pgstata_res = NULL;
+        pgstata_batch_free(pgstata_par_batch);
+        pgstata_par_batch = NULL;
+
+        /* Take the next batch a worker has ready */
+        rc = pgstata_collect_batch(debug_mode);
+        if (rc) {
+            goto CLEANUP;
+        }
+        pending = PQntuples(pgstata_res);
+    }
+    else {
+        PQclear(pgstata_res);
+        pgstata_res = NULL;
+
+        /* Pick up the prefetched batch, and send the FETCH after it */
+        rc = pgstata_collect_fetch(debug_mode);
+        if (rc) {
+            goto CLEANUP;
+        }
+        rc = pgstata_prefetch_after(pgstata_res, debug_mode);
+        if (rc) {
+            goto CLEANUP;
+        }
+        pending = PQntuples(pgstata_res);
+    }
+    pgstata_num_obs += pending;
+
+    *msg = '\000';
+    snprintf(msg, 32, "%i", pgstata_num_obs);
+    if (debug_mode) {
+        SF_display("DEBUG: _obs: ");
+        SF_display(msg);
+        SF_display("\n");
+    }
+    SF_macro_save("_obs", msg);
+    snprintf(msg, 32, "%.3f", pgstata_wait_secs);
+    SF_macro_save("_wait_secs", msg);
+    snprintf(msg, 32, "%.3f", pgstata_store_secs);
+    SF_macro_save("_store_secs", msg);
+
+  CLEANUP:
+    if (rc == pgstata_break) {
+        if (debug_mode) {
+            SF_display("DEBUG: Break pressed; cancelling the query\n");
+        }
+        pgstata_cleanup(debug_mode);
+    }
+    else if (rc) {
+        SF_error("*error* cleaning up\n");
+        pgstata_cleanup(debug_mode);
+    }
+
+    if (!rc) {
+        rc = pending ? pgstata_ok : pgstata_finished;
+        if (rc == pgstata_finished) {
+            pgstata_report_lossy();
+        }
+        if (debug_mode) {
+            if (rc == pgstata_ok) {
+                SF_display("DEBUG: more data.\n");
+            }
+            else if (rc == pgstata_finished) {
+                SF_display("DEBUG: no more data. Show's over. Go home.\n");
+            }
+        }
+    }
+    return rc;
+}
+
+/*
+ * Saves the values of encoded column VARNAME as locals for the ADO wrapper
+ * to turn into a value label: _nlabels, and _lab1, _lab2, ... for codes 1,
+ * 2, .... A column which has gone back to being a string still has its
+ * dictionary, for decoding the codes already stored.
+ */
+
+pgstata_rc
+pgstata_labels (int argc, char **argv) {
+    USAGE_CHECK(argc, 1, 2, "labels VARNAME [debug]");
+    const char *name = argv[0];
+    char msg[256];
+    int j, code;
+
+    for (j=0; pgstata_columns != NULL && j<pgstata_num_vars; ++j) {
+        if (pgstata_columns[j].dict != NULL
+            && strcmp(pgstata_columns[j].name, name) == 0) {
+            break;
+        }
+    }
+    if (pgstata_columns == NULL || j == pgstata_num_vars) {
+        snprintf(msg, 255, "no encoded column named %s\n", name);
+        SF_error(msg);
+        return pgstata_usage_error;
+    }
+
+    const pgstata_dict *dict = pgstata_columns[j].dict;
+    for (code=1; code<=dict->nvalues; ++code) {
+        int len;
+        const char *val = pgstata_dict_value(dict, code, &len);
+        char *text = pgstata_scratch_copy(val, len);
+        if (text == NULL) {
+            SF_error("out of memory saving value labels\n");
+            return pgstata_db_error;
+        }
+        snprintf(msg, 32, "_lab%d", code);
+        SF_macro_save(msg, text);
+    }
+    snprintf(msg, 32, "%d", dict->nvalues);
+    SF_macro_save("_nlabels", msg);
+    return pgstata_ok;
+}
+
+/*
+ * Fills matrix MATNAME, which the ADO wrapper has made with a row per column
+ * and five columns, with the statistics of the values loaded: counts of
+ * non-missing and missing values, and for numeric columns the minimum,
+ * maximum and whether all are whole numbers. Entries which don't apply are
+ * left missing.
+ */
+
+pgstata_rc
+pgstata_colstats (int argc, char **argv) {
+    USAGE_CHECK(argc, 1, 2, "stats MATNAME [debug]");
+    char *mat = argv[0];
+    int j;
+
+    if (pgstata_columns == NULL) {
+        SF_error("Must call \"prepare\" before calling \"stats\"\n");
+        return pgstata_usage_error;
+    }
+    for (j=0; j<pgstata_num_vars; ++j) {
+        const pgstata_column *col = &pgstata_columns[j];
+        const pgstata_stats *stats = &col->stats;
+        const int numeric = col->decode != NULL && stats->nonmissing > 0;
+        if (SF_mat_store(mat, j + 1, 1, stats->nonmissing)
+            || SF_mat_store(mat, j + 1, 2, stats->missing)
+            || SF_mat_store(mat, j + 1, 3, numeric ? stats->min : SV_missval)
+            || SF_mat_store(mat, j + 1, 4, numeric ? stats->max : SV_missval)
+            || SF_mat_store(mat, j + 1, 5,
+                            numeric ? stats->integral : SV_missval)) {
+            SF_error("failed to store column statistics\n");
+            return pgstata_usage_error;
+        }
+    }
+    return pgstata_ok;
+}
+
+/*
+ * The profile option. "profile start" resets the counters and turns them on
+ * for a load about to begin. "profile clock" saves the time by the same
+ * monotonic clock in _clock, for the ADO wrapper to time its own phases.
+ * "profile finish" turns the counters off and saves them as _prof_* locals,
+ * with _prof_batches the number of batches recorded, and "profile fill
+ * MATNAME" then fills matrix MATNAME, made by the ADO wrapper with a row per
+ * batch and five columns, with their records: as many as it has rows for.
+ */
+
+pgstata_rc
+pgstata_profiler (int argc, char **argv) {
+    USAGE_CHECK(argc, 1, 2, "profile start|clock|finish|fill MATNAME");
+    static const char *class_names[pgstata_prof_nclasses] = {
+        "bool", "int", "float", "numeric", "datetime", "string"
+    };
+    const pgstata_profile *prof = &pgstata_prof;
+    char name[64], msg[64];
+    int i;
+
+    if (strcmp(argv[0], "start") == 0) {
+        free(pgstata_prof.batches);
+        memset(&pgstata_prof, 0, sizeof(pgstata_prof));
+        pgstata_prof.on = 1;
+        pgstata_prof.started = pgstata_clock();
+        return pgstata_ok;
+    }
+    if (strcmp(argv[0], "clock") == 0) {
+        snprintf(msg, 64, "%.6f", pgstata_clock());
+        SF_macro_save("_clock", msg);
+        return pgstata_ok;
+    }
+    if (strcmp(argv[0], "fill") == 0 && argc == 2) {
+        const int nrows = SF_row(argv[1]);
+        for (i=0; i<prof->nbatches && i<nrows; ++i) {
+            const pgstata_batch_prof *batch = &prof->batches[i];
+            if (SF_mat_store(argv[1], i + 1, 1, batch->rows)
+                || SF_mat_store(argv[1], i + 1, 2, batch->bytes)
+                || SF_mat_store(argv[1], i + 1, 3, batch->fetch_secs)
+                || SF_mat_store(argv[1], i + 1, 4, batch->decode_secs)
+                || SF_mat_store(argv[1], i + 1, 5, batch->store_secs)) {
+                SF_error("failed to store batch profile\n");
+                return pgstata_usage_error;
+            }
+        }
+        return pgstata_ok;
+    }
+    if (strcmp(argv[0], "finish") != 0) {
+        SF_error("usage: profile start|clock|finish|fill MATNAME\n");
+        return pgstata_usage_error;
+    }
+
+    double total = prof->on ? pgstata_clock() - prof->started : 0;
+    double rows = 0, bytes = 0, store = 0;
+    for (i=0; i<prof->nbatches; ++i) {
+        rows += prof->batches[i].rows;
+        bytes += prof->batches[i].bytes;
+        store += prof->batches[i].store_secs;
+    }
+    pgstata_prof.on = 0;
+    snprintf(msg, 64, "%.6f", total);
+    SF_macro_save("_prof_total_secs", msg);
+    snprintf(msg, 64, "%.6f", prof->connect_secs);
+    SF_macro_save("_prof_connect_secs", msg);
+    snprintf(msg, 64, "%.6f", prof->prepare_secs);
+    SF_macro_save("_prof_prepare_secs", msg);
+    for (i=0; i<pgstata_prof_nclasses; ++i) {
+        snprintf(name, 64, "_prof_decode_%s_secs", class_names[i]);
+        snprintf(msg, 64, "%.6f", prof->decode_secs[i]);
+        SF_macro_save(name, msg);
+    }
+    snprintf(msg, 64, "%.6f", store);
+    SF_macro_save("_prof_write_secs", msg);
+    snprintf(msg, 64, "%.0f", rows);
+    SF_macro_save("_prof_rows", msg);
+    snprintf(msg, 64, "%.0f", bytes);
+    SF_macro_save("_prof_bytes", msg);
+    snprintf(msg, 64, "%.6g", total > 0 ? rows / total : 0);
+    SF_macro_save("_prof_rows_per_sec", msg);
+    snprintf(msg, 64, "%.6g", total > 0 ? bytes / total : 0);
+    SF_macro_save("_prof_bytes_per_sec", msg);
+    snprintf(msg, 64, "%d", prof->nbatches);
+    SF_macro_save("_prof_batches", msg);
+    return pgstata_ok;
+}
+
+// }}}
+// Exporting the result to a .dta file {{{
+
+/*
+ * export() runs the query prepare() has set up to the end, and writes its
+ * result to a .dta file instead of into the dataset in memory. The rows go
+ * through the same batches, type mapping and encoding as a load, but are
+ * spooled to a file (see pgstata_spool_batch()) until the last batch has
+ * settled every column's type. The .dta file is then written from the
+ * spool a row at a time, so no more than a batch is ever held in memory.
+ *
+ * The file is in format 118, or 119 if it has more variables than 118
+ * allows, and laid out as:
+ *
+ *     <stata_dta><header>     release, byte order, K, N, label, timestamp
+ *     <map>                   offsets of the sections, filled in last
+ *     <variable_types> to <characteristics>, K entries each
+ *     <data>                  the rows, each value in its storage type
+ *     <strls>                 a GSO record per non-empty strL value
+ *     <value_labels>          one per encoded column, named after it
+ *     </stata_dta>
+ *
+ * Numbers are written least significant byte first.
+ */
+
+// How a column is written: its .dta type code, bytes in a row, strN width
+// and display format
+typedef struct _pgstata_dta_var {
+    uint16_t code;
+    int      width;
+    int      strn;   // strN: N, otherwise 0
+    int      strl;
+    char     fmt[57];
+} pgstata_dta_var;
+
+// A value read back from the spool file. TEXT is reused from value to value.
+typedef struct _pgstata_spool_value {
+    int      tag;
+    double   number;
+    int32_t  code;
+    int32_t  len;
+    char    *text;
+    size_t   text_len;   // allocated length of TEXT
+} pgstata_spool_value;
+
+static inline void
+pgstata_put_le (unsigned char *buf, uint64_t val, const int n)
+{
+    int i;
+    for (i=0; i<n; ++i) {
+        buf[i] = val & 0xff;
+        val >>= 8;
+    }
+}
+
+static inline int
+pgstata_write_le (FILE *f, const uint64_t val, const int n)
+{
+    unsigned char buf[8];
+    pgstata_put_le(buf, val, n);
+    return fwrite(buf, 1, n, f) != (size_t) n;
+}
+
+// Writes VAL in a field of WIDTH bytes, at most 321, padded with NULs
+static int
+pgstata_write_field (FILE *f, const char *val, const size_t width)
+{
+    char buf[321];
+    memset(buf, 0, width);
+    strncpy(buf, val, width - 1);
+    return fwrite(buf, 1, width, f) != width;
+}
+
+
+/*
+ * Works out how column COL is written, from the Stata type it ended up with
+ * and FMT, the display format prepare() gave it, if any.
+ */
+
+static void
+pgstata_dta_type (const pgstata_column *col, const char *fmt,
+                  pgstata_dta_var *var)
+{
+    const char *type = col->type;
+    memset(var, 0, sizeof(*var));
+    if (strcmp(type, "byte") == 0) {
+        var->code = 65530;
+        var->width = 1;
+        strcpy(var->fmt, "%8.0g");
+    }
+    else if (strcmp(type, "int") == 0) {
+        var->code = 65529;
+        var->width = 2;
+        strcpy(var->fmt, "%8.0g");
+    }
+    else if (strcmp(type, "long") == 0) {
+        var->code = 65528;
+        var->width = 4;
+        strcpy(var->fmt, "%12.0g");
+    }
+    else if (strcmp(type, "float") == 0) {
+        var->code = 65527;
+        var->width = 4;
+        strcpy(var->fmt, "%9.0g");
+    }
+    else if (strcmp(type, "double") == 0) {
+        var->code = 65526;
+        var->width = 8;
+        strcpy(var->fmt, "%10.0g");
+    }
+    else if (strcmp(type, "strL") == 0) {
+        var->code = 32768;
+        var->width = 8;
+        var->strl = 1;
+        strcpy(var->fmt, "%9s");
+    }
+    else {
+        var->strn = atoi(type + 3) > 0 ? atoi(type + 3) : 1;
+        var->code = var->strn;
+        var->width = var->strn;
+        snprintf(var->fmt, sizeof(var->fmt), "%%%ds",
+                 var->strn > 9 ? var->strn : 9);
+    }
+
+    // prepare() gives dates %d, which is short for %td
+    if (strcmp(fmt, "%d") == 0) {
+        strcpy(var->fmt, "%td");
+    }
+    else if (*fmt == '%') {
+        snprintf(var->fmt, sizeof(var->fmt), "%s", fmt);
+    }
+}
+
+
+/*
+ * Writes number VALUE, or missing if MISSING, as a value of .dta type CODE.
+ * A value outside the type's range, which the type mapping doesn't give, is
+ * written as missing too.
+ */
+
+static void
+pgstata_dta_number (unsigned char *out, const uint16_t code,
+                    const double value, int missing)
+{
+    union { float f; uint32_t u; } f32;
+    union { double d; uint64_t u; } f64;
+    switch (code) {
+        case 65530:
+            missing |= ! (value >= PGSTATA_BYTE_MIN
+                          && value <= PGSTATA_BYTE_MAX);
+            out[0] = (unsigned char) (missing ? 101 : (int) value);
+            break;
+        case 65529:
+            missing |= ! (value >= PGSTATA_INT_MIN
+                          && value <= PGSTATA_INT_MAX);
+            pgstata_put_le(out, (uint64_t) (missing ? 32741 : (int) value),
+                           2);
+            break;
+        case 65528:
+            missing |= ! (value >= PGSTATA_LONG_MIN
+                          && value <= PGSTATA_LONG_MAX);
+            pgstata_put_le(out,
+                           (uint64_t) (missing ? INT64_C(2147483621)
+                                               : (int64_t) value), 4);
+            break;
+        case 65527:
+            missing |= ! (fabs(value) <= PGSTATA_FLOAT_MAX);
+            f32.f = (float) value;
+            pgstata_put_le(out, missing ? UINT32_C(0x7f000000) : f32.u, 4);
+            break;
+        default:
+            f64.d = value;
+            pgstata_put_le(out, missing ? UINT64_C(0x7fe0000000000000)
+                                        : f64.u, 8);
+            break;
+    }
+}
+
+
+/*
+ * Reads the next value from spool file F into V. Returns non-zero if it
+ * can't be read.
+ */
+
+static int
+pgstata_spool_read (FILE *f, pgstata_spool_value *v)
+{
+    v->tag = getc(f);
+    v->len = 0;
+    switch (v->tag) {
+        case pgstata_spool_null:
+            return 0;
+        case pgstata_spool_number:
+            return fread(&v->number, sizeof(double), 1, f) != 1;
+        case pgstata_spool_code:
+            return fread(&v->code, sizeof(int32_t), 1, f) != 1;
+        case pgstata_spool_string:
+            if (fread(&v->len, sizeof(int32_t), 1, f) != 1 || v->len < 0) {
+                return 1;
+            }
+            if ((size_t) v->len >= v->text_len) {
+                size_t want = v->len + 1 > 2 * v->text_len
+                              ? v->len + 1 : 2 * v->text_len;
+                char *grown = realloc(v->text, want);
+                if (grown == NULL) {
+                    return 1;
+                }
+                v->text = grown;
+                v->text_len = want;
+            }
+            return fread(v->text, 1, v->len, f) != (size_t) v->len;
+        default:
+            return 1;
+    }
+}
+
+// The text of value V of string column COL: a code spooled before the
+// column went back to being a string is looked up in its dictionary
+static inline const char *
+pgstata_spool_text (const pgstata_column *col, const pgstata_spool_value *v,
+                    int *len)
+{
+    if (v->tag == pgstata_spool_code && col->dict != NULL) {
+        return pgstata_dict_value(col->dict, v->code, len);
+    }
+    *len = v->tag == pgstata_spool_string ? v->len : 0;
+    return v->text;
+}
+
+// Bytes of a value label's text kept: Stata holds at most LABEL_MAX
+static inline int
+pgstata_label_len (const char *val, int len)
+{
+    if (len > PGSTATA_DTA_LABEL_MAX) {
+        len = PGSTATA_DTA_LABEL_MAX;
+        while (len > 0 && (val[len] & 0xC0) == 0x80) {
+            --len;
+        }
+    }
+    return len;
+}
+
+
+/*
+ * Writes the value labels of encoded column COL to F, under its own name.
+ */
+
+static int
+pgstata_dta_write_labels (FILE *f, const pgstata_column *col)
+{
+    const pgstata_dict *dict = col->dict;
+    const int n = dict->nvalues;
+    uint32_t txtlen = 0;
+    int code, len, failed;
+    const char *val;
+
+    for (code=1; code<=n; ++code) {
+        val = pgstata_dict_value(dict, code, &len);
+        txtlen += pgstata_label_len(val, len) + 1;
+    }
+    failed = fputs("<lbl>", f) < 0
+             || pgstata_write_le(f, 8 + 8 * (uint64_t) n + txtlen, 4)
+             || pgstata_write_field(f, col->name, 129)
+             || pgstata_write_le(f, 0, 3)
+             || pgstata_write_le(f, n, 4)
+             || pgstata_write_le(f, txtlen, 4);
+    txtlen = 0;
+    for (code=1; ! failed && code<=n; ++code) {
+        val = pgstata_dict_value(dict, code, &len);
+        failed = pgstata_write_le(f, txtlen, 4);
+        txtlen += pgstata_label_len(val, len) + 1;
+    }
+    for (code=1; ! failed && code<=n; ++code) {
+        failed = pgstata_write_le(f, code, 4);
+    }
+    for (code=1; ! failed && code<=n; ++code) {
+        val = pgstata_dict_value(dict, code, &len);
+        len = pgstata_label_len(val, len);
+        failed = fwrite(val, 1, len, f) != (size_t) len || putc(0, f) == EOF;
+    }
+    return failed || fputs("</lbl>", f) < 0;
+}
+
+
+/*
+ * Writes .dta file PATH from the rows in spool file SPOOL_PATH, with the
+ * columns' final types. FMTS are the display formats prepare() gave them.
+ */
+
+static pgstata_rc
+pgstata_write_dta (const char *path, const char *fmts,
+                   const char *spool_path, const int debug_mode)
+{
+    const int nvars = pgstata_num_vars;
+    const uint64_t nobs = pgstata_num_obs_loaded;
+    const int release = nvars > PGSTATA_DTA_MAX_VARS_118 ? 119 : 118;
+    const int kbytes = release == 119 ? 4 : 2;  // K and sortlist entries
+    const int vbytes = release == 119 ? 3 : 2;  // v of a strL's (v,o)
+    pgstata_dta_var *vars = calloc(nvars > 0 ? nvars : 1, sizeof(*vars));
+    pgstata_spool_value v;
+    unsigned char *row = NULL;
+    size_t row_len = 0;
+    uint64_t map[14];
+    uint64_t i;
+    char fmt[57], stamp[18], msg[256];
+    int j, n, any_strl = 0, failed = 0;
+    FILE *spool = NULL, *f = NULL;
+    pgstata_rc rc = pgstata_db_error;
+
+    memset(&v, 0, sizeof(v));
+    memset(map, 0, sizeof(map));
+    if (vars == NULL) {
+        SF_error("out of memory writing the .dta file\n");
+        return pgstata_db_error;
+    }
+    for (j=0; j<nvars; ++j) {
+        if (sscanf(fmts, " %56s%n", fmt, &n) == 1) {
+            fmts += n;
+        }
+        else {
+            *fmt = '\000';
+        }
+        pgstata_dta_type(&pgstata_columns[j], fmt, &vars[j]);
+        row_len += vars[j].width;
+        any_strl |= vars[j].strl;
+    }
+    row = malloc(row_len > 0 ? row_len : 1);
+    spool = fopen(spool_path, "rb");
+    f = fopen(path, "wb");
+    if (row == NULL || spool == NULL || f == NULL) {
+        snprintf(msg, 255, "can't open %.200s for writing\n", path);
+        SF_error(f == NULL ? msg : "can't read back the export spool file\n");
+        goto DONE;
+    }
+    setvbuf(f, NULL, _IOFBF, PGSTATA_SAVE_CHUNK_BYTES);
+    setvbuf(spool, NULL, _IOFBF, PGSTATA_SAVE_CHUNK_BYTES);
+
+    // Header, and a map to fill in once the sections' offsets are known
+    time_t now = time(NULL);
+    if (strftime(stamp, sizeof(stamp), "%d %b %Y %H:%M",
+                 localtime(&now)) != 17) {
+        *stamp = '\000';
+    }
+    fprintf(f, "<stata_dta><header><release>%d</release>"
+               "<byteorder>LSF</byteorder><K>", release);
+    pgstata_write_le(f, nvars, kbytes);
+    fputs("</K><N>", f);
+    pgstata_write_le(f, nobs, 8);
+    fputs("</N><label>", f);
+    pgstata_write_le(f, 0, 2);
+    fputs("</label><timestamp>", f);
+    putc(strlen(stamp), f);
+    fputs(stamp, f);
+    fputs("</timestamp></header>", f);
+    map[1] = ftell(f);
+    fputs("<map>", f);
+    fwrite(map, sizeof(map), 1, f);
+    fputs("</map>", f);
+
+    // Descriptors
+    map[2] = ftell(f);
+    fputs("<variable_types>", f);
+    for (j=0; j<nvars; ++j) {
+        pgstata_write_le(f, vars[j].code, 2);
+    }
+    fputs("</variable_types>", f);
+    map[3] = ftell(f);
+    fputs("<varnames>", f);
+    for (j=0; j<nvars; ++j) {
+        pgstata_write_field(f, pgstata_columns[j].name, 129);
+    }
+    fputs("</varnames>", f);
+    map[4] = ftell(f);
+    fputs("<sortlist>", f);
+    for (j=0; j<=nvars; ++j) {
+        pgstata_write_le(f, 0, kbytes);
+    }
+    fputs("</sortlist>", f);
+    map[5] = ftell(f);
+    fputs("<formats>", f);
+    for (j=0; j<nvars; ++j) {
+        pgstata_write_field(f, vars[j].fmt, 57);
+    }
+    fputs("</formats>", f);
+    map[6] = ftell(f);
+    fputs("<value_label_names>", f);
+    for (j=0; j<nvars; ++j) {
+        const pgstata_column *col = &pgstata_columns[j];
+        pgstata_write_field(f, col->encode != pgstata_encode_none
+                               ? col->name : "", 129);
+    }
+    fputs("</value_label_names>", f);
+    map[7] = ftell(f);
+    fputs("<variable_labels>", f);
+    for (j=0; j<nvars; ++j) {
+        pgstata_write_field(f, "", 321);
+    }
+    fputs("</variable_labels>", f);
+    map[8] = ftell(f);
+    fputs("<characteristics></characteristics>", f);
+
+    // The rows. A strL is written as its (v,o), and its value later.
+    map[9] = ftell(f);
+    fputs("<data>", f);
+    for (i=0; i<nobs && ! failed; ++i) {
+        unsigned char *out = row;
+        for (j=0; j<nvars && ! failed; ++j) {
+            const pgstata_dta_var *var = &vars[j];
+            failed = pgstata_spool_read(spool, &v);
+            if (var->strn > 0 || var->strl) {
+                int len;
+                const char *text = pgstata_spool_text(&pgstata_columns[j],
+                                                      &v, &len);
+                if (var->strl) {
+                    pgstata_put_le(out, len > 0 ? j + 1 : 0, vbytes);
+                    pgstata_put_le(out + vbytes, len > 0 ? i + 1 : 0,
+                                   8 - vbytes);
+                }
+                else {
+                    len = len < var->strn ? len : var->strn;
+                    if (len > 0) {
+                        memcpy(out, text, len);
+                    }
+                    memset(out + len, 0, var->strn - len);
+                }
+            }
+            else {
+                pgstata_dta_number(out, var->code,
+                                   v.tag == pgstata_spool_code ? v.code
+                                                               : v.number,
+                                   v.tag == pgstata_spool_null);
+            }
+            out += var->width;
+        }
+        failed |= fwrite(row, 1, row_len, f) != row_len;
+    }
+    fputs("</data>", f);
+
+    // The strLs' values, from a second pass over the spool
+    map[10] = ftell(f);
+    fputs("<strls>", f);
+    if (any_strl && ! failed) {
+        rewind(spool);
+    }
+    for (i=0; any_strl && i<nobs && ! failed; ++i) {
+        for (j=0; j<nvars && ! failed; ++j) {
+            int len;
+            failed = pgstata_spool_read(spool, &v);
+            if (! vars[j].strl || failed) {
+                continue;
+            }
+            const char *text = pgstata_spool_text(&pgstata_columns[j], &v,
+                                                  &len);
+            if (len == 0) {
+                continue;
+            }
+            failed = fputs("GSO", f) < 0
+                     || pgstata_write_le(f, j + 1, 4)
+                     || pgstata_write_le(f, i + 1, 8)
+                     || putc(130, f) == EOF
+                     || pgstata_write_le(f, len + 1, 4)
+                     || fwrite(text, 1, len, f) != (size_t) len
+                     || putc(0, f) == EOF;
+        }
+    }
+    fputs("</strls>", f);
+
+    map[11] = ftell(f);
+    fputs("<value_labels>", f);
+    for (j=0; j<nvars && ! failed; ++j) {
+        if (pgstata_columns[j].encode != pgstata_encode_none) {
+            failed = pgstata_dta_write_labels(f, &pgstata_columns[j]);
+        }
+    }
+    fputs("</value_labels>", f);
+    map[12] = ftell(f);
+    fputs("</stata_dta>", f);
+    map[13] = ftell(f);
+
+    // Now the map
+    failed |= fseek(f, map[1] + 5, SEEK_SET) != 0;
+    for (j=0; j<14 && ! failed; ++j) {
+        failed = pgstata_write_le(f, map[j], 8);
+    }
+    failed |= ferror(f) != 0;
+    if (failed) {
+        snprintf(msg, 255, "failed to write %.200s\n", path);
+        SF_error(msg);
+        goto DONE;
+    }
+    if (debug_mode) {
+        snprintf(msg, 255, "DEBUG: wrote %.0f rows to %.150s, format %d\n",
+                 (double) nobs, path, release);
+        SF_display(msg);
+    }
+    rc = pgstata_ok;
+
+  DONE:
+    if (f != NULL && fclose(f) != 0 && rc == pgstata_ok) {
+        snprintf(msg, 255, "failed to write %.200s\n", path);
+        SF_error(msg);
+        rc = pgstata_db_error;
+    }
+    if (f != NULL && rc != pgstata_ok) {
+        unlink(path);
+    }
+    if (spool != NULL) {
+        fclose(spool);
+    }
+    free(v.text);
+    free(row);
+    free(vars);
+    return rc;
+}
+
+
+/*
+ * Loads the rest of the query prepare() set up with its export option, and
+ * writes the result to .dta file PATH, replacing any file already there.
+ * FORMATS are the display formats prepare() gave the columns, and SPOOL the
+ * file which holds the rows meanwhile. Leaves _obs at the rows written.
+ */
+
+pgstata_rc
+pgstata_export (int argc, char **argv) {
+    USAGE_CHECK(argc, 3, 4, "export PATH FORMATS spool=PATH [debug]");
+    const int debug_mode = pgstata_has_opt(argc-2, argv+2, "debug");
+    const char *spool_path = pgstata_opt_value(argc-2, argv+2, "spool");
+    char *populate_argv[] = { "debug" };
+    pgstata_rc rc;
+
+    if (spool_path == NULL || *spool_path == '\000') {
+        SF_error("export needs a spool= file\n");
+        return pgstata_usage_error;
+    }
+    if (pgstata_columns == NULL || pgstata_load_mode == pgstata_mode_cache) {
+        SF_error("Must call \"prepare\" before calling \"export\"\n");
+        return pgstata_usage_error;
+    }
+    pgstata_export_spool = fopen(spool_path, "wb");
+    if (pgstata_export_spool == NULL) {
+        SF_error("can't open the export spool file\n");
+        return pgstata_db_error;
+    }
+    setvbuf(pgstata_export_spool, NULL, _IOFBF, PGSTATA_SAVE_CHUNK_BYTES);
+
+    // A batch which widens a column comes back to be spooled again, as it
+    // would to be stored once the ADO wrapper had recast the variable
+    do {
+        rc = pgstata_populate_next(debug_mode, populate_argv);
+    } while (rc == pgstata_ok);
+    if (fclose(pgstata_export_spool) != 0 && rc == pgstata_finished) {
+        SF_error("failed to write the export spool file\n");
+        rc = pgstata_db_error;
+    }
+    pgstata_export_spool = NULL;
+    if (rc == pgstata_finished) {
+        rc = pgstata_write_dta(argv[0], argv[1], spool_path, debug_mode);
+    }
+    unlink(spool_path);
+    return rc;
+}
+
+// }}}
+// Saving the dataset to the database {{{
+
+/*
+ * save() writes the variables it is called with into a table, as one binary
+ * COPY FROM STDIN inside a transaction, so that a failure leaves the table
+ * as it was. The ADO wrapper passes the variables' names, storage types and
+ * formats, which the plugin interface has no way of finding out. strL
+ * variables can't be read through the plugin interface either: the ADO
+ * wrapper writes their values to the file named by strlfile=, row by row,
+ * each a native double length followed by that many bytes.
+ */
+
+typedef struct _pgstata_save_column {
+    pgstata_save_kind kind;
+    char              name[33];
+} pgstata_save_column;
+
+static const char *pgstata_save_types[] = {
+    "smallint", "integer", "real", "double precision", "date",
+    "timestamp", "text", "text"
+};
+
+// COPY data waiting to be sent
+char  *pgstata_save_buf = NULL;
+size_t pgstata_save_used = 0;
+size_t pgstata_save_len = 0;
+
+static inline int
+pgstata_save_reserve (const size_t n)
+{
+    if (pgstata_save_used + n <= pgstata_save_len) {
+        return 0;
+    }
+    size_t len = pgstata_save_len > 0 ? pgstata_save_len : 4096;
+    while (len < pgstata_save_used + n) {
+        len *= 2;
+    }
+    char *buf = realloc(pgstata_save_buf, len);
+    if (buf == NULL) {
+        return -1;
+    }
+    pgstata_save_buf = buf;
+    pgstata_save_len = len;
+    return 0;
+}
 
-        char statatype_tmp[33];
-        char statafmt_tmp[13];
-        bzero(statafmt_tmp, 13);
-        switch (ftype) {
-            
-            // pg bool -> stata byte
-            case BOOLOID:
-                strcat(stata_mac_types, "byte ");
-                break;
+static inline void
+pgstata_put_int16 (const int16_t v)
+{
+    unsigned char *p = (unsigned char *) pgstata_save_buf + pgstata_save_used;
+    p[0] = (unsigned char) ((uint16_t) v >> 8);
+    p[1] = (unsigned char) v;
+    pgstata_save_used += 2;
+}
 
-            // pg smallint -> stata long
-            // sadly a stata int is just a little too narrow
-            case INT2OID:
-                strcat(stata_mac_types, "long ");
-                break;
+static inline void
+pgstata_put_int32 (const int32_t v)
+{
+    pgstata_put_int16((int16_t) ((uint32_t) v >> 16));
+    pgstata_put_int16((int16_t) v);
+}
 
-            // other pg numeric types -> stata double
-            case INT4OID:
-            case INT8OID:
-            case FLOAT4OID:
-            case FLOAT8OID:
-            case NUMERICOID:
-                strcat(stata_mac_types, "double ");
-                break;
+static inline void
+pgstata_put_int64 (const int64_t v)
+{
+    pgstata_put_int32((int32_t) ((uint64_t) v >> 32));
+    pgstata_put_int32((int32_t) v);
+}
 
-            // fixed-width character strings <= 244 chars in length
-            case BPCHAROID:
-            case VARCHAROID:
-                *statatype_tmp = '\000';
-                if (fmod-VARHDRSZ < 245 && fmod-VARHDRSZ > 0) {
-                    snprintf(statatype_tmp, 32, "str%d ", fmod-VARHDRSZ);
-                    strcat(stata_mac_types, statatype_tmp);
-                    break;
-                    // typemod for a char(N) or a varchar(N) is VARHDRSZ+N
-                    // assume character == ASCII for now
-                }
-                // FALLTHRU - treat it as TEXT and truncate...
-                ftype = TEXTOID;
+static inline void
+pgstata_put_bytes (const char *val, const size_t len)
+{
+    pgstata_put_int32((int32_t) len);
+    memcpy(pgstata_save_buf + pgstata_save_used, val, len);
+    pgstata_save_used += len;
+}
 
-            // variable-width character strings
-            case TEXTOID:
-                strcat(stata_mac_types, "str244 ");
-                break;
-                // Could issue more SQL commands to find the maximum length
-                // here. It's likely a view is being used, however.
+static pgstata_rc
+pgstata_save_flush (void)
+{
+    if (pgstata_save_used == 0) {
+        return pgstata_ok;
+    }
+    if (PQputCopyData(pgstata_conn, pgstata_save_buf,
+                      (int) pgstata_save_used) != 1) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        return pgstata_db_error;
+    }
+    pgstata_save_used = 0;
+    return pgstata_ok;
+}
 
-            // Dates and times
-            case DATEOID:
-            case TIMESTAMPOID:
-            case TIMESTAMPTZOID:
-                strcat(stata_mac_types, "long ");
-                strcat(statafmt_tmp, "%d");
-                break;
 
-            /*
-             * Unknown types. The explicitly-named ones might get some proper
-             * conversion code at some point.
-             */
+/*
+ * Works out the Postgres type of each of the NVARS variables from the
+ * space-separated NAMES, TYPES and FORMATS the ADO wrapper passes.
+ */
 
-            case CASHOID: // money
-            case INTERVALOID: // interval
-            case TIMEOID: // time without time zone
-            case TIMETZOID: //time with time zone
-            default:
-                *typetmp = '\000';
-                pgstata_typoid2name(ftype, 255, typetmp, debug_mode);
-                snprintf(msgtmp, 255,
-                         "Type \"%s\" (column %s) is only partially "
-                         "supported: treating it as str244\n",
-                         typetmp, fname);
-                SF_error(msgtmp);
-                *msgtmp = '\000';
-                strcat(stata_mac_types, "str244 ");
-                break;
-        }
+static pgstata_rc
+pgstata_plan_save (pgstata_save_column *cols, const int nvars,
+                   const char *names, const char *types, const char *fmts)
+{
+    char type[16], fmt[64], msg[256];
+    int j, n;
 
-        // Remember what we discovered for per-row tests later on
-        column_widths[i] = fsize;
-        column_oids[i] = ftype;
-        column_mods[i] = fmod;
+    for (j=0; j<nvars; ++j) {
+        pgstata_save_column *col = &cols[j];
+        if (sscanf(names, " %32s%n", col->name, &n) != 1) {
+            break;
+        }
+        names += n;
+        if (sscanf(types, " %15s%n", type, &n) != 1) {
+            break;
+        }
+        types += n;
+        if (sscanf(fmts, " %63s%n", fmt, &n) != 1) {
+            break;
+        }
+        fmts += n;
 
-        if (*statafmt_tmp != '\000') {
-            strcat(stata_mac_fmts, statafmt_tmp);
+        // Daily dates are %td, or %d as pgload gives them; clock times %tc
+        // or %tC. A - after the % left-aligns them.
+        const char *f = fmt + (fmt[1] == '-' ? 2 : 1);
+        if (strncmp(f, "td", 2) == 0 || *f == 'd') {
+            col->kind = pgstata_save_date;
         }
-        else {
-            strcat(stata_mac_fmts, "default");
+        else if (strncmp(f, "tc", 2) == 0 || strncmp(f, "tC", 2) == 0) {
+            col->kind = pgstata_save_timestamp;
         }
-        strcat(stata_mac_fmts, " ");
-        if (debug_mode) {
-            char message[256];
-            snprintf(message, 255,
-                     "DEBUG: name=%s size=%d oid=%d mod=%d\n",
-                     fname, fsize, ftype, fmod);
-            SF_display(message);
+        else if (strcmp(type, "byte") == 0 || strcmp(type, "int") == 0) {
+            col->kind = pgstata_save_int2;
+        }
+        else if (strcmp(type, "long") == 0) {
+            col->kind = pgstata_save_int4;
+        }
+        else if (strcmp(type, "float") == 0) {
+            col->kind = pgstata_save_float4;
+        }
+        else if (strcmp(type, "double") == 0) {
+            col->kind = pgstata_save_float8;
+        }
+        else if (strcmp(type, "strL") == 0) {
+            col->kind = pgstata_save_strl;
+        }
+        else if (strncmp(type, "str", 3) == 0) {
+            col->kind = pgstata_save_text;
+        }
+        else {
+            snprintf(msg, 255, "variable %s has unknown type %s\n",
+                     col->name, type);
+            SF_error(msg);
+            return pgstata_usage_error;
         }
     }
-
-    // save type info
-    char tmpbuf[256];
-    bzero(tmpbuf, 256);
-    sprintf(tmpbuf, "%i", pgstata_num_obs);
-    if (debug_mode) {
-        SF_display("DEBUG: _vars: ");
-        SF_display(stata_mac_vars);
-        SF_display("\nDEBUG: _types: ");
-        SF_display(stata_mac_types);
-        SF_display("\nDEBUG: _fmts: ");
-        SF_display(stata_mac_fmts);
-        SF_display("\nDEBUG: _obs: ");
-        SF_display(tmpbuf);
-        SF_display("\n");
+    if (j < nvars) {
+        SF_error("save: names=, types= and fmts= must give every "
+                 "variable\n");
+        return pgstata_usage_error;
     }
-    SF_macro_save("_obs", tmpbuf);
-    SF_macro_save("_vars", stata_mac_vars);
-    SF_macro_save("_types", stata_mac_types);
-    SF_macro_save("_fmts", stata_mac_fmts);
-
-    free(stata_mac_vars);
-    free(stata_mac_types);
-    free(stata_mac_fmts);
-
     return pgstata_ok;
 }
 
-// }}}
-// Query execution, and population of Stata workspace {{{
 
-pgstata_rc
-pgstata_populate_next (int argc, char **argv) {
-    USAGE_CHECK(argc, 0, 1, "populate_next [debug]");
+/*
+ * Builds the statements save() runs before the COPY: creating, emptying or
+ * replacing TABLE, as MODE says, and then the COPY itself. Each is
+ * malloc()ed; those not needed are NULL.
+ */
+
+static pgstata_rc
+pgstata_save_sql (const pgstata_save_column *cols, const int nvars,
+                  const char *table, const char *mode, char **ddl,
+                  char **copy)
+{
+    const int create = strcmp(mode, "create") == 0
+                       || strcmp(mode, "replace") == 0;
+    size_t len = 2 * strlen(table) + 128;
+    int j;
+    for (j=0; j<nvars; ++j) {
+        len += 2 * strlen(cols[j].name) + 24;
+    }
+    *ddl = malloc(len);
+    *copy = malloc(len);
+    if (*ddl == NULL || *copy == NULL) {
+        free(*ddl);
+        free(*copy);
+        *ddl = *copy = NULL;
+        SF_error("out of memory building COPY statement\n");
+        return pgstata_db_error;
+    }
+    **ddl = '\000';
+    if (strcmp(mode, "replace") == 0) {
+        sprintf(*ddl, "DROP TABLE IF EXISTS %s; ", table);
+    }
+    if (create) {
+        strcat(*ddl, "CREATE TABLE ");
+        strcat(*ddl, table);
+        strcat(*ddl, " (");
+    }
+    else if (strcmp(mode, "truncate") == 0) {
+        sprintf(*ddl, "TRUNCATE TABLE %s", table);
+    }
+    sprintf(*copy, "COPY %s (", table);
 
-    // Debugging mode
-    int debug_mode = 0;
-    if (argc >= 1) {
-        if (strncasecmp(argv[0], "debug", 5) == 0) {
-            debug_mode = 1;
+    for (j=0; j<nvars; ++j) {
+        char *ident = PQescapeIdentifier(pgstata_conn, cols[j].name,
+                                         strlen(cols[j].name));
+        if (ident == NULL) {
+            SF_error(PQerrorMessage(pgstata_conn));
+            free(*ddl);
+            free(*copy);
+            *ddl = *copy = NULL;
+            return pgstata_db_error;
         }
+        if (j > 0) {
+            strcat(*copy, ", ");
+            if (create) {
+                strcat(*ddl, ", ");
+            }
+        }
+        strcat(*copy, ident);
+        if (create) {
+            strcat(*ddl, ident);
+            strcat(*ddl, " ");
+            strcat(*ddl, pgstata_save_types[cols[j].kind]);
+        }
+        PQfreemem(ident);
+    }
+    if (create) {
+        strcat(*ddl, ")");
     }
+    strcat(*copy, ") FROM STDIN WITH (FORMAT binary)");
+    if (**ddl == '\000') {
+        free(*ddl);
+        *ddl = NULL;
+    }
+    return pgstata_ok;
+}
 
-    PGCONN_CHECK(debug_mode);
 
-    ST_retcode rc = 0;
-    if (! pgstata_res) {
-        SF_error("Must call \"prepare\" before calling \"populate_next\"\n");
-        pgstata_cleanup(debug_mode);
-        return pgstata_usage_error;
-    }
+static void
+pgstata_save_failed (const pgstata_save_column *col, const int obs)
+{
+    char msg[256];
+    snprintf(msg, 255, "failed to read %s at observation %d\n", col->name,
+             obs);
+    SF_error(msg);
+}
 
-    const int  nfields = PQnfields(pgstata_res); // number of columns
-    char      *valuetmp = NULL;  // ptr to string value, owned by libpq
-    char       msg[256];    // message buffer for errors
-    bzero(msg, 256);
-    // Individual values
-    struct tm  tvalue;
-    char       svalue[245];
-    bzero(svalue, 245);
-    bzero(&tvalue, sizeof(struct tm));
+/*
+ * Adds observation OBS to the COPY data as a binary tuple. Missing values,
+ * and empty strings, which Stata counts as missing, go in as NULLs.
+ */
 
-    int ntups = PQntuples(pgstata_res);  // #rows in this slurp
-    if (ntups == 0) {
-        return pgstata_finished;
+static pgstata_rc
+pgstata_save_row (const pgstata_save_column *cols, const int nvars,
+                  const int obs, FILE *strls, char **strl_buf,
+                  size_t *strl_len)
+{
+    char sbuf[PGSTATA_SDATA_BUF_LEN];
+    double value;
+    int j;
+
+    if (pgstata_save_reserve(2)) {
+        SF_error("out of memory saving data\n");
+        return pgstata_db_error;
     }
+    pgstata_put_int16((int16_t) nvars);
+    for (j=0; j<nvars; ++j) {
+        const pgstata_save_kind kind = cols[j].kind;
+        const char *val = sbuf;
+        size_t len = 0;
 
-    int i, j;
-    for (i=0; i<ntups; ++i) {
-        int stata_obs = 1 + i + pgstata_num_obs_loaded;
-        for (j=0; j<nfields; ++j) {
-            if (PQgetisnull(pgstata_res, i, j)) {
-                continue;
+        if (kind == pgstata_save_strl) {
+            double dlen;
+            if (strls == NULL || fread(&dlen, sizeof(double), 1, strls) != 1) {
+                SF_error("can't read strL values\n");
+                return pgstata_db_error;
             }
-            valuetmp = PQgetvalue(pgstata_res, i, j);
-            int stata_var = 1 + j;
-            switch (column_oids[j]) {
-                case INT4OID:
-                case INT2OID: // maybe atoi?
-                case INT8OID: // maybe use atoll for this?
-                    rc = SF_vstore(stata_var, stata_obs, atol(valuetmp));
-                    break;
+            len = (size_t) dlen;
+            if (len > *strl_len) {
+                char *buf = realloc(*strl_buf, len);
+                if (buf == NULL) {
+                    SF_error("out of memory saving strL values\n");
+                    return pgstata_db_error;
+                }
+                *strl_buf = buf;
+                *strl_len = len;
+            }
+            if (len > 0 && fread(*strl_buf, 1, len, strls) != len) {
+                SF_error("can't read strL values\n");
+                return pgstata_db_error;
+            }
+            val = *strl_buf;
+        }
+        else if (kind == pgstata_save_text) {
+            if (SF_sdata(j + 1, obs, sbuf)) {
+                pgstata_save_failed(&cols[j], obs);
+                return pgstata_db_error;
+            }
+            len = strlen(sbuf);
+        }
+        else if (SF_vdata(j + 1, obs, &value)) {
+            pgstata_save_failed(&cols[j], obs);
+            return pgstata_db_error;
+        }
 
-                case FLOAT4OID:
-                case FLOAT8OID:
-                case NUMERICOID:
-                    rc = SF_vstore(stata_var, stata_obs, 
-                                   strtold(valuetmp, NULL));
-                    break;
+        if (pgstata_save_reserve(len + 12)) {
+            SF_error("out of memory saving data\n");
+            return pgstata_db_error;
+        }
+        if (kind == pgstata_save_text || kind == pgstata_save_strl) {
+            if (len == 0) {
+                pgstata_put_int32(-1);
+            }
+            else {
+                pgstata_put_bytes(val, len);
+            }
+            continue;
+        }
+        if (SF_is_missing(value)) {
+            pgstata_put_int32(-1);
+            continue;
+        }
+        switch (kind) {
+            case pgstata_save_int2:
+                pgstata_put_int32(2);
+                pgstata_put_int16((int16_t) value);
+                break;
+            case pgstata_save_int4:
+                pgstata_put_int32(4);
+                pgstata_put_int32((int32_t) value);
+                break;
+            case pgstata_save_float4: {
+                union {
+                    uint32_t i;
+                    float    f;
+                } f4;
+                f4.f = (float) value;
+                pgstata_put_int32(4);
+                pgstata_put_int32((int32_t) f4.i);
+                break;
+            }
+            case pgstata_save_date:
+                pgstata_put_int32(4);
+                pgstata_put_int32((int32_t) (floor(value)
+                                             - PGSTATA_PG_EPOCH_DAYS));
+                break;
+            case pgstata_save_timestamp:
+                pgstata_put_int32(8);
+                pgstata_put_int64(llround((value - PGSTATA_PG_EPOCH_DAYS
+                                           * (double) PGSTATA_MSECS_PER_DAY)
+                                          * 1000));
+                break;
+            default: {
+                union {
+                    uint64_t i;
+                    double   d;
+                } f8;
+                f8.d = value;
+                pgstata_put_int32(8);
+                pgstata_put_int64((int64_t) f8.i);
+                break;
+            }
+        }
+    }
+    return pgstata_ok;
+}
 
-                case BPCHAROID:
-                case VARCHAROID:
-                    // Assume these are always <= 244 in length.
-                    // See earlier setup.
-                    rc = SF_sstore(stata_var, stata_obs, valuetmp);
-                    break;
 
-                case DATEOID:
-                case TIMESTAMPOID:
-                case TIMESTAMPTZOID:
-                    if (strptime(valuetmp, PGSTATA_PG_DATE_FORMAT,
-                                 &tvalue) == NULL) {
-                        snprintf(msg, 255,
-                                 "failed to parse date at (%d, %d)",
-                                 stata_obs, stata_var);
-                        SF_error(msg);
-                        goto CLEANUP;
-                    }
-                    rc = SF_vstore(stata_var, stata_obs, 
-                                   pgstata_tm2statadate(&tvalue));
-                    bzero(&tvalue, sizeof(struct tm));
-                    break;
+pgstata_rc
+pgstata_save (int argc, char **argv) {
+    USAGE_CHECK(argc, 4, -1,
+                "save TABLE \"names=...\" \"types=...\" \"fmts=...\" "
+                "[\"create\"|\"replace\"|\"append\"|\"truncate\"] "
+                "[\"strlfile=PATH\"] [\"debug\"]");
+    const char *table = argv[0];
+    const int debug_mode = pgstata_has_opt(argc-1, argv+1, "debug");
+    const char *names = pgstata_opt_value(argc-1, argv+1, "names");
+    const char *types = pgstata_opt_value(argc-1, argv+1, "types");
+    const char *fmts = pgstata_opt_value(argc-1, argv+1, "fmts");
+    const char *strl_path = pgstata_opt_value(argc-1, argv+1, "strlfile");
+    const char *mode = "create";
+    char msg[256];
+    int nvars = SF_nvars();
+    int obs, j;
 
-                case BOOLOID:
-                    rc = SF_vstore(stata_var, stata_obs,
-                                   strncasecmp(valuetmp, "t", 1) == 0);
-                    break;
+    if (pgstata_has_opt(argc-1, argv+1, "replace")) {
+        mode = "replace";
+    }
+    else if (pgstata_has_opt(argc-1, argv+1, "append")) {
+        mode = "append";
+    }
+    else if (pgstata_has_opt(argc-1, argv+1, "truncate")) {
+        mode = "truncate";
+    }
+    if (names == NULL || types == NULL || fmts == NULL || nvars < 1) {
+        SF_error("save needs the variables, with their names, types and "
+                 "formats\n");
+        return pgstata_usage_error;
+    }
 
-                /*
-                 * The following types will be imported as strings and
-                 * truncated to 244 characters if their string representation
-                 * is longer than that.
-                 */
-                case TEXTOID:
-                case CASHOID: // money
-                case INTERVALOID: // interval
-                case TIMEOID: // time without time zone
-                case TIMETZOID: //time with time zone
-                default:
-                    strncpy(svalue, valuetmp, 244);
-                    rc = SF_sstore(stata_var, stata_obs, svalue);
-                    bzero(svalue, 245);
-                    break;
-            }
-            if (rc) {
-                snprintf(msg, 255,
-                         "failed to store oid:%d at (%d,%d)\n",
-                         column_oids[j], stata_obs, stata_var);
-                SF_error(msg);
-                goto CLEANUP;
+    PGCONN_CHECK(debug_mode);
+    if (pgstata_in_transaction || pgstata_columns != NULL) {
+        SF_error("save: a load is in progress on this connection\n");
+        return pgstata_usage_error;
+    }
+
+    pgstata_save_column *cols = calloc(nvars, sizeof(pgstata_save_column));
+    char *ddl = NULL, *copy = NULL;
+    char *strl_buf = NULL;
+    size_t strl_len = 0;
+    FILE *strls = NULL;
+    double saved = 0, started = pgstata_clock();
+    int in_copy = 0;
+    PGresult *res;
+    pgstata_rc rc = pgstata_ok;
+    if (cols == NULL) {
+        SF_error("out of memory saving data\n");
+        return pgstata_db_error;
+    }
+    rc = pgstata_plan_save(cols, nvars, names, types, fmts);
+    if (rc == pgstata_ok) {
+        rc = pgstata_save_sql(cols, nvars, table, mode, &ddl, &copy);
+    }
+    for (j=0; rc == pgstata_ok && j<nvars; ++j) {
+        if (cols[j].kind == pgstata_save_strl && strls == NULL) {
+            strls = strl_path != NULL ? fopen(strl_path, "rb") : NULL;
+            if (strls == NULL) {
+                SF_error("can't open the file of strL values\n");
+                rc = pgstata_usage_error;
             }
         }
     }
-    pgstata_num_obs_loaded += i;
-    PQclear(pgstata_res);
+    if (rc != pgstata_ok) {
+        goto DONE;
+    }
 
-    /* Advance the cursor */
-    char advance_sql[256];
-    *advance_sql = '\000';
-    snprintf(advance_sql, 255, "FETCH FORWARD %d FROM pgstata_cursor\n",
-             PGSTATA_CURSOR_SLURP_ROWS);
+    // One transaction, so that a failure leaves the table as it was
+    rc = pgstata_exec_command(pgstata_conn, "BEGIN TRANSACTION", debug_mode);
+    if (rc == pgstata_ok && ddl != NULL) {
+        rc = pgstata_exec_command(pgstata_conn, ddl, debug_mode);
+    }
+    if (rc != pgstata_ok) {
+        goto DONE;
+    }
     if (debug_mode) {
-        SF_display(advance_sql);
+        SF_display(copy);
+        SF_display("\n");
     }
-    pgstata_res = PQexec(pgstata_conn, advance_sql);
-    if (PQresultStatus(pgstata_res) != PGRES_TUPLES_OK) {
-        SF_error("error: ");
-        SF_error(PQresultErrorMessage(pgstata_res));
+    res = PQexec(pgstata_conn, copy);
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        SF_error(PQresultErrorMessage(res));
+        PQclear(res);
         rc = pgstata_db_error;
-        goto CLEANUP;
+        goto DONE;
     }
-    int pending = PQntuples(pgstata_res);
-    pgstata_num_obs += pending;
+    PQclear(res);
+    in_copy = 1;
 
-    *msg = '\000';
-    snprintf(msg, 32, "%i", pgstata_num_obs);
-    if (debug_mode) {
-        SF_display("DEBUG: _obs: ");
-        SF_display(msg);
-        SF_display("\n");
+    // Header: signature, flags and header extension length
+    pgstata_save_used = 0;
+    if (pgstata_save_reserve(PGSTATA_COPY_SIGNATURE_LEN + 8)) {
+        SF_error("out of memory saving data\n");
+        rc = pgstata_db_error;
+        goto DONE;
     }
-    SF_macro_save("_obs", msg);
+    memcpy(pgstata_save_buf, PGSTATA_COPY_SIGNATURE,
+           PGSTATA_COPY_SIGNATURE_LEN);
+    pgstata_save_used = PGSTATA_COPY_SIGNATURE_LEN;
+    pgstata_put_int32(0);
+    pgstata_put_int32(0);
 
-  CLEANUP:
-    if (rc) {
-        SF_error("*error* cleaning up\n");
-        pgstata_cleanup(debug_mode);
+    for (obs=SF_in1(); obs<=SF_in2(); ++obs) {
+        if (! SF_ifobs(obs)) {
+            continue;
+        }
+        rc = pgstata_save_row(cols, nvars, obs, strls, &strl_buf, &strl_len);
+        if (rc == pgstata_ok && pgstata_save_used >= PGSTATA_SAVE_CHUNK_BYTES) {
+            rc = pgstata_save_flush();
+        }
+        if (rc != pgstata_ok) {
+            goto DONE;
+        }
+        saved += 1;
     }
 
-    if (!rc) {
-        rc = pending ? pgstata_ok : pgstata_finished;
-        if (debug_mode) {
-            if (rc == pgstata_ok) {
-                SF_display("DEBUG: more data.\n");
-            }
-            else if (rc == pgstata_finished) {
-                SF_display("DEBUG: no more data. Show's over. Go home.\n");
-            }
+    // Trailer, and the end of the COPY
+    if (pgstata_save_reserve(2)) {
+        SF_error("out of memory saving data\n");
+        rc = pgstata_db_error;
+        goto DONE;
+    }
+    pgstata_put_int16(-1);
+    rc = pgstata_save_flush();
+    if (rc != pgstata_ok) {
+        goto DONE;
+    }
+    in_copy = 0;
+    if (PQputCopyEnd(pgstata_conn, NULL) != 1) {
+        SF_error(PQerrorMessage(pgstata_conn));
+        rc = pgstata_db_error;
+        goto DONE;
+    }
+    while ((res = PQgetResult(pgstata_conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK && rc == pgstata_ok) {
+            SF_error(PQresultErrorMessage(res));
+            rc = pgstata_db_error;
+        }
+        PQclear(res);
+    }
+    if (rc == pgstata_ok) {
+        rc = pgstata_exec_command(pgstata_conn, "COMMIT TRANSACTION",
+                                  debug_mode);
+    }
+    if (debug_mode) {
+        snprintf(msg, 255, "DEBUG: sent %.0f rows in %.3fs\n", saved,
+                 pgstata_clock() - started);
+        SF_display(msg);
+    }
+
+  DONE:
+    if (in_copy) {
+        PQputCopyEnd(pgstata_conn, "pgsave failed");
+        while ((res = PQgetResult(pgstata_conn)) != NULL) {
+            PQclear(res);
         }
     }
+    if (rc != pgstata_ok && PQtransactionStatus(pgstata_conn)
+                            != PQTRANS_IDLE) {
+        PQclear(PQexec(pgstata_conn, "ROLLBACK TRANSACTION"));
+    }
+    snprintf(msg, 32, "%.0f", rc == pgstata_ok ? saved : 0);
+    SF_macro_save("_saved", msg);
+    if (strls != NULL) {
+        fclose(strls);
+    }
+    free(strl_buf);
+    free(cols);
+    free(ddl);
+    free(copy);
+    free(pgstata_save_buf);
+    pgstata_save_buf = NULL;
+    pgstata_save_len = 0;
+    pgstata_save_used = 0;
     return rc;
 }
 
@@ -706,12 +7889,39 @@ stata_call (int argc, char **argv) {
     else if (strcmp(argv[0], "disconnect") == 0) {
         return pgstata_disconnect(argc-1, argv+1);
     }
+    else if (strcmp(argv[0], "close") == 0) {
+        return pgstata_close(argc-1, argv+1);
+    }
+    else if (strcmp(argv[0], "bind") == 0) {
+        return pgstata_bind(argc-1, argv+1);
+    }
+    else if (strcmp(argv[0], "keys") == 0) {
+        return pgstata_keys_set(argc-1, argv+1);
+    }
     else if (strcmp(argv[0], "prepare") == 0) {
         return pgstata_prepare(argc-1, argv+1);
     }
     else if (strcmp(argv[0], "populate_next") == 0) {
         return pgstata_populate_next(argc-1, argv+1);
     }
+    else if (strcmp(argv[0], "profile") == 0) {
+        return pgstata_profiler(argc-1, argv+1);
+    }
+    else if (strcmp(argv[0], "export") == 0) {
+        return pgstata_export(argc-1, argv+1);
+    }
+    else if (strcmp(argv[0], "cache_save") == 0) {
+        return pgstata_cache_save(argc-1, argv+1);
+    }
+    else if (strcmp(argv[0], "labels") == 0) {
+        return pgstata_labels(argc-1, argv+1);
+    }
+    else if (strcmp(argv[0], "stats") == 0) {
+        return pgstata_colstats(argc-1, argv+1);
+    }
+    else if (strcmp(argv[0], "save") == 0) {
+        return pgstata_save(argc-1, argv+1);
+    }
 
     SF_error("unrecognised command option\n");
     return pgstata_usage_error;
@@ -0,0 +1,849 @@
+// License blurb {{{
+
+/*
+    pgconv - the pgload plugin's value decoders
+    Copyright (C) 2007 Andrew Chadwick
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License and the
+    GNU Lesser General Public License along with this program.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+// }}}
+// Library inclusions {{{
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "pgconv.h"
+
+// }}}
+// Calendar {{{
+
+/*
+ * Days from 1 Jan 1960 to the given proleptic Gregorian date. YEAR is
+ * astronomical, so 1 BC is year 0. After Howard Hinnant's days_from_civil().
+ */
+
+long
+pgstata_days_from_civil (long year, const int month, const int day)
+{
+    year -= month <= 2;
+    const long era = (year >= 0 ? year : year - 399) / 400;
+    const long yoe = year - era * 400;
+    const long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 715815;   // 1 Mar 0000 to 1 Jan 1960
+}
+
+
+// }}}
+// Value decoders {{{
+
+/*
+ * Decimal parsing kernel for the text decoders. Digits are accumulated into
+ * a 64-bit mantissa, eight at a time where the bytes allow it, and turned
+ * into a double exactly when the mantissa and power of ten are both exactly
+ * representable (Clinger's fast path). That covers nearly all prices,
+ * returns and counts. Anything else goes to strtod(), which rounds
+ * correctly, so results never differ from it.
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PGSTATA_SWAR_DIGITS 1
+#endif
+
+#define PGSTATA_MAX_MANTISSA_DIGITS 19
+
+/* Sign words of binary NUMERIC values; the infinities are PostgreSQL 14's */
+
+#define PGSTATA_NUMERIC_POS  0x0000
+#define PGSTATA_NUMERIC_NEG  0x4000
+#define PGSTATA_NUMERIC_NAN  0xC000
+#define PGSTATA_NUMERIC_PINF 0xD000
+#define PGSTATA_NUMERIC_NINF 0xF000
+
+static const double pgstata_exact_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#ifdef PGSTATA_SWAR_DIGITS
+// True if all eight bytes of a little-endian load are ASCII digits
+static inline int
+pgstata_is_8digits (const uint64_t v)
+{
+    return ((v & UINT64_C(0xF0F0F0F0F0F0F0F0))
+            | (((v + UINT64_C(0x0606060606060606))
+                & UINT64_C(0xF0F0F0F0F0F0F0F0)) >> 4))
+           == UINT64_C(0x3333333333333333);
+}
+
+// Value of eight ASCII digits loaded little-endian
+static inline uint32_t
+pgstata_parse_8digits (uint64_t v)
+{
+    const uint64_t mask = UINT64_C(0x000000FF000000FF);
+    const uint64_t mul1 = UINT64_C(0x000F424000000064);  // 100 + (1000000 << 32)
+    const uint64_t mul2 = UINT64_C(0x0000271000000001);  // 1 + (10000 << 32)
+    v -= UINT64_C(0x3030303030303030);
+    v = (v * 10) + (v >> 8);
+    v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+    return (uint32_t) v;
+}
+#endif
+
+/*
+ * Consumes the run of digits at P, adding them to *MANT. *NDIGITS counts the
+ * digits in *MANT (leading zeros aside, mostly); once it would exceed
+ * PGSTATA_MAX_MANTISSA_DIGITS further digits are skipped and *DROPPED is set.
+ */
+
+static inline const char *
+pgstata_scan_digits (const char *p, const char *end, uint64_t *mant,
+                     int *ndigits, int *dropped)
+{
+#ifdef PGSTATA_SWAR_DIGITS
+    while (end - p >= 8 && *ndigits + 8 <= PGSTATA_MAX_MANTISSA_DIGITS) {
+        uint64_t chunk;
+        memcpy(&chunk, p, 8);
+        if (! pgstata_is_8digits(chunk)) {
+            break;
+        }
+        *mant = *mant * 100000000 + pgstata_parse_8digits(chunk);
+        if (*mant != 0) {
+            *ndigits += 8;
+        }
+        p += 8;
+    }
+#endif
+    while (p < end && (unsigned) (*p - '0') < 10) {
+        if (*ndigits < PGSTATA_MAX_MANTISSA_DIGITS) {
+            *mant = *mant * 10 + (unsigned) (*p - '0');
+            if (*mant != 0) {
+                ++*ndigits;
+            }
+        }
+        else {
+            *dropped = 1;
+        }
+        ++p;
+    }
+    return p;
+}
+
+/*
+ * Parses the LEN bytes at VAL, which must also be NUL-terminated, as a
+ * double. NaN and infinities become Stata missing. Returns -1 if VAL is not
+ * a number at all.
+ */
+
+int
+pgstata_parse_double (const char *val, const int len, double *out)
+{
+    const char *p = val;
+    const char *end = val + len;
+    uint64_t mant = 0;
+    int ndigits = 0, dropped = 0, exp10 = 0, negative = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        ++p;
+    }
+    const char *digits = p;
+    p = pgstata_scan_digits(p, end, &mant, &ndigits, &dropped);
+    int any_digits = (p != digits);
+    if (p < end && *p == '.') {
+        const char *frac = ++p;
+        p = pgstata_scan_digits(p, end, &mant, &ndigits, &dropped);
+        exp10 -= (int) (p - frac);
+        any_digits |= (p != frac);
+    }
+    if (! any_digits) {
+        goto SLOW;      // NaN, Infinity, or junk
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int exp_negative = 0, exp_value = 0;
+        ++p;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = (*p == '-');
+            ++p;
+        }
+        if (p == end) {
+            goto SLOW;
+        }
+        while (p < end && (unsigned) (*p - '0') < 10) {
+            if (exp_value < 100000) {
+                exp_value = exp_value * 10 + (*p - '0');
+            }
+            ++p;
+        }
+        exp10 += exp_negative ? -exp_value : exp_value;
+    }
+    if (p != end || dropped) {
+        goto SLOW;
+    }
+
+    if (mant <= PGSTATA_EXACT_INT_LIMIT && exp10 >= -22 && exp10 <= 22) {
+        double value = (double) mant;
+        if (exp10 < 0) {
+            value /= pgstata_exact_pow10[-exp10];
+        }
+        else {
+            value *= pgstata_exact_pow10[exp10];
+        }
+        *out = negative ? -value : value;
+        return 0;
+    }
+
+  SLOW: {
+        char *parsed_end = NULL;
+        double value = strtod(val, &parsed_end);
+        if (parsed_end == val) {
+            return -1;
+        }
+        *out = isfinite(value) ? value : PGSTATA_MISSVAL;
+        return 0;
+    }
+}
+
+
+int
+pgstata_decode_int_text (const char *val, const int len, double *out)
+{
+    const char *p = val;
+    const char *end = val + len;
+    uint64_t mag = 0;
+    int ndigits = 0, dropped = 0, negative = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        ++p;
+    }
+    const char *q = pgstata_scan_digits(p, end, &mag, &ndigits, &dropped);
+    if (q == p || q != end || dropped) {
+        return pgstata_parse_double(val, len, out) < 0 ? -1 : 1;
+    }
+    double value = (double) mag;
+    *out = negative ? -value : value;
+    if (mag > PGSTATA_EXACT_INT_LIMIT && (uint64_t) value != mag) {
+        return 1;
+    }
+    return 0;
+}
+
+int
+pgstata_decode_float_text (const char *val, const int len, double *out)
+{
+    return pgstata_parse_double(val, len, out);
+}
+
+int
+pgstata_decode_bool_text (const char *val, const int len, double *out)
+{
+    *out = strncasecmp(val, "t", 1) == 0;
+    return 0;
+}
+
+/*
+ * Dates and timestamps are read in the ISO DateStyle which connect() asks
+ * for: YYYY-MM-DD, then for timestamps HH:MM:SS[.ffffff], then for
+ * timestamptz a UTC offset +HH[:MM[:SS]], and finally " BC" for years
+ * before 1 AD. Values in a column tend to repeat (panel data has the same
+ * few hundred dates over and over), so each decoder remembers the last
+ * string it saw and what it came to.
+ */
+
+typedef struct _pgstata_date_cache {
+    int    len;
+    char   text[PGSTATA_DATE_CACHE_LEN];
+    double value;
+} pgstata_date_cache;
+
+// One of each per thread, since parallel() workers decode side by side
+static __thread pgstata_date_cache pgstata_date_text_cache;
+static __thread pgstata_date_cache pgstata_timestamp_text_cache;
+
+static inline int
+pgstata_date_cache_hit (const pgstata_date_cache *cache, const char *val,
+                        const int len, double *out)
+{
+    if (len == cache->len && memcmp(val, cache->text, len) == 0) {
+        *out = cache->value;
+        return 1;
+    }
+    return 0;
+}
+
+static inline void
+pgstata_date_cache_set (pgstata_date_cache *cache, const char *val,
+                        const int len, const double value)
+{
+    if (len <= PGSTATA_DATE_CACHE_LEN) {
+        memcpy(cache->text, val, len);
+        cache->len = len;
+        cache->value = value;
+    }
+}
+
+// Reads exactly N digits at *P, advancing past them; -1 if they aren't there
+static inline int
+pgstata_scan_fixed_digits (const char **p, const char *end, const int n)
+{
+    int i, value = 0;
+    if (end - *p < n) {
+        return -1;
+    }
+    for (i=0; i<n; ++i) {
+        const unsigned digit = (unsigned) ((*p)[i] - '0');
+        if (digit > 9) {
+            return -1;
+        }
+        value = value * 10 + digit;
+    }
+    *p += n;
+    return value;
+}
+
+/*
+ * Reads the YYYY-MM-DD at *P, advancing past it, and sets *DAYS to its Stata
+ * date. Years may have more than four digits. BC says whether the value
+ * ended in " BC". Returns -1 if there is no valid date there.
+ */
+
+static inline int
+pgstata_scan_iso_date (const char **p, const char *end, const int bc,
+                       long *days)
+{
+    const char *q = *p;
+    long year = 0;
+    while (q < end && (unsigned) (*q - '0') < 10 && q - *p < 9) {
+        year = year * 10 + (*q - '0');
+        ++q;
+    }
+    if (q - *p < 4 || q == end || *q++ != '-') {
+        return -1;
+    }
+    const int month = pgstata_scan_fixed_digits(&q, end, 2);
+    if (month < 1 || month > 12 || q == end || *q++ != '-') {
+        return -1;
+    }
+    const int day = pgstata_scan_fixed_digits(&q, end, 2);
+    if (day < 1 || day > 31) {
+        return -1;
+    }
+    *days = pgstata_days_from_civil(bc ? 1 - year : year, month, day);
+    *p = q;
+    return 0;
+}
+
+// Strips a trailing " BC" from the value, returning 1 if there was one
+static inline int
+pgstata_strip_bc (const char *val, int *len)
+{
+    if (*len > 3 && memcmp(val + *len - 3, " BC", 3) == 0) {
+        *len -= 3;
+        return 1;
+    }
+    return 0;
+}
+
+// "infinity" and "-infinity" load as missing
+static inline int
+pgstata_is_infinity (const char *val, const int len)
+{
+    return (len == 8 && memcmp(val, "infinity", 8) == 0)
+           || (len == 9 && memcmp(val, "-infinity", 9) == 0);
+}
+
+int
+pgstata_decode_date_text (const char *val, const int len, double *out)
+{
+    pgstata_date_cache *cache = &pgstata_date_text_cache;
+    if (pgstata_date_cache_hit(cache, val, len, out)) {
+        return 0;
+    }
+    if (pgstata_is_infinity(val, len)) {
+        *out = PGSTATA_MISSVAL;
+        return 0;
+    }
+
+    int date_len = len;
+    const int bc = pgstata_strip_bc(val, &date_len);
+    const char *p = val;
+    long days;
+    if (pgstata_scan_iso_date(&p, val + date_len, bc, &days)
+        || p != val + date_len) {
+        return -1;
+    }
+    *out = (double) days;
+    pgstata_date_cache_set(cache, val, len, *out);
+    return 0;
+}
+
+// Timestamps, with or without a time zone, become Stata %tc milliseconds.
+// Digits beyond the millisecond are dropped, as they are for binary values.
+int
+pgstata_decode_timestamp_text (const char *val, const int len, double *out)
+{
+    pgstata_date_cache *cache = &pgstata_timestamp_text_cache;
+    if (pgstata_date_cache_hit(cache, val, len, out)) {
+        return 0;
+    }
+    if (pgstata_is_infinity(val, len)) {
+        *out = PGSTATA_MISSVAL;
+        return 0;
+    }
+
+    int ts_len = len;
+    const int bc = pgstata_strip_bc(val, &ts_len);
+    const char *p = val;
+    const char *end = val + ts_len;
+    long days;
+    if (pgstata_scan_iso_date(&p, end, bc, &days)
+        || p == end || (*p != ' ' && *p != 'T')) {
+        return -1;
+    }
+    ++p;
+
+    const int hour = pgstata_scan_fixed_digits(&p, end, 2);
+    if (hour < 0 || p == end || *p++ != ':') {
+        return -1;
+    }
+    const int minute = pgstata_scan_fixed_digits(&p, end, 2);
+    if (minute < 0 || p == end || *p++ != ':') {
+        return -1;
+    }
+    const int second = pgstata_scan_fixed_digits(&p, end, 2);
+    if (second < 0) {
+        return -1;
+    }
+    int64_t msecs = ((hour * 60 + minute) * 60 + second) * INT64_C(1000);
+    if (p < end && *p == '.') {
+        int scale = 100;
+        ++p;
+        while (p < end && (unsigned) (*p - '0') < 10) {
+            msecs += (*p - '0') * scale;
+            scale /= 10;
+            ++p;
+        }
+    }
+
+    // timestamptz: shift to UTC, as the binary form already is
+    if (p < end && (*p == '+' || *p == '-')) {
+        const int sign = *p++ == '-' ? -1 : 1;
+        int offset = pgstata_scan_fixed_digits(&p, end, 2) * 3600;
+        if (offset < 0) {
+            return -1;
+        }
+        if (p < end && *p == ':') {
+            ++p;
+            const int off_min = pgstata_scan_fixed_digits(&p, end, 2);
+            if (off_min < 0) {
+                return -1;
+            }
+            offset += off_min * 60;
+            if (p < end && *p == ':') {
+                ++p;
+                const int off_sec = pgstata_scan_fixed_digits(&p, end, 2);
+                if (off_sec < 0) {
+                    return -1;
+                }
+                offset += off_sec;
+            }
+        }
+        msecs -= sign * offset * INT64_C(1000);
+    }
+    if (p != end) {
+        return -1;
+    }
+
+    *out = (double) (days * PGSTATA_MSECS_PER_DAY + msecs);
+    pgstata_date_cache_set(cache, val, len, *out);
+    return 0;
+}
+
+int
+pgstata_decode_bool_binary (const char *val, const int len, double *out)
+{
+    if (len != 1) {
+        return -1;
+    }
+    *out = *val != 0;
+    return 0;
+}
+
+int
+pgstata_decode_int2_binary (const char *val, const int len, double *out)
+{
+    if (len != 2) {
+        return -1;
+    }
+    *out = pgstata_get_int16(val);
+    return 0;
+}
+
+int
+pgstata_decode_int4_binary (const char *val, const int len, double *out)
+{
+    if (len != 4) {
+        return -1;
+    }
+    *out = pgstata_get_int32(val);
+    return 0;
+}
+
+int
+pgstata_decode_int8_binary (const char *val, const int len, double *out)
+{
+    if (len != 8) {
+        return -1;
+    }
+    int64_t value = pgstata_get_int64(val);
+    *out = (double) value;
+    if (value > (int64_t) PGSTATA_EXACT_INT_LIMIT
+        || value < -(int64_t) PGSTATA_EXACT_INT_LIMIT) {
+        // doubles at or beyond 2^63 don't convert back to int64
+        return *out >= 9223372036854775808.0 || (int64_t) *out != value;
+    }
+    return 0;
+}
+
+int
+pgstata_decode_float4_binary (const char *val, const int len, double *out)
+{
+    union {
+        uint32_t i;
+        float    f;
+    } f4;
+    if (len != 4) {
+        return -1;
+    }
+    f4.i = (uint32_t) pgstata_get_int32(val);
+    *out = isfinite(f4.f) ? f4.f : PGSTATA_MISSVAL;
+    return 0;
+}
+
+int
+pgstata_decode_float8_binary (const char *val, const int len, double *out)
+{
+    union {
+        uint64_t i;
+        double   d;
+    } f8;
+    if (len != 8) {
+        return -1;
+    }
+    f8.i = (uint64_t) pgstata_get_int64(val);
+    *out = isfinite(f8.d) ? f8.d : PGSTATA_MISSVAL;
+    return 0;
+}
+
+/*
+ * NUMERIC values, as 0.DIGITS x 10^EXP10, gathered a decimal digit at a time
+ * from the most significant. Leading zeros only move the exponent, trailing
+ * ones aren't counted in NSIG, and only the first CAP digits are kept.
+ */
+
+typedef struct _pgstata_decimal {
+    char *digits;
+    int   cap;
+    int   n;
+    int   nsig;
+    int   exp10;
+} pgstata_decimal;
+
+static inline void
+pgstata_decimal_push (pgstata_decimal *dec, const char c)
+{
+    if (dec->n == 0 && c == '0') {
+        --dec->exp10;
+        return;
+    }
+    if (dec->n < dec->cap) {
+        dec->digits[dec->n] = c;
+    }
+    ++dec->n;
+    if (c != '0') {
+        dec->nsig = dec->n;
+    }
+}
+
+/*
+ * Whether the non-zero decimal DEC loses digits as the double VALUE: whether
+ * VALUE, written out to as many significant digits as DEC has, differs from
+ * it. Up to DBL_DIG digits always survive, outside the subnormal range. A
+ * value beyond Stata's largest, or with more than
+ * PGSTATA_NUMERIC_CHECK_DIGITS digits, counts as losing them.
+ */
+
+static int
+pgstata_decimal_lossy (const pgstata_decimal *dec, const double value)
+{
+    char buf[PGSTATA_NUMERIC_CHECK_DIGITS + 16];
+    int i;
+    if (value >= PGSTATA_MISSVAL) {
+        return 1;
+    }
+    if (dec->nsig <= DBL_DIG && fabs(value) >= DBL_MIN) {
+        return 0;
+    }
+    if (dec->nsig > PGSTATA_NUMERIC_CHECK_DIGITS) {
+        return 1;
+    }
+    snprintf(buf, sizeof(buf), "%.*e", dec->nsig - 1, fabs(value));
+    if (buf[0] != dec->digits[0]) {
+        return 1;
+    }
+    for (i=1; i<dec->nsig; ++i) {
+        if (buf[i + 1] != dec->digits[i]) {
+            return 1;
+        }
+    }
+    return atoi(strchr(buf, 'e') + 1) != dec->exp10 - 1;
+}
+
+/*
+ * Binary NUMERIC: the number of base-10000 digits, the weight (power of
+ * 10000) of the first, a sign word and the display scale, each 16 bits,
+ * then the digits; the value is the sum of digit[i] * 10000^(weight - i).
+ * Up to four digits make an exact 64-bit mantissa, which becomes a double
+ * by Clinger's fast path when the power of ten allows, as in the text
+ * kernel. That covers prices, amounts and rates. Longer or more extreme
+ * values are written out in decimal for strtod(), so every result is the
+ * correctly rounded one. With CHECK set, returns 1 for a value which loses
+ * digits in the double.
+ */
+
+static inline int
+pgstata_numeric_binary (const char *val, const int len, double *out,
+                        const int check)
+{
+    if (len < 8) {
+        return -1;
+    }
+    const int ndigits = pgstata_get_int16(val);
+    const int weight = pgstata_get_int16(val + 2);
+    const int sign = (uint16_t) pgstata_get_int16(val + 4);
+    const char *digits = val + 8;
+    int i;
+    if (sign == PGSTATA_NUMERIC_NAN || sign == PGSTATA_NUMERIC_PINF
+        || sign == PGSTATA_NUMERIC_NINF) {
+        *out = PGSTATA_MISSVAL;
+        return 0;
+    }
+    if ((sign != PGSTATA_NUMERIC_POS && sign != PGSTATA_NUMERIC_NEG)
+        || ndigits < 0 || len != 8 + 2 * ndigits) {
+        return -1;
+    }
+
+    if (ndigits <= 4) {
+        uint64_t mant = 0;
+        for (i=0; i<ndigits; ++i) {
+            const int d = pgstata_get_int16(digits + 2 * i);
+            if ((unsigned) d >= 10000) {
+                return -1;
+            }
+            mant = mant * 10000 + (unsigned) d;
+        }
+        // Trailing zeros, or zeros added to a large exponent, let more
+        // values through
+        int exp10 = 4 * (weight + 1 - ndigits);
+        while (exp10 < 0 && mant != 0 && mant % 10 == 0) {
+            mant /= 10;
+            ++exp10;
+        }
+        while (exp10 > 22 && mant != 0
+               && mant <= PGSTATA_EXACT_INT_LIMIT / 10) {
+            mant *= 10;
+            --exp10;
+        }
+        if (mant <= PGSTATA_EXACT_INT_LIMIT && exp10 >= -22 && exp10 <= 22) {
+            double value = (double) mant;
+            if (exp10 < 0) {
+                value /= pgstata_exact_pow10[-exp10];
+            }
+            else {
+                value *= pgstata_exact_pow10[exp10];
+            }
+            *out = sign == PGSTATA_NUMERIC_NEG ? -value : value;
+            if (! check || mant < UINT64_C(1000000000000000)) {
+                return 0;
+            }
+        }
+    }
+
+    // ".DIGITSe+EXP10", on the stack unless it is very long
+    char stack_buf[PGSTATA_NUMERIC_CHECK_DIGITS + 32];
+    const size_t buf_len = 4 * (size_t) ndigits + 16;
+    char *buf = buf_len <= sizeof(stack_buf) ? stack_buf : malloc(buf_len);
+    if (buf == NULL) {
+        return -1;
+    }
+    pgstata_decimal dec = { buf + 1, 4 * ndigits, 0, 0, 4 * (weight + 1) };
+    for (i=0; i<ndigits; ++i) {
+        const int d = pgstata_get_int16(digits + 2 * i);
+        if ((unsigned) d >= 10000) {
+            if (buf != stack_buf) {
+                free(buf);
+            }
+            return -1;
+        }
+        pgstata_decimal_push(&dec, (char) ('0' + d / 1000));
+        pgstata_decimal_push(&dec, (char) ('0' + d / 100 % 10));
+        pgstata_decimal_push(&dec, (char) ('0' + d / 10 % 10));
+        pgstata_decimal_push(&dec, (char) ('0' + d % 10));
+    }
+    double value = 0;
+    int lossy = 0;
+    if (dec.nsig > 0) {
+        // The exponent is at most 4 * 32768 either way
+        char *e = buf + 1 + dec.nsig;
+        int exp10 = dec.exp10 < 0 ? -dec.exp10 : dec.exp10;
+        buf[0] = '.';
+        *e++ = 'e';
+        if (dec.exp10 < 0) {
+            *e++ = '-';
+        }
+        for (i=100000; i>1 && exp10 < i; i/=10) {
+        }
+        for (; i>0; i/=10) {
+            *e++ = (char) ('0' + exp10 / i % 10);
+        }
+        *e = '\000';
+        value = strtod(buf, NULL);
+        if (! isfinite(value)) {
+            value = PGSTATA_MISSVAL;
+        }
+        lossy = check && pgstata_decimal_lossy(&dec, value);
+    }
+    if (sign == PGSTATA_NUMERIC_NEG && value != PGSTATA_MISSVAL) {
+        value = -value;
+    }
+    if (buf != stack_buf) {
+        free(buf);
+    }
+    *out = value;
+    return lossy;
+}
+
+int
+pgstata_decode_numeric_binary (const char *val, const int len, double *out)
+{
+    return pgstata_numeric_binary(val, len, out, 0);
+}
+
+int
+pgstata_decode_numeric_binary_checked (const char *val, const int len,
+                                       double *out)
+{
+    return pgstata_numeric_binary(val, len, out, 1);
+}
+
+// The text form, as the float decoder reads it, but returning 1 for a value
+// which loses digits in the double
+int
+pgstata_decode_numeric_text_checked (const char *val, const int len,
+                                     double *out)
+{
+    char digits[PGSTATA_NUMERIC_CHECK_DIGITS];
+    pgstata_decimal dec = { digits, PGSTATA_NUMERIC_CHECK_DIGITS, 0, 0, 0 };
+    const char *p = val;
+    const char *end = val + len;
+    if (pgstata_parse_double(val, len, out) < 0) {
+        return -1;
+    }
+    if (p < end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    const char *point = p;
+    while (point < end && *point != '.') {
+        ++point;
+    }
+    dec.exp10 = (int) (point - p);
+    for (; p < end; ++p) {
+        if ((unsigned) (*p - '0') < 10) {
+            pgstata_decimal_push(&dec, *p);
+        }
+        else if (*p != '.') {
+            return 0;       // NaN or Infinity, which the server spells out
+        }
+    }
+    return dec.nsig > 0 && pgstata_decimal_lossy(&dec, fabs(*out));
+}
+
+// Days since 1 Jan 2000; +/-infinity become missing
+int
+pgstata_decode_date_binary (const char *val, const int len, double *out)
+{
+    if (len != 4) {
+        return -1;
+    }
+    int32_t days = pgstata_get_int32(val);
+    if (days == INT32_MIN || days == INT32_MAX) {
+        *out = PGSTATA_MISSVAL;
+        return 0;
+    }
+    *out = days + PGSTATA_PG_EPOCH_DAYS;
+    return 0;
+}
+
+// Microseconds since midnight UTC, 1 Jan 2000, to %tc milliseconds, rounding
+// down like the text form; +/-infinity become missing
+int
+pgstata_decode_timestamp_binary (const char *val, const int len, double *out)
+{
+    if (len != 8) {
+        return -1;
+    }
+    int64_t usecs = pgstata_get_int64(val);
+    if (usecs == INT64_MIN || usecs == INT64_MAX) {
+        *out = PGSTATA_MISSVAL;
+        return 0;
+    }
+    int64_t msecs = usecs / 1000;
+    if (usecs % 1000 < 0) {
+        --msecs;
+    }
+    *out = (double) (msecs + PGSTATA_PG_EPOCH_DAYS * PGSTATA_MSECS_PER_DAY);
+    return 0;
+}
+
+
+// }}}
+// Strings {{{
+
+/*
+ * Stata counts a strN's width in bytes, so a value cut down to fit is cut
+ * back to the start of the UTF-8 character the limit falls in. Bytes of the
+ * form 10xxxxxx continue a character.
+ */
+
+int
+pgstata_utf8_clip (const char *val, int len, const int max_len)
+{
+    if (max_len > 0 && len > max_len) {
+        len = max_len;
+        while (len > 0 && (val[len] & 0xC0) == 0x80) {
+            --len;
+        }
+    }
+    return len;
+}
+
+// }}}
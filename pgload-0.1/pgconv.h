@@ -0,0 +1,138 @@
+// License blurb {{{
+
+/*
+    pgconv - the pgload plugin's value decoders
+    Copyright (C) 2007 Andrew Chadwick
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License and the
+    GNU Lesser General Public License along with this program.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+// }}}
+
+#if !defined(PGCONV_H)
+#define PGCONV_H
+
+#include <stdint.h>
+
+/*
+ * The decoders which turn Postgres values, in text or binary COPY form, into
+ * Stata numbers. They depend on nothing but the C library, so that they can
+ * be benchmarked and fuzzed on their own (convbench.c, convfuzz.c) as well as
+ * linked into the plugin.
+ */
+
+/* Days from the Stata epoch (1 Jan 1960) to the Postgres epoch (1 Jan 2000).
+ * Binary dates and timestamps are relative to the latter. */
+
+#define PGSTATA_PG_EPOCH_DAYS 14610
+
+/* Milliseconds per day: Stata %tc clock values count milliseconds. */
+
+#define PGSTATA_MSECS_PER_DAY INT64_C(86400000)
+
+/* Longest date or timestamp string remembered by the text decoder cache. */
+
+#define PGSTATA_DATE_CACHE_LEN 32
+
+/* Stata's system missing value, ., which is 2^1023 in every Stata. The
+ * decoders give it for NaN, infinities and +/-infinity dates. */
+
+#define PGSTATA_MISSVAL 0x1p1023
+
+/* Integers up to this magnitude are exact in a double. */
+
+#define PGSTATA_EXACT_INT_LIMIT (UINT64_C(1) << 53)
+
+/* The NUMERIC precision check compares values of up to this many significant
+ * digits with their doubles; longer ones count as losing precision. */
+
+#define PGSTATA_NUMERIC_CHECK_DIGITS 40
+
+/*
+ * Network-order integer accessors for the binary COPY format.
+ */
+
+static inline int16_t
+pgstata_get_int16 (const char *p)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    return (int16_t) ((u[0] << 8) | u[1]);
+}
+
+static inline int32_t
+pgstata_get_int32 (const char *p)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    return (int32_t) (((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16)
+                      | ((uint32_t) u[2] << 8) | (uint32_t) u[3]);
+}
+
+static inline int64_t
+pgstata_get_int64 (const char *p)
+{
+    return (int64_t) (((uint64_t) (uint32_t) pgstata_get_int32(p) << 32)
+                      | (uint64_t) (uint32_t) pgstata_get_int32(p + 4));
+}
+
+
+/*
+ * Each decoder turns one non-NULL value of a numeric column into the number
+ * to store in Stata. It returns 0 on success, -1 if the value can't be
+ * parsed, and 1 if the value was stored but can't be represented exactly
+ * (int8 values beyond 2^53, and with the _checked NUMERIC decoders, values
+ * which don't come back from the double to their last digit). The text
+ * decoders expect the value to be NUL-terminated; the binary ones read the
+ * LEN bytes of a binary COPY field.
+ */
+
+typedef int (*pgstata_decoder) (const char *val, const int len, double *out);
+
+int pgstata_decode_int_text (const char *val, const int len, double *out);
+int pgstata_decode_float_text (const char *val, const int len, double *out);
+int pgstata_decode_bool_text (const char *val, const int len, double *out);
+int pgstata_decode_date_text (const char *val, const int len, double *out);
+int pgstata_decode_timestamp_text (const char *val, const int len,
+                                   double *out);
+int pgstata_decode_numeric_text_checked (const char *val, const int len,
+                                         double *out);
+
+int pgstata_decode_bool_binary (const char *val, const int len, double *out);
+int pgstata_decode_int2_binary (const char *val, const int len, double *out);
+int pgstata_decode_int4_binary (const char *val, const int len, double *out);
+int pgstata_decode_int8_binary (const char *val, const int len, double *out);
+int pgstata_decode_float4_binary (const char *val, const int len,
+                                  double *out);
+int pgstata_decode_float8_binary (const char *val, const int len,
+                                  double *out);
+int pgstata_decode_numeric_binary (const char *val, const int len,
+                                   double *out);
+int pgstata_decode_numeric_binary_checked (const char *val, const int len,
+                                           double *out);
+int pgstata_decode_date_binary (const char *val, const int len, double *out);
+int pgstata_decode_timestamp_binary (const char *val, const int len,
+                                     double *out);
+
+// Parses the LEN bytes at VAL, which must also be NUL-terminated, as a
+// double, giving exactly what strtod() would; -1 if VAL isn't a number
+int pgstata_parse_double (const char *val, const int len, double *out);
+
+// Days from 1 Jan 1960 to a proleptic Gregorian date; YEAR is astronomical
+long pgstata_days_from_civil (long year, const int month, const int day);
+
+// How many of the LEN bytes of UTF-8 string VAL to keep so that there are
+// at most MAX_LEN, without cutting a character in half
+int pgstata_utf8_clip (const char *val, int len, const int max_len);
+
+#endif
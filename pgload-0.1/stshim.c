@@ -0,0 +1,629 @@
+// License blurb {{{
+
+/*
+    stshim - a stand-in for Stata, for running the pgload plugin outside it
+    Copyright (C) 2007 Andrew Chadwick
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License and the
+    GNU Lesser General Public License along with this program.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+// }}}
+// Library inclusions {{{
+
+/* For strdup() */
+#define _XOPEN_SOURCE 600
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stplugin.h"
+#include "stshim.h"
+
+// }}}
+// Settings and constants {{{
+
+/* Stata's system missing value, ., and the most arguments stshim_call()
+ * passes on. */
+
+#define STSHIM_MISSVAL 8.988465674311579e+307
+#define STSHIM_MAX_ARGS 64
+
+/* Return codes, as Stata gives them. */
+
+#define STSHIM_NOT_FOUND 111
+#define STSHIM_TYPE_MISMATCH 109
+#define STSHIM_OUT_OF_RANGE 503
+
+// }}}
+// Globals {{{
+
+// The plugin's entry point, in pg.c
+STDLL stata_call (int argc, char **argv);
+
+// A variable. Numeric ones hold doubles whatever their storage type; strN
+// ones hold WIDTH+1 bytes per observation. strLs hold nothing, as the plugin
+// interface can't store into them.
+typedef struct _stshim_var {
+    char    name[33];
+    char    type[8];
+    int     width;   // strN: N; strL: -1; numeric: 0
+    double *num;
+    char   *str;
+} stshim_var;
+
+// A macro, scalar or matrix, in a list by name
+typedef struct _stshim_named {
+    char   *name;
+    char   *text;      // macros
+    double  value;     // scalars
+    double *mat;       // matrices, ROWS by COLS in row order
+    int     rows;
+    int     cols;
+    struct _stshim_named *next;
+} stshim_named;
+
+ST_plugin     stshim_table;
+stshim_var   *stshim_vars = NULL;
+int           stshim_num_vars = 0;
+int           stshim_vars_len = 0;   // allocated length of stshim_vars
+int           stshim_num_obs = 0;
+int           stshim_obs_len = 0;    // observations allocated per variable
+stshim_named *stshim_macros = NULL;
+stshim_named *stshim_scalars = NULL;
+stshim_named *stshim_matrices = NULL;
+int           stshim_is_quiet = 0;
+int           stshim_stopflag = 0;
+char          stshim_error[1024];
+
+// }}}
+// Helper funcs {{{
+
+static stshim_named *
+stshim_find (stshim_named *list, const char *name)
+{
+    for (; list != NULL; list = list->next) {
+        if (strcmp(list->name, name) == 0) {
+            return list;
+        }
+    }
+    return NULL;
+}
+
+static stshim_named *
+stshim_find_or_add (stshim_named **list, const char *name)
+{
+    stshim_named *named = stshim_find(*list, name);
+    if (named != NULL) {
+        return named;
+    }
+    named = calloc(1, sizeof(*named));
+    if (named == NULL || (named->name = strdup(name)) == NULL) {
+        free(named);
+        return NULL;
+    }
+    named->next = *list;
+    *list = named;
+    return named;
+}
+
+static stshim_var *
+stshim_var_at (const int j, const int i)
+{
+    if (j < 1 || j > stshim_num_vars || i < 1 || i > stshim_num_obs) {
+        return NULL;
+    }
+    return &stshim_vars[j - 1];
+}
+
+static int
+stshim_type_width (const char *type)
+{
+    if (strcmp(type, "strL") == 0) {
+        return -1;
+    }
+    if (strncmp(type, "str", 3) == 0) {
+        return atoi(type + 3) > 0 ? atoi(type + 3) : 1;
+    }
+    return 0;
+}
+
+// Gives VAR room for LEN observations, the new ones missing or empty
+static int
+stshim_var_alloc (stshim_var *var, const int old_len, const int len)
+{
+    int i;
+    if (var->width > 0) {
+        char *str = realloc(var->str, (size_t) len * (var->width + 1));
+        if (str == NULL) {
+            return 1;
+        }
+        memset(str + (size_t) old_len * (var->width + 1), 0,
+               (size_t) (len - old_len) * (var->width + 1));
+        var->str = str;
+    }
+    else if (var->width == 0) {
+        double *num = realloc(var->num, (size_t) len * sizeof(double));
+        if (num == NULL) {
+            return 1;
+        }
+        for (i=old_len; i<len; ++i) {
+            num[i] = STSHIM_MISSVAL;
+        }
+        var->num = num;
+    }
+    return 0;
+}
+
+// }}}
+// The plugin interface {{{
+
+static ST_int
+stshim_display (char *text)
+{
+    if (! stshim_is_quiet) {
+        fputs(text, stdout);
+    }
+    return 0;
+}
+
+static ST_int
+stshim_display_error (char *text)
+{
+    snprintf(stshim_error, sizeof(stshim_error), "%s", text);
+    if (! stshim_is_quiet) {
+        fputs(text, stderr);
+    }
+    return 0;
+}
+
+static ST_int
+stshim_macro_save (char *name, char *text)
+{
+    stshim_named *macro = stshim_find_or_add(&stshim_macros, name);
+    char *copy = strdup(text);
+    if (macro == NULL || copy == NULL) {
+        free(copy);
+        return 1;
+    }
+    free(macro->text);
+    macro->text = copy;
+    return 0;
+}
+
+static ST_int
+stshim_macro_use (char *name, char *buf, ST_int len)
+{
+    const stshim_named *macro = stshim_find(stshim_macros, name);
+    if (len > 0) {
+        snprintf(buf, len, "%s", macro != NULL ? macro->text : "");
+    }
+    return 0;
+}
+
+static ST_int
+stshim_scalar_use (char *name, ST_double *value)
+{
+    const stshim_named *scalar = stshim_find(stshim_scalars, name);
+    if (scalar == NULL) {
+        return STSHIM_NOT_FOUND;
+    }
+    *value = scalar->value;
+    return 0;
+}
+
+static ST_int
+stshim_scalar_save (char *name, ST_double value)
+{
+    stshim_set_scalar(name, value);
+    return 0;
+}
+
+static ST_int
+stshim_mat_store (char *name, ST_int r, ST_int c, ST_double value)
+{
+    const stshim_named *mat = stshim_find(stshim_matrices, name);
+    if (mat == NULL) {
+        return STSHIM_NOT_FOUND;
+    }
+    if (r < 1 || r > mat->rows || c < 1 || c > mat->cols) {
+        return STSHIM_OUT_OF_RANGE;
+    }
+    mat->mat[(size_t) (r - 1) * mat->cols + c - 1] = value;
+    return 0;
+}
+
+static ST_int
+stshim_mat_el (char *name, ST_int r, ST_int c, ST_double *value)
+{
+    const stshim_named *mat = stshim_find(stshim_matrices, name);
+    if (mat == NULL) {
+        return STSHIM_NOT_FOUND;
+    }
+    if (r < 1 || r > mat->rows || c < 1 || c > mat->cols) {
+        return STSHIM_OUT_OF_RANGE;
+    }
+    *value = mat->mat[(size_t) (r - 1) * mat->cols + c - 1];
+    return 0;
+}
+
+static ST_int
+stshim_rows_of (char *name)
+{
+    const stshim_named *mat = stshim_find(stshim_matrices, name);
+    return mat != NULL ? mat->rows : 0;
+}
+
+static ST_int
+stshim_cols_of (char *name)
+{
+    const stshim_named *mat = stshim_find(stshim_matrices, name);
+    return mat != NULL ? mat->cols : 0;
+}
+
+static ST_int
+stshim_get_nobs (void)
+{
+    return stshim_num_obs;
+}
+
+static ST_int
+stshim_get_nvars (void)
+{
+    return stshim_num_vars;
+}
+
+static ST_int
+stshim_first_obs (void)
+{
+    return 1;
+}
+
+static ST_boolean
+stshim_selected (ST_int i)
+{
+    return 1;
+}
+
+static ST_boolean
+stshim_is_str (ST_int j)
+{
+    return j >= 1 && j <= stshim_num_vars && stshim_vars[j - 1].width != 0;
+}
+
+static ST_boolean
+stshim_is_missing (ST_double value)
+{
+    return value >= STSHIM_MISSVAL;
+}
+
+static ST_int
+stshim_poll (void)
+{
+    return 0;
+}
+
+static ST_int
+stshim_store (ST_int j, ST_int i, ST_double value)
+{
+    stshim_var *var = stshim_var_at(j, i);
+    if (var == NULL) {
+        return STSHIM_OUT_OF_RANGE;
+    }
+    if (var->width != 0) {
+        return STSHIM_TYPE_MISMATCH;
+    }
+    var->num[i - 1] = value;
+    return 0;
+}
+
+static ST_int
+stshim_sstore (ST_int j, ST_int i, char *text)
+{
+    stshim_var *var = stshim_var_at(j, i);
+    if (var == NULL) {
+        return STSHIM_OUT_OF_RANGE;
+    }
+    if (var->width <= 0) {
+        return STSHIM_TYPE_MISMATCH;
+    }
+    char *cell = var->str + (size_t) (i - 1) * (var->width + 1);
+    strncpy(cell, text, var->width);
+    cell[var->width] = '\000';
+    return 0;
+}
+
+static ST_int
+stshim_vdata (ST_int j, ST_int i, ST_double *value)
+{
+    stshim_var *var = stshim_var_at(j, i);
+    if (var == NULL) {
+        return STSHIM_OUT_OF_RANGE;
+    }
+    if (var->width != 0) {
+        return STSHIM_TYPE_MISMATCH;
+    }
+    *value = var->num[i - 1];
+    return 0;
+}
+
+static ST_double
+stshim_data (ST_int j, ST_int i)
+{
+    ST_double value = STSHIM_MISSVAL;
+    stshim_vdata(j, i, &value);
+    return value;
+}
+
+static ST_int
+stshim_sdata (ST_int j, ST_int i, char *text)
+{
+    stshim_var *var = stshim_var_at(j, i);
+    if (var == NULL) {
+        return STSHIM_OUT_OF_RANGE;
+    }
+    if (var->width <= 0) {
+        return STSHIM_TYPE_MISMATCH;
+    }
+    strcpy(text, var->str + (size_t) (i - 1) * (var->width + 1));
+    return 0;
+}
+
+// }}}
+// The driver's side {{{
+
+void
+stshim_init (void)
+{
+    memset(&stshim_table, 0, sizeof(stshim_table));
+    stshim_table.spoutsml = stshim_display;
+    stshim_table.spoutnosml = stshim_display;
+    stshim_table.spouterr = stshim_display_error;
+    stshim_table.macresave = stshim_macro_save;
+    stshim_table.macuse = stshim_macro_use;
+    stshim_table.scalaruse = stshim_scalar_use;
+    stshim_table.scalsave = stshim_scalar_save;
+    stshim_table.matstore = stshim_mat_store;
+    stshim_table.safematstore = stshim_mat_store;
+    stshim_table.matel = stshim_mat_el;
+    stshim_table.safematel = stshim_mat_el;
+    stshim_table.rowsof = stshim_rows_of;
+    stshim_table.colsof = stshim_cols_of;
+    stshim_table.nobs = stshim_get_nobs;
+    stshim_table.nobs1 = stshim_first_obs;
+    stshim_table.nobs2 = stshim_get_nobs;
+    stshim_table.nvar = stshim_get_nvars;
+    stshim_table.nvars = stshim_get_nvars;
+    stshim_table.missval = STSHIM_MISSVAL;
+    stshim_table.ismissing = stshim_is_missing;
+    stshim_table.isstr = stshim_is_str;
+    stshim_table.selobs = stshim_selected;
+    stshim_table.pollstd = stshim_poll;
+    stshim_table.pollnow = stshim_poll;
+    stshim_table.stopflag = &stshim_stopflag;
+    stshim_table.store = stshim_store;
+    stshim_table.safestore = stshim_store;
+    stshim_table.sstore = stshim_sstore;
+    stshim_table.data = stshim_data;
+    stshim_table.safedata = stshim_data;
+    stshim_table.vdata = stshim_vdata;
+    stshim_table.safevdata = stshim_vdata;
+    stshim_table.sdata = stshim_sdata;
+    pginit(&stshim_table);
+    stshim_clear();
+}
+
+int
+stshim_call (const char *cmd, ...)
+{
+    char *argv[STSHIM_MAX_ARGS];
+    int argc = 0;
+    const char *arg;
+    va_list ap;
+
+    argv[argc++] = (char *) cmd;
+    va_start(ap, cmd);
+    while ((arg = va_arg(ap, const char *)) != NULL
+           && argc < STSHIM_MAX_ARGS) {
+        argv[argc++] = (char *) arg;
+    }
+    va_end(ap);
+    *stshim_error = '\000';
+    return stata_call(argc, argv);
+}
+
+void
+stshim_quiet (const int quiet)
+{
+    stshim_is_quiet = quiet;
+}
+
+const char *
+stshim_last_error (void)
+{
+    return stshim_error;
+}
+
+void
+stshim_clear (void)
+{
+    int j;
+    for (j=0; j<stshim_num_vars; ++j) {
+        free(stshim_vars[j].num);
+        free(stshim_vars[j].str);
+    }
+    free(stshim_vars);
+    stshim_vars = NULL;
+    stshim_num_vars = 0;
+    stshim_vars_len = 0;
+    stshim_num_obs = 0;
+    stshim_obs_len = 0;
+}
+
+int
+stshim_add_var (const char *name, const char *type)
+{
+    if (stshim_num_vars == stshim_vars_len) {
+        int want = stshim_vars_len ? 2 * stshim_vars_len : 16;
+        stshim_var *grown = realloc(stshim_vars, want * sizeof(*grown));
+        if (grown == NULL) {
+            return 1;
+        }
+        stshim_vars = grown;
+        stshim_vars_len = want;
+    }
+    stshim_var *var = &stshim_vars[stshim_num_vars];
+    memset(var, 0, sizeof(*var));
+    snprintf(var->name, sizeof(var->name), "%s", name);
+    snprintf(var->type, sizeof(var->type), "%s", type);
+    var->width = stshim_type_width(type);
+    if (stshim_var_alloc(var, 0, stshim_obs_len)) {
+        return 1;
+    }
+    ++stshim_num_vars;
+    return 0;
+}
+
+int
+stshim_set_obs (const int nobs)
+{
+    int j;
+    if (nobs > stshim_obs_len) {
+        for (j=0; j<stshim_num_vars; ++j) {
+            if (stshim_var_alloc(&stshim_vars[j], stshim_obs_len, nobs)) {
+                return 1;
+            }
+        }
+        stshim_obs_len = nobs;
+    }
+    stshim_num_obs = nobs;
+    return 0;
+}
+
+/*
+ * Changes the type of variable NAME. A strN keeps its values when widened;
+ * a variable which changes between string and numeric starts again empty,
+ * which is as much as a benchmark needs.
+ */
+
+int
+stshim_recast (const char *name, const char *type)
+{
+    int j, i;
+    for (j=0; j<stshim_num_vars && strcmp(stshim_vars[j].name, name); ++j)
+        ;
+    if (j == stshim_num_vars) {
+        return STSHIM_NOT_FOUND;
+    }
+    stshim_var *var = &stshim_vars[j];
+    stshim_var recast = *var;
+    snprintf(recast.type, sizeof(recast.type), "%s", type);
+    recast.width = stshim_type_width(type);
+    if ((recast.width == 0) == (var->width == 0)
+        && (recast.width <= 0 || var->width <= 0)) {
+        *var = recast;
+        return 0;
+    }
+    recast.num = NULL;
+    recast.str = NULL;
+    if (stshim_var_alloc(&recast, 0, stshim_obs_len)) {
+        return 1;
+    }
+    if (recast.width > 0 && var->width > 0) {
+        for (i=0; i<stshim_obs_len; ++i) {
+            memcpy(recast.str + (size_t) i * (recast.width + 1),
+                   var->str + (size_t) i * (var->width + 1),
+                   var->width < recast.width ? var->width : recast.width);
+        }
+    }
+    free(var->num);
+    free(var->str);
+    *var = recast;
+    return 0;
+}
+
+int
+stshim_nobs (void)
+{
+    return stshim_num_obs;
+}
+
+int
+stshim_nvars (void)
+{
+    return stshim_num_vars;
+}
+
+double
+stshim_value (const int j, const int i)
+{
+    return stshim_data(j, i);
+}
+
+const char *
+stshim_string (const int j, const int i)
+{
+    const stshim_var *var = stshim_var_at(j, i);
+    if (var == NULL || var->width <= 0) {
+        return "";
+    }
+    return var->str + (size_t) (i - 1) * (var->width + 1);
+}
+
+const char *
+stshim_macro (const char *name)
+{
+    const stshim_named *macro = stshim_find(stshim_macros, name);
+    return macro != NULL ? macro->text : NULL;
+}
+
+void
+stshim_set_scalar (const char *name, const double value)
+{
+    stshim_named *scalar = stshim_find_or_add(&stshim_scalars, name);
+    if (scalar != NULL) {
+        scalar->value = value;
+    }
+}
+
+int
+stshim_set_matrix (const char *name, const int rows, const int cols)
+{
+    stshim_named *mat = stshim_find_or_add(&stshim_matrices, name);
+    double *values = calloc((size_t) rows * cols + 1, sizeof(double));
+    int i;
+    if (mat == NULL || values == NULL) {
+        free(values);
+        return 1;
+    }
+    for (i=0; i<rows * cols; ++i) {
+        values[i] = STSHIM_MISSVAL;
+    }
+    free(mat->mat);
+    mat->mat = values;
+    mat->rows = rows;
+    mat->cols = cols;
+    return 0;
+}
+
+double
+stshim_matrix_el (const char *name, const int r, const int c)
+{
+    ST_double value = STSHIM_MISSVAL;
+    stshim_mat_el((char *) name, r, c, &value);
+    return value;
+}
+
+// }}}
@@ -0,0 +1,72 @@
+// License blurb {{{
+
+/*
+    stshim - a stand-in for Stata, for running the pgload plugin outside it
+    Copyright (C) 2007 Andrew Chadwick
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License and the
+    GNU Lesser General Public License along with this program.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+// }}}
+
+#if !defined(STSHIM_H)
+#define STSHIM_H
+
+/*
+ * The shim fills in the plugin interface's ST_plugin table with an
+ * in-memory dataset, a store of macros, scalars and matrices, and output to
+ * stdout and stderr, so that pg.c can be linked into an ordinary program and
+ * driven through stata_call() the way the ADO wrappers drive it.
+ */
+
+// Installs the shim as the plugin's Stata, with an empty dataset
+void stshim_init (void);
+
+// Runs plugin command CMD with the arguments after it, up to a NULL, and
+// returns its return code
+int stshim_call (const char *cmd, ...);
+
+// With QUIET set, the plugin's output is kept back; the last error message
+// it gave is still kept for stshim_last_error()
+void stshim_quiet (const int quiet);
+const char *stshim_last_error (void);
+
+// The dataset: drops everything, adds a variable of Stata type TYPE (byte,
+// int, long, float, double, strN or strL), sets the number of observations,
+// and changes the type of variable NAME
+void stshim_clear (void);
+int stshim_add_var (const char *name, const char *type);
+int stshim_set_obs (const int nobs);
+int stshim_recast (const char *name, const char *type);
+int stshim_nobs (void);
+int stshim_nvars (void);
+
+// Values stored by the plugin, for checking its work: variable J (from 1)
+// of observation I (from 1)
+double stshim_value (const int j, const int i);
+const char *stshim_string (const int j, const int i);
+
+// A macro the plugin has saved, such as "_obs", or NULL if it hasn't
+const char *stshim_macro (const char *name);
+
+// Sets numeric scalar NAME, for the plugin to read
+void stshim_set_scalar (const char *name, const double value);
+
+// Makes matrix NAME of ROWS by COLS missing values, for the plugin to fill,
+// and reads element (R, C) of it back
+int stshim_set_matrix (const char *name, const int rows, const int cols);
+double stshim_matrix_el (const char *name, const int r, const int c);
+
+#endif